@@ -0,0 +1,35 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "fat32.h"
+
+/*
+ * Alocação de clusters sobre a FAT em memória (ver fattable.h), comum à linha
+ * de comando e à biblioteca. Nada aqui imprime ou encerra o processo: em erro,
+ * as funções retornam 0 com errno.
+ */
+
+struct fat32_newcluster_info
+{
+	uint32_t cluster; // Número do cluster alocado
+	uint64_t address; // Endereço da entrada do cluster na FAT
+};
+
+/* Reserva um cluster livre (ele fica reservado até receber um valor na FAT) */
+struct fat32_newcluster_info fat32_find_free_cluster(struct fat_image *img, struct fat_bpb *bpb);
+
+/* Procura `count` clusters livres consecutivos; retorna o primeiro ou 0 */
+uint32_t fat32_find_free_run(struct fat_image *img, struct fat_bpb *bpb, uint32_t count);
+
+/*
+ * Aloca e encadeia `count` clusters em trechos contíguos (best-fit), o último
+ * apontando para EOF. Se `clusters` não for NULL, recebe os clusters na ordem
+ * da cadeia, e *pieces o número de trechos contíguos que ela de fato tem.
+ * Retorna o primeiro cluster, ou 0 com errno (ENOSPC, ENOMEM); nesse caso nada
+ * fica alocado.
+ */
+uint32_t fat32_alloc_chain(struct fat_image *img, struct fat_bpb *bpb, uint32_t count, uint32_t *clusters, size_t *pieces);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Cache de blocos da imagem, com orçamento de memória fixo, descarte LRU e
+ * write-back: escritas ficam no bloco (sujo) até serem descarregadas por
+ * cache_flush() ou até o bloco ser descartado.
+ *
+ * A cache não sabe fazer E/S; quem a cria passa as funções de leitura e
+ * escrita do dispositivo. Ela também não tem trava própria: quem a usa
+ * serializa o acesso (a camada de imagem usa o mutex da imagem).
+ */
+
+#define CACHE_BLOCK (4 * 1024) /* tamanho de cada bloco (8 setores de 512 bytes) */
+
+#define CACHE_DEFAULT_BUDGET (8 * 1024 * 1024)
+
+typedef int (*cache_io_fn)(void *ctx, uint64_t offset, void *buf, size_t len);
+
+struct cache_block
+{
+	uint64_t number;  // offset / CACHE_BLOCK
+	uint8_t *data;
+	size_t   len;     // Bytes válidos (o último bloco da imagem pode ser curto)
+	bool     valid;   // Falso para blocos livres (fora da tabela hash)
+	bool     dirty;
+
+	struct cache_block *hnext;      // Encadeamento na tabela hash
+	struct cache_block *prev, *next; // Lista LRU (next = mais recente)
+};
+
+struct block_cache
+{
+	size_t capacity;  // Número de blocos que cabem no orçamento
+	size_t used;
+	uint64_t limit;   // Tamanho da imagem; nenhum bloco passa daqui
+
+	struct cache_block  *blocks; // Todos os blocos, alocados de uma vez
+	uint8_t             *pool;   // Dados dos blocos
+	struct cache_block **table;
+	size_t         table_mask;
+	struct cache_block     lru;  // Sentinela da lista LRU
+
+	cache_io_fn read, write;
+	void *ctx;
+
+	uint64_t hits, misses;
+	uint64_t writebacks; // Escritas de blocos sujos no disco (ver image_pread())
+};
+
+struct block_cache *cache_create(size_t budget, size_t align, uint64_t limit,
+                                 cache_io_fn read, cache_io_fn write, void *ctx);
+void cache_destroy(struct block_cache *);
+
+/* Leitura/escrita através da cache. Retornam 0 ou -1 (com errno). */
+int cache_read(struct block_cache *, uint64_t offset, void *buf, size_t len);
+int cache_write(struct block_cache *, uint64_t offset, const void *buf, size_t len);
+
+/* Escreve todos os blocos sujos, agrupando os adjacentes. */
+int cache_flush(struct block_cache *);
+
+/*
+ * Para E/S que passa por fora da cache: cache_overlay() copia para buf o que
+ * está sujo na cache, cache_update() atualiza as cópias em cache com o que foi
+ * escrito em disco e cache_invalidate() descarta os blocos do intervalo.
+ */
+void cache_overlay(struct block_cache *, uint64_t offset, void *buf, size_t len);
+void cache_update(struct block_cache *, uint64_t offset, const void *buf, size_t len);
+void cache_invalidate(struct block_cache *, uint64_t offset, size_t len);
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef CHAIN_H
+#define CHAIN_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "image.h"
+#include "fattable.h"
+
+struct fat_bpb;
+
+/*
+ * Mapa físico de um arquivo: a cadeia que começa no primeiro cluster
+ * (starting_cluster_low | ea_index << 16), resolvida numa lista de trechos de
+ * clusters consecutivos no disco. Quem move dados faz uma E/S por trecho, em
+ * vez de uma por cluster.
+ *
+ * Os mapas ficam numa cache por imagem, indexada pelo primeiro cluster, com
+ * descarte LRU. Um mapa vale enquanto a FAT não mudar: qualquer fat_set()
+ * troca a geração da tabela, e o mapa é resolvido de novo na próxima consulta.
+ */
+
+#define CHAIN_CACHE_SIZE 64 /* arquivos com mapa em cache, por imagem */
+
+struct chain_extent
+{
+	uint32_t first;  // Primeiro cluster do trecho
+	uint32_t length; // Clusters no trecho
+	uint32_t index;  // Posição do primeiro cluster na cadeia (0 = início do arquivo)
+};
+
+struct chain
+{
+	uint32_t start;    // Primeiro cluster (0 = arquivo vazio)
+	uint32_t clusters; // Clusters na cadeia inteira
+
+	struct chain_extent *extents;
+	size_t   count;
+	size_t   cap;
+
+	uint64_t generation; // Geração da FAT quando foi resolvida
+	uint64_t used;       // Para o descarte LRU
+};
+
+struct chain_cache
+{
+	pthread_mutex_t lock;
+	struct chain slots[CHAIN_CACHE_SIZE];
+	uint64_t     tick;
+
+	uint64_t hits;
+	uint64_t misses;
+};
+
+/*
+ * Resolve a cadeia a partir de `start` em `chain` (reaproveitando a memória
+ * que ela já tiver). A cadeia acaba no EOF ou em qualquer valor fora da região
+ * de dados. Retorna 0, ou -1 com errno ELOOP se a cadeia tiver ciclo e ENOMEM
+ * se faltar memória.
+ */
+int chain_resolve(struct fat_table *, uint32_t start, struct chain *);
+void chain_free(struct chain *);
+
+struct chain_cache *chain_cache_create(void);
+void chain_cache_free(struct chain_cache *);
+
+/*
+ * Mapa da cadeia que começa em `start`, da cache da imagem. O ponteiro vale
+ * até a próxima alteração da FAT ou até CHAIN_CACHE_SIZE outras consultas, então
+ * só serve a quem usa a imagem sozinho. Retorna NULL em erro (com errno).
+ */
+const struct chain *chain_get(struct fat_image *, uint32_t start);
+
+/*
+ * Como chain_get(), mas copia o mapa para `out`, que é do chamador (começa
+ * zerado e é liberado com chain_free()). Serve a várias threads ao mesmo
+ * tempo: a cache é consultada sob a sua trava, e a cópia custa só os trechos.
+ * Retorna 0 ou -1 (com errno).
+ */
+int chain_lookup(struct fat_image *, uint32_t start, struct chain *out);
+
+/*
+ * Posição de leitura dentro de um mapa. chain_span() dá o endereço e o
+ * tamanho do trecho contíguo a partir da posição atual (0 no fim da cadeia);
+ * chain_advance() anda `len` bytes, no máximo até o fim desse trecho.
+ * chain_seek() vai direto para o byte `offset` do arquivo com uma busca
+ * binária nos trechos, sem percorrer a cadeia.
+ */
+struct chain_cursor
+{
+	const struct chain *chain;
+	size_t   extent; // Trecho atual
+	uint64_t offset; // Bytes já percorridos dentro dele
+};
+
+void chain_begin(struct chain_cursor *, const struct chain *);
+uint64_t chain_span(struct chain_cursor *, struct fat_bpb *, uint64_t *address);
+void chain_advance(struct chain_cursor *, struct fat_bpb *, uint64_t len);
+void chain_seek(struct chain_cursor *, struct fat_bpb *, uint64_t offset);
+
+#endif
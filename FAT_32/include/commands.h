@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include "fat32.h"
+#include "alloc.h"
 
 /*
  * Esta struct encapsula o resultado de find(), carregando informações sobre a
@@ -13,6 +14,7 @@ struct far_dir_searchres
 	struct fat_dir fdir; // Diretório encontrado
 	bool          found; // Encontrou algo?
 	int             idx; // Index relativo ao diretório de busca
+	uint64_t    address; // Endereço da entrada na imagem
 };
 
 /*
@@ -25,36 +27,52 @@ struct fat16_newcluster_info
 	uint32_t address;
 };
 
-struct fat32_newcluster_info
- {
-    uint32_t cluster; // Número do cluster alocado
-    uint32_t address; // Endereço físico onde o cluster está armazenado
-};
-
-/* list files in fat_bpb */
-struct fat_dir *ls(FILE *, struct fat_bpb *);
+/* Lista o diretório raiz, imprimindo cada entrada assim que o cluster dela é lido */
+void ls(struct fat_image *, struct fat_bpb *);
 
 /* move um arquivo da fonte ao destino */
-void mv(FILE* fp, char* source, char* dest, struct fat_bpb* bpb);
+void mv(struct fat_image* img, char* source, char* dest, struct fat_bpb* bpb);
 
 /* delete the file from the fat directory */
-void rm(FILE* fp, char* filename, struct fat_bpb* bpb);
+void rm(struct fat_image* img, char* filename, struct fat_bpb* bpb);
 
 /* copy the file to the fat directory */
-void cp(FILE* fp, char* source, char* dest, struct fat_bpb* bpb);
+void cp(struct fat_image* img, char* source, char* dest, struct fat_bpb* bpb);
 
 /*
  * Esta função escreve no terminal os conteúdos de um arquivo.
  */
-void cat(FILE* fp, char* filename, struct fat_bpb* bpb);
+void cat(struct fat_image* img, char* filename, struct fat_bpb* bpb);
 
-/* helper function: find specific filename in fat_dir */
-struct far_dir_searchres find_in_root(struct fat_dir *dirs, char *filename, struct fat_bpb *bpb);
+/*
+ * Como cat(), mas só os `length` bytes a partir de `offset` (cortados no fim
+ * do arquivo). A posição é achada no mapa da cadeia (ver chain.h), sem
+ * percorrer os clusters anteriores.
+ */
+void cat_range(struct fat_image* img, char* filename, struct fat_bpb* bpb, uint64_t offset, uint64_t length);
+
+/*
+ * Esta função copia um arquivo da imagem para um arquivo do host.
+ */
+void export(struct fat_image* img, char* source, char* dest, struct fat_bpb* bpb);
+
+/*
+ * Esta função copia um arquivo do host para dentro da imagem.
+ */
+void import(struct fat_image* img, char* source, char* dest, struct fat_bpb* bpb);
+
+/* helper function: find specific filename in the root directory (idx is the entry index) */
+struct far_dir_searchres find_in_root(struct fat_image *img, char *filename, struct fat_bpb *bpb);
 
 /* Procura cluster vazio */
-struct fat16_newcluster_info fat16_find_free_cluster(FILE* fp, struct fat_bpb* bpb);
+struct fat16_newcluster_info fat16_find_free_cluster(struct fat_image* img, struct fat_bpb* bpb);
 
-struct fat32_newcluster_info fat32_find_free_cluster(FILE* fp, struct fat_bpb* bpb);
+/*
+ * E/S da linha de comando sobre image_pread()/image_pwrite(): em erro, avisam
+ * na stderr e retornam RB_ERROR.
+ */
+int read_bytes(struct fat_image *, uint64_t, void *, unsigned int);
+int write_bytes(struct fat_image *, uint64_t, const void *, unsigned int);
 
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
 
@@ -0,0 +1,73 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdint.h>
+
+/*
+ * Modo daemon: as imagens ficam abertas (FAT, cache de blocos e mapas de
+ * arquivos em memória) e os pedidos chegam por um socket Unix. Cada conexão
+ * manda quantos pedidos quiser, um depois do outro, e recebe uma resposta por
+ * pedido, na mesma ordem. As conexões são atendidas ao mesmo tempo por um
+ * conjunto fixo de threads, todas sobre os mesmos volumes, um pedido de cada
+ * vez: entre dois pedidos a conexão não ocupa nenhuma thread.
+ *
+ * Os números vão na ordem de bytes da máquina: cliente e daemon estão sempre
+ * no mesmo host.
+ */
+
+#define DAEMON_MAGIC   0x3233424Fu /* "OB32" */
+#define DAEMON_CHUNK   (1024 * 1024) /* Bytes por leitura/escrita ao mover dados */
+#define DAEMON_BACKLOG 64 /* Conexões com pedido esperando uma thread livre */
+
+enum daemon_op
+{
+	DAEMON_LS = 1, // Entradas do diretório raiz: `count` struct daemon_entry
+	DAEMON_CAT,    // `length` bytes de `name` a partir de `offset`
+	DAEMON_CP,     // Copia `name` para `dest`, dentro da mesma imagem
+	DAEMON_RM,     // Remove `name`
+	DAEMON_MV,     // Renomeia `name` para `dest`
+	DAEMON_IMPORT, // Cria `name` com os `length` bytes que seguem o pedido
+	DAEMON_EXPORT, // O arquivo `name` inteiro
+	DAEMON_FLUSH,  // Grava na imagem as alterações feitas até aqui
+};
+
+#pragma pack(push, 1)
+
+/* Seguem o pedido: `name_len` bytes de nome, `dest_len` de destino e, no import, os dados. */
+struct daemon_request
+{
+	uint32_t magic;
+	uint8_t  op;
+	uint8_t  volume;   // Índice da imagem, na ordem da linha de comando
+	uint8_t  name_len;
+	uint8_t  dest_len;
+	uint64_t offset;
+	uint64_t length;
+};
+
+/* Seguem a resposta: `length` bytes de dados (só quando status == 0). */
+struct daemon_response
+{
+	int32_t  status;  // 0 ou -errno
+	uint32_t count;   // Entradas (ls)
+	uint64_t length;
+};
+
+struct daemon_entry
+{
+	char     name[13]; // "NOME.EXT", terminado em '\0'
+	uint8_t  attr;
+	uint32_t size;
+	uint32_t cluster;
+};
+
+#pragma pack(pop)
+
+/*
+ * Abre as `n` imagens, escuta em `socket_path` e atende com `workers` threads
+ * até receber SIGINT ou SIGTERM; aí descarrega e fecha as imagens. Retorna o
+ * código de saída do processo.
+ */
+int daemon_run(const char *socket_path, char **images, int n, int flags, unsigned workers);
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "fat32.h"
+#include "chain.h"
+
+#define DIR_INDEX_CACHE_SIZE 4 /* diretórios com índice de nomes, por imagem */
+
+/*
+ * Leitura de um diretório em fluxo: a cadeia do diretório vem do mapa
+ * (chain.h), um cluster é lido por vez com uma única E/S, e dir_next() devolve
+ * as entradas direto desse buffer. A memória não depende do tamanho do
+ * diretório: só o buffer de um cluster e o mapa da cadeia. A leitura para na
+ * primeira entrada com name[0] == 0, que marca o fim, ou no fim da cadeia.
+ *
+ *     struct dir_iter it;
+ *     const struct fat_dir *entry;
+ *
+ *     if (dir_open(&it, img, bpb, cluster) != 0) ...
+ *     while ((entry = dir_next(&it)) != NULL) ...
+ *     if (it.error != 0) ...
+ *     dir_close(&it);
+ */
+struct dir_iter
+{
+	struct fat_image   *img;
+	struct fat_bpb     *bpb;
+	struct chain        chain;  // Mapa da cadeia do diretório
+	struct chain_cursor cursor; // Próximo cluster a ler
+
+	struct fat_dir *buffer;      // Cluster atual
+	size_t          per_cluster; // Entradas por cluster
+	size_t          next;        // Próxima entrada dentro do buffer
+	size_t          first;       // Posição no diretório da primeira entrada do buffer
+	uint64_t        base;        // Endereço do cluster atual (0 antes do primeiro)
+
+	size_t   index;   // Posição no diretório da última entrada devolvida (no fim, a seguinte)
+	uint64_t address; // Endereço dela na imagem
+	uint64_t end;     // Endereço da marca de fim (0 se a cadeia acabou sem ela)
+	bool     done;
+	int      error;   // errno, se a leitura parou por erro
+};
+
+/* Prepara a leitura do diretório que começa em `cluster`. Retorna 0, ou -1 com errno. */
+int dir_open(struct dir_iter *, struct fat_image *, struct fat_bpb *, uint32_t cluster);
+
+/*
+ * Próxima entrada, apagadas e de nome longo incluídas. O ponteiro aponta para
+ * o buffer e vale até a próxima chamada. Retorna NULL no fim do diretório ou
+ * em erro (com o errno em `error`).
+ */
+const struct fat_dir *dir_next(struct dir_iter *);
+
+/*
+ * Como dir_next(), mas pula direto para a próxima entrada chamada `name` (11
+ * bytes, no formato FAT32) ou para a próxima apagada, varrendo o buffer com
+ * dir_scan_name() e dir_scan_free() (ver dirscan.h).
+ */
+const struct fat_dir *dir_next_named(struct dir_iter *, const char *name);
+const struct fat_dir *dir_next_free(struct dir_iter *);
+
+void dir_close(struct dir_iter *);
+
+/*
+ * Endereço de uma entrada livre para um arquivo novo no diretório que começa
+ * em `cluster`: a primeira apagada, a marca de fim ou, com a cadeia cheia, o
+ * início de um cluster novo, zerado e emendado no fim do diretório. Se `index`
+ * não for NULL, recebe a posição dela no diretório. Retorna 0 com errno se não
+ * houver espaço.
+ */
+uint64_t dir_free_slot(struct fat_image *, struct fat_bpb *, uint32_t cluster, size_t *index);
+
+/*
+ * Índice de nomes: uma tabela hash, por diretório, do nome 8.3 (11 bytes) para
+ * a posição da entrada. É montada com uma leitura do diretório na primeira
+ * busca e depois mantida por quem altera as entradas, então cada busca custa
+ * O(1) (mais a leitura da entrada, que passa pela cache de blocos) seja qual
+ * for o tamanho do diretório. Entradas apagadas, de nome longo e o rótulo do
+ * volume não entram; com nomes repetidos, vale a primeira entrada.
+ *
+ * Os índices ficam numa cache por imagem, indexada pelo primeiro cluster do
+ * diretório, com descarte LRU e uma trava própria.
+ */
+enum dir_name_state
+{
+	DIR_NAME_EMPTY, // Nunca usada: a busca para aqui
+	DIR_NAME_USED,
+	DIR_NAME_GONE,  // Nome removido: a busca continua
+};
+
+struct dir_name
+{
+	char     name[FAT32STR_SIZE];
+	uint8_t  state;   // DIR_NAME_EMPTY, DIR_NAME_USED ou DIR_NAME_GONE
+	uint32_t index;   // Posição da entrada no diretório
+	uint64_t address; // Endereço dela na imagem
+};
+
+struct dir_index
+{
+	uint32_t         cluster;  // Primeiro cluster do diretório (0 = sem índice)
+	struct dir_name *table;
+	size_t           cap;      // Potência de 2
+	size_t           used;     // Nomes na tabela
+	size_t           gone;     // Posições de nomes removidos
+	bool             repeated; // Há nomes em mais de uma entrada
+	uint64_t         last;     // Para o descarte LRU
+};
+
+struct dir_index_cache
+{
+	pthread_mutex_t  lock;
+	struct dir_index slots[DIR_INDEX_CACHE_SIZE];
+	uint64_t         tick;
+};
+
+/* Uma entrada achada pelo índice */
+struct dir_location
+{
+	struct fat_dir entry;
+	size_t         index;
+	uint64_t       address;
+};
+
+struct dir_index_cache *dir_index_cache_create(void);
+void dir_index_cache_free(struct dir_index_cache *);
+
+/*
+ * Procura `name` (no formato FAT32) no diretório que começa em `cluster`,
+ * montando o índice se preciso. A entrada é relida do disco; se não tiver mais
+ * o nome, o índice estava velho e é montado de novo. Retorna 1 se achou (em
+ * *loc), 0 se não, ou -1 com errno.
+ */
+int dir_index_find(struct fat_image *, struct fat_bpb *, uint32_t cluster, const char *name, struct dir_location *loc);
+
+/*
+ * Avisa o índice de que a entrada `index` (em `address`) do diretório deixou
+ * de se chamar `old` e passou a se chamar `new`: NULL em `old` é uma criação,
+ * e em `new`, uma remoção. Quem grava entradas de diretório chama isso depois
+ * de cada gravação. Sem índice montado para o diretório, não faz nada; se
+ * faltar memória, o índice é descartado e montado de novo na próxima busca.
+ */
+void dir_index_update(struct fat_image *, uint32_t cluster, const char *old, const char *new,
+                      size_t index, uint64_t address);
+
+#endif
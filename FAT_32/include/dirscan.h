@@ -0,0 +1,38 @@
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+
+#include <stddef.h>
+#include "fat32.h"
+
+/*
+ * Varredura de um cluster de diretório. As entradas têm 32 bytes, com o nome
+ * (11 bytes) no início, então os nomes de várias entradas são comparados de
+ * uma vez com SSE2 ou AVX2. O conjunto de instruções é escolhido na primeira
+ * chamada, conforme a CPU: AVX2 se houver, senão SSE2 (sempre presente em
+ * x86-64); nas outras arquiteturas, a versão escalar.
+ *
+ * As duas funções param na marca de fim (name[0] == 0): as entradas depois
+ * dela não contam.
+ */
+
+/* Primeira entrada de `entries[0, count)` chamada `name` (11 bytes, no formato FAT32) ou que marca o fim; `count` se nenhuma. */
+size_t dir_scan_name(const struct fat_dir *entries, size_t count, const char *name);
+
+/* Primeira entrada apagada (DIR_FREE_ENTRY) ou que marca o fim; `count` se nenhuma. */
+size_t dir_scan_free(const struct fat_dir *entries, size_t count);
+
+/*
+ * Troca a implementação escolhida por uma específica (os testes comparam as
+ * três entre si). Retorna 0, ou -1 com ENOTSUP se a CPU ou a arquitetura não
+ * tiver esse conjunto. Não pode ser chamada com varreduras em andamento.
+ */
+enum dir_scan_isa
+{
+	DIR_SCAN_SCALAR,
+	DIR_SCAN_SSE2,
+	DIR_SCAN_AVX2,
+};
+
+int dir_scan_use(enum dir_scan_isa isa);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Conjunto de trechos (extents) de clusters livres, indexado duas vezes: por
+ * início, para juntar vizinhos ao liberar, e por tamanho, para achar o menor
+ * trecho em que um pedido cabe (best-fit). Cada trecho é um nó que está nas
+ * duas árvores ao mesmo tempo; as árvores são treaps (árvores de busca com
+ * prioridades aleatórias, balanceadas em média), então inserir, tirar ou
+ * dividir um trecho custa O(log n), seja qual for a fragmentação.
+ */
+
+struct extent
+{
+	uint32_t start;
+	uint32_t length;
+};
+
+#define EXTENT_BY_START  0
+#define EXTENT_BY_LENGTH 1
+
+struct extent_node
+{
+	struct extent       e;
+	uint32_t            priority;
+	struct extent_node *child[2][2]; // [árvore][esquerda/direita]
+};
+
+struct extent_set
+{
+	struct extent_node *root[2]; // EXTENT_BY_START e EXTENT_BY_LENGTH
+	size_t   count;
+	uint32_t seed;               // Gerador das prioridades
+};
+
+/* Monta o conjunto a partir de trechos ordenados, disjuntos e não vizinhos. */
+int extent_set_build(struct extent_set *, const struct extent *sorted, size_t n);
+void extent_set_free(struct extent_set *);
+
+/* Devolve [start, start + length) ao conjunto, juntando com os vizinhos. */
+int extent_set_insert(struct extent_set *, uint32_t start, uint32_t length);
+
+/* Tira [start, start + length) do conjunto; -1 (ENOENT) se não estiver contido num trecho. */
+int extent_set_erase(struct extent_set *, uint32_t start, uint32_t length);
+
+/* Primeiro valor >= `from` contido em algum trecho, ou 0 se não houver. */
+uint32_t extent_set_next(struct extent_set *, uint32_t from);
+
+/*
+ * Planeja a alocação de `count` clusters, sem alterar o conjunto: um só trecho
+ * (o menor em que cabe) se possível; senão, os maiores trechos até completar,
+ * com o último pedaço de novo por best-fit. Retorna o número de pedaços
+ * escritos em out (no máximo `max`), ou 0 se não houver espaço.
+ */
+size_t extent_set_plan(struct extent_set *, uint32_t count, struct extent *out, size_t max);
+
+#endif
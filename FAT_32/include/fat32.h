@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include "image.h"
 
 #define DIR_FREE_ENTRY 0xE5
 
@@ -71,25 +72,26 @@ struct fat_bpb {
 #pragma pack(pop)
 
 /* Prototypes for reading and manipulating FAT32 */
-int read_bytes(FILE *, unsigned int, void *, unsigned int);
-void rfat(FILE *, struct fat_bpb *);
-
-/* Prototypes for calculating FAT32 offsets and addresses */
-uint32_t bpb_fat_address(struct fat_bpb *);
-uint32_t bpb_root_dir_address(struct fat_bpb *);
-uint32_t next_cluster(FILE *fp, struct fat_bpb *bpb, uint32_t cluster);
-uint32_t bpb_data_address(struct fat_bpb *);
+int rfat(struct fat_image *, struct fat_bpb *);
+
+/* Prototypes for calculating FAT32 offsets and addresses (64 bits) */
+uint64_t bpb_fat_address(struct fat_bpb *);
+uint64_t bpb_root_dir_address(struct fat_bpb *);
+uint64_t bpb_data_address(struct fat_bpb *);
+uint64_t bpb_froot_addr(struct fat_bpb *bpb);
+uint64_t bpb_faddress(struct fat_bpb *);
+uint64_t bpb_fdata_addr(struct fat_bpb *bpb);
+// Função para calcular o endereço físico de um cluster (FAT32)
+uint64_t cluster_to_address(uint32_t cluster, struct fat_bpb *bpb);
+// Endereço da entrada de um cluster em uma das cópias da FAT
+uint64_t fat_entry_address(uint32_t cluster, uint8_t copy, struct fat_bpb *bpb);
+
+uint32_t next_cluster(struct fat_image *img, struct fat_bpb *bpb, uint32_t cluster);
+uint32_t fat_dir_cluster(const struct fat_dir *);
 uint32_t bpb_data_sector_count(struct fat_bpb *);
 uint32_t bpb_data_cluster_count(struct fat_bpb *bpb);
-uint32_t bpb_froot_addr(struct fat_bpb *bpb);  // Apenas a declaração, sem definição.
-uint32_t bpb_faddress(struct fat_bpb *);
-// Função que encontra um cluster livre e retorna informações sobre ele
 uint32_t bpb_fdata_cluster_count(struct fat_bpb *bpb);
-uint32_t bpb_fdata_addr(struct fat_bpb *bpb);
 uint32_t bpb_fdata_sector_count(struct fat_bpb *);
-// Função para calcular o endereço físico de um cluster (FAT32)
-uint32_t bpb_fdata_sector_count(struct fat_bpb *bpb);
-uint32_t cluster_to_address(uint32_t cluster, struct fat_bpb *bpb);
 uint32_t bpb_fdata_sector_count_s(struct fat_bpb *bpb);
 
 ///
@@ -0,0 +1,168 @@
+#ifndef FATTABLE_H
+#define FATTABLE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "image.h"
+#include "extent.h"
+
+struct fat_bpb;
+
+/*
+ * Cópia da FAT em memória. É carregada inteira em rfat(); leituras de entradas
+ * não fazem E/S, e alterações marcam o setor da FAT como sujo. Na descarga, os
+ * setores sujos vão para todas as cópias da FAT em disco, em escritas
+ * agrupadas.
+ *
+ * Há duas representações. A expandida guarda um uint32_t por cluster. A
+ * compacta, usada com IMAGE_COMPACT_FAT ou quando a FAT passa de
+ * FAT_COMPACT_THRESHOLD, guarda a tabela como trechos ordenados: num trecho
+ * encadeado, cada cluster aponta para o seguinte e o último para `next`; num
+ * trecho uniforme (livres, EOFs seguidos...), todas as entradas valem `next`.
+ * Arquivos quase contíguos custam poucos trechos, e a busca é binária.
+ *
+ * Junto da tabela fica o espaço livre como trechos (ver extent.h) e, na
+ * representação expandida, também um bitmap de clusters livres (um bit por
+ * cluster), ambos mantidos por fat_set(), além dos campos do setor FSInfo:
+ * quantidade de clusters livres e a dica de onde começar a procurar, gravados
+ * de volta na descarga. A compacta não tem bitmap, para não gastar memória
+ * proporcional ao volume: os trechos livres são montados direto dos trechos
+ * da FAT e guardam só os clusters livres e não reservados.
+ *
+ * Concorrência: o bitmap é atômico. Na expandida, fat_claim(), fat_reserve()
+ * e fat_release() reservam e devolvem clusters com compare-and-swap, sem
+ * trava; na compacta, tiram e devolvem o cluster dos trechos sob `lock`. Cada
+ * thread procura a partir do seu próprio cursor. O resto (entradas, trechos,
+ * setores sujos, descarga) fica sob `lock`, tomado por fat_set(),
+ * fat_plan_extents() e fat_table_flush(). Cada thread só altera as entradas
+ * dos clusters que reservou.
+ *
+ * fat_get() e fat_follow() não tomam a trava em nenhuma das representações.
+ * Na expandida, as entradas são atômicas e lidas e gravadas com
+ * memory_order_relaxed: um leitor vê o valor antigo ou o novo. Na compacta, fat_set() marca a alteração dos trechos num seqlock (`seq`), e
+ * o leitor refaz a busca se ela mudou no meio. Quando o vetor de trechos
+ * cresce, o antigo não é liberado (um leitor pode estar nele) até
+ * fat_table_free().
+ */
+
+#define FAT_COMPACT_THRESHOLD (64 * 1024 * 1024)
+
+#define FAT_RUN_UNIFORM 0x80000000u /* bit de `length`: trecho uniforme */
+
+#define FAT_CURSOR_TABLES 4 /* tabelas com cursor de fat_claim() guardado, por thread */
+
+struct fat_run
+{
+	uint32_t start;
+	uint32_t length; // Com FAT_RUN_UNIFORM no bit mais alto
+	uint32_t next;   // Valor da última entrada (ou de todas, se uniforme)
+};
+
+struct fat_table
+{
+	_Atomic uint32_t *entries; // Representação expandida: NULL na compacta
+
+	struct fat_run *_Atomic runs; // Representação compacta, cobrindo [0, count)
+	_Atomic size_t   nruns;
+	size_t           runs_cap;
+	struct fat_run **retired;     // Vetores de trechos substituídos, liberados com a tabela
+	size_t           nretired;
+	size_t           retired_size; // Bytes neles
+	_Atomic uint64_t seq;          // Ímpar enquanto os trechos mudam (seqlock)
+
+	uint32_t  count;       // Número de entradas
+	uint32_t  limit;       // Primeiro cluster além da região de dados
+
+	_Atomic uint64_t *free_map;  // Bit ligado = cluster livre (e não reservado); NULL na compacta
+	struct extent_set free_extents;
+	_Atomic uint32_t  free_count;
+	_Atomic uint32_t  next_free; // Dica: a busca por cluster livre começa aqui
+	uint64_t          fsinfo;    // Endereço do FSInfo (0 se o volume não tem um válido)
+	atomic_bool       fsinfo_dirty;
+
+	_Atomic uint64_t  generation; // Muda a cada alteração de entrada
+	uint64_t          id;         // Único no processo: chave dos cursores de fat_claim()
+	atomic_uint       claimers;   // Threads que já procuraram nesta tabela
+
+	pthread_mutex_t lock;
+	uint32_t  sector_size;
+	uint32_t  sectors;     // Setores por cópia
+	uint64_t *dirty;       // Um bit por setor
+	uint32_t  ndirty;      // Setores sujos
+
+	uint64_t  address;     // Endereço da primeira cópia
+	uint64_t  copy_size;   // Bytes por cópia
+	uint8_t   copies;      // Cópias a manter em dia
+	uint8_t   first_copy;  // Primeira delas (sem espelhamento, só a ativa)
+};
+
+struct fat_table *fat_table_load(struct fat_image *, struct fat_bpb *);
+void fat_table_free(struct fat_table *);
+
+/* Escreve os setores sujos em todas as cópias. Retorna 0 ou -1 (com errno). */
+int fat_table_flush(struct fat_image *, struct fat_table *);
+
+/* Memória usada pela tabela, em bytes */
+size_t fat_table_memory(struct fat_table *);
+
+/* Entrada de `cluster` com a máscara de 28 bits; EOF fora da tabela. */
+uint32_t fat_get(struct fat_table *, uint32_t cluster);
+
+/*
+ * Quantos clusters, a partir de `cluster`, seguem em sequência física na
+ * cadeia (cada um apontando para o seguinte). Em *next fica a entrada do
+ * último deles. Na representação compacta, trechos encadeados são pulados
+ * inteiros.
+ */
+uint32_t fat_follow(struct fat_table *, uint32_t cluster, uint32_t *next);
+
+/*
+ * Altera a entrada de `cluster`. Na representação expandida os 4 bits
+ * reservados são preservados; na compacta eles são relidos do disco na
+ * descarga. Retorna 0, ou -1 se faltar memória para dividir um trecho.
+ */
+int fat_set(struct fat_table *, uint32_t cluster, uint32_t value);
+
+/*
+ * Cluster livre a partir da dica do FSInfo (dando a volta no fim do volume),
+ * ou 0 se o volume estiver cheio. Não reserva nada: o cluster passa a estar
+ * em uso quando recebe um valor com fat_set().
+ */
+uint32_t fat_alloc(struct fat_table *);
+
+/*
+ * Reserva um cluster livre sem trava: procura a partir do cursor da thread e
+ * toma o bit com compare-and-swap. Retorna 0 se o volume estiver cheio. O
+ * cluster fica reservado até receber um valor com fat_set(). Cada thread tem
+ * um cursor por tabela (até FAT_CURSOR_TABLES tabelas ao mesmo tempo), então
+ * uma thread que aloca em várias imagens não mistura as posições.
+ */
+uint32_t fat_claim(struct fat_table *);
+
+/* Reserva `cluster` se ainda estiver livre. Retorna false se não estava. */
+bool fat_reserve(struct fat_table *, uint32_t cluster);
+
+/* Devolve ao bitmap (ou aos trechos, na compacta) um cluster reservado e não usado. */
+void fat_release(struct fat_table *, uint32_t cluster);
+
+/* Primeiro cluster livre em [from, fim), ou 0. */
+uint32_t fat_next_free(struct fat_table *, uint32_t from);
+
+/*
+ * Primeiro de `count` clusters livres consecutivos, ou 0. Na compacta, o
+ * início do menor trecho livre em que cabem.
+ */
+uint32_t fat_find_free_run(struct fat_table *, uint32_t count);
+
+/*
+ * Planeja `count` clusters em trechos contíguos: o menor trecho livre em que
+ * o arquivo inteiro cabe, ou então os maiores trechos até completar. Não
+ * reserva nada. O plano é montado sob a trava, num vetor alocado aqui (liberar
+ * com free()), com os pedaços em *n. Retorna NULL com errno (ENOSPC, ENOMEM).
+ */
+struct extent *fat_plan_extents(struct fat_table *, uint32_t count, size_t *n);
+
+#endif
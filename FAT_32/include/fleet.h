@@ -0,0 +1,38 @@
+#ifndef FLEET_H
+#define FLEET_H
+
+/*
+ * Modo frota: a mesma operação em muitas imagens, distribuídas entre um
+ * conjunto fixo de threads. Cada thread abre uma imagem por vez, então nunca
+ * há mais imagens abertas do que threads (e as threads são limitadas pelo
+ * RLIMIT_NOFILE). Cada linha da saída começa com o caminho da imagem; as
+ * linhas de imagens diferentes podem se intercalar, mas nunca se misturam.
+ */
+
+#define FLEET_FDS_PER_IMAGE 2  /* descritores por imagem aberta (imagem e folga) */
+#define FLEET_FDS_RESERVED  16 /* descritores que ficam para o resto do processo */
+
+enum fleet_op
+{
+	FLEET_LS,    // Entradas do diretório raiz
+	FLEET_CAT,   // Conteúdo de um arquivo
+	FLEET_CHECK, // Consistência das cadeias e das cópias da FAT
+};
+
+/*
+ * Expande a lista de imagens: "@arquivo" lê um caminho por linha ("@-" lê da
+ * entrada padrão), e padrões com '*', '?' ou '[' passam pelo glob(3). Os
+ * outros argumentos são caminhos. Retorna o número de imagens em *out (um
+ * vetor com os caminhos, liberado pelo chamador) ou encerra o processo em
+ * erro.
+ */
+int fleet_expand(char **args, int n, char ***out);
+
+/*
+ * Executa `op` em cada uma das `n` imagens com até `workers` threads.
+ * `name` é o arquivo do FLEET_CAT. Retorna o código de saída do processo:
+ * falha se alguma imagem não pôde ser lida ou não passou na verificação.
+ */
+int fleet_run(enum fleet_op op, const char *name, char **images, int n, int flags, unsigned workers);
+
+#endif
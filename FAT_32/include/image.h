@@ -0,0 +1,95 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Camada de E/S posicional sobre a imagem de disco.
+ *
+ * Toda leitura/escrita é feita com pread()/pwrite() sobre um descritor cru, sem
+ * posição de arquivo compartilhada, então várias threads podem usar a mesma
+ * imagem. Leituras e escritas pequenas (entradas da FAT, dentries, clusters)
+ * passam por uma cache de blocos com descarte LRU (ver cache.h); escritas
+ * ficam na cache até o próximo image_flush() ou até o bloco ser descartado.
+ * Pedidos maiores que IMAGE_BYPASS vão direto ao disco, mantendo a cache
+ * coerente; a trava da imagem só é tomada para acertar a cache antes e depois
+ * da E/S, que roda em paralelo com as outras threads.
+ */
+
+#define IMAGE_MMAP   (1 << 0) /* mapeia a imagem inteira em memória */
+#define IMAGE_DIRECT (1 << 1) /* O_DIRECT: não passa pelo page cache do host */
+#define IMAGE_COMPACT_FAT (1 << 2) /* FAT em memória como trechos (ver fattable.h) */
+#define IMAGE_RDONLY (1 << 3) /* só leitura: escritas falham com EROFS e nada é descarregado */
+
+#define IMAGE_BUFSZ  (64 * 1024) /* tamanho dos pedaços lidos de uma vez da FAT */
+#define IMAGE_BYPASS (16 * 1024) /* pedidos maiores que isso não passam pela cache */
+
+struct uring;
+struct block_cache;
+struct fat_table;
+struct chain_cache;
+struct dir_index_cache;
+
+struct fat_image
+{
+	int              fd;
+	int           flags;
+	size_t        align; // Alinhamento exigido pelo O_DIRECT (1 sem --direct)
+
+	uint8_t       *map; // Backend mmap: NULL quando não mapeada
+	size_t    map_size;
+
+	uint64_t      size; // Tamanho da imagem em bytes
+	uint32_t host_block; // Bloco do sistema de arquivos do host (st_blksize)
+	bool     no_clone;   // O host recusou FICLONERANGE: as cópias vão só por copy_file_range()
+
+	pthread_mutex_t lock; // Protege a cache
+	struct block_cache *cache; // NULL quando mapeada
+
+	struct fat_table *fat; // FAT em memória, carregada por rfat()
+	struct chain_cache *chains; // Mapas de arquivos (ver chain.h)
+	struct dir_index_cache *names; // Índices de nomes dos diretórios (ver directory.h)
+
+	struct uring *ring; // Modo io_uring: NULL quando desligado
+	unsigned ring_depth; // Clusters em voo por transferência
+};
+
+/*
+ * Abre/fecha a imagem. Com IMAGE_MMAP, se o mapeamento falhar a imagem segue
+ * com pread()/pwrite() e img->map fica NULL. image_close() descarrega a FAT em
+ * memória e a cache e libera a imagem mesmo em erro; retorna 0 ou -1 (com
+ * errno) se a descarga falhou.
+ */
+struct fat_image *image_open(const char *path, int flags);
+int image_close(struct fat_image *);
+
+/* Troca o orçamento de memória da cache (em bytes). Retorna 0 ou -1. */
+int image_set_cache(struct fat_image *, size_t budget);
+
+/* Liga o modo io_uring com `depth` operações em voo. Retorna 0 ou -1. */
+int image_enable_uring(struct fat_image *, unsigned depth);
+
+/*
+ * Para E/S feita por fora da camada (io_uring, sendfile, copy_file_range...):
+ * image_sync_buffers() descarrega os blocos sujos, para que o disco esteja em
+ * dia, e image_invalidate() descarta da cache um trecho escrito por fora.
+ */
+int image_sync_buffers(struct fat_image *);
+void image_invalidate(struct fat_image *, uint64_t offset, size_t len);
+
+/* Buffer alinhado para E/S em modo --direct (liberar com free()) */
+void *image_alloc(struct fat_image *, size_t len);
+bool image_is_aligned(struct fat_image *, uint64_t offset, size_t len);
+
+/* E/S posicional. Retornam 0 em sucesso e -1 em erro (com errno). */
+int image_pread(struct fat_image *, uint64_t offset, void *buf, size_t len);
+int image_pwrite(struct fat_image *, uint64_t offset, const void *buf, size_t len);
+int image_flush(struct fat_image *);
+
+/* Ponteiro direto para [offset, offset + len) no mapeamento, ou NULL */
+const void *image_at(struct fat_image *, uint64_t offset, size_t len);
+
+#endif
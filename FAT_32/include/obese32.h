@@ -0,0 +1,96 @@
+#ifndef OBESE32_H
+#define OBESE32_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * libobese32: acesso a imagens FAT32 sem passar pelo executável.
+ *
+ * Tudo gira em torno de um volume aberto (struct obese32), que guarda o BPB,
+ * a cache de blocos, a FAT em memória, o alocador e os mapas de arquivos.
+ * Nenhuma função imprime nem encerra o processo: todas retornam 0 (ou uma
+ * contagem de bytes) em sucesso e -errno em erro.
+ *
+ * Os nomes seguem o formato 8.3 ("NOME.EXT", ou "NOME" sem extensão, sem
+ * diferenciar maiúsculas) e ficam no diretório raiz.
+ *
+ * Um volume pode ser usado por várias threads: leituras (readdir, stat,
+ * pread) rodam ao mesmo tempo, e alterações são feitas uma por vez. As
+ * alterações ficam em memória até obese32_flush() ou obese32_close().
+ */
+
+#define OBESE32_MMAP        (1 << 0) /* mapeia a imagem inteira em memória */
+#define OBESE32_DIRECT      (1 << 1) /* O_DIRECT: não passa pelo page cache do host */
+#define OBESE32_COMPACT_FAT (1 << 2) /* FAT em memória como trechos */
+#define OBESE32_RDONLY      (1 << 3) /* só leitura: alterações retornam -EROFS */
+
+#define OBESE32_NAME_MAX 13 /* "NOMEXXXX.EXT" e o '\0' */
+
+struct obese32;
+
+struct obese32_stat
+{
+	char     name[OBESE32_NAME_MAX];
+	uint8_t  attr;    // Atributos da entrada (DIR_ATTR_*)
+	uint32_t size;    // Tamanho em bytes
+	uint32_t cluster; // Primeiro cluster (0 se o arquivo estiver vazio)
+};
+
+/* Abre a imagem em `path` e carrega o volume em *vol. */
+int obese32_open(const char *path, int flags, struct obese32 **vol);
+
+/* Descarrega as alterações e fecha o volume (ele é liberado mesmo em erro). */
+int obese32_close(struct obese32 *vol);
+
+/* Grava a FAT e os blocos alterados na imagem. */
+int obese32_flush(struct obese32 *vol);
+
+/*
+ * Próxima entrada do diretório raiz a partir de *cookie (comece com 0).
+ * Retorna 1 com a entrada em *st, 0 no fim do diretório, ou -errno.
+ */
+int obese32_readdir(struct obese32 *vol, uint64_t *cookie, struct obese32_stat *st);
+
+int obese32_stat(struct obese32 *vol, const char *name, struct obese32_stat *st);
+
+/* Lê até `len` bytes a partir de `offset`; retorna quantos foram lidos (0 no fim). */
+ssize_t obese32_pread(struct obese32 *vol, const char *name, void *buf, size_t len, uint64_t offset);
+
+/*
+ * Escreve `len` bytes em `offset`, alocando clusters se o arquivo crescer;
+ * um buraco entre o fim antigo e `offset` é preenchido com zeros. Retorna `len`.
+ */
+ssize_t obese32_pwrite(struct obese32 *vol, const char *name, const void *buf, size_t len, uint64_t offset);
+
+/* Cria um arquivo vazio (-EEXIST se já existir). */
+int obese32_create(struct obese32 *vol, const char *name);
+
+/* Remove o arquivo e libera seus clusters. */
+int obese32_unlink(struct obese32 *vol, const char *name);
+
+/* Renomeia `from` para `to` (-EEXIST se `to` já existir). */
+int obese32_rename(struct obese32 *vol, const char *from, const char *to);
+
+/* Verificação */
+
+struct obese32_check
+{
+	uint32_t files;        // Arquivos e diretórios no diretório raiz
+	uint32_t used;         // Clusters ocupados na FAT
+	uint32_t bad_chains;   // Cadeias com ciclo, ou com mais ou menos clusters que o tamanho pede
+	uint32_t cross_links;  // Clusters em mais de uma cadeia
+	uint32_t lost;         // Clusters ocupados que não pertencem a nenhuma cadeia
+	uint32_t fat_mismatch; // Setores em que as cópias da FAT divergem no disco
+};
+
+/*
+ * Confere a consistência do volume: as cadeias do diretório raiz e de cada
+ * entrada dele contra a FAT, e as cópias da FAT entre si. Retorna 0 com o
+ * resultado em *report (o volume está íntegro se todos os contadores de
+ * problemas forem 0), ou -errno se a verificação não pôde ser feita.
+ */
+int obese32_check(struct obese32 *vol, struct obese32_check *report);
+
+#endif
@@ -2,8 +2,10 @@
 #define OUTPUT_H
 
 #include "fat32.h"
+#include "directory.h"
 
-void show_files(struct fat_dir *);
+/* Imprime as entradas do diretório conforme o iterador as lê */
+void show_files(struct dir_iter *);
 
 void verbose(struct fat_bpb *);
 
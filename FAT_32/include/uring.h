@@ -0,0 +1,41 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "fat32.h"
+
+/*
+ * Anel io_uring mínimo, falando direto com as syscalls (sem liburing).
+ *
+ * É usado pelo modo --uring de cat e cp para manter várias leituras/escritas
+ * de cluster em voo ao mesmo tempo, em vez de uma por vez.
+ */
+
+#define URING_DEFAULT_DEPTH 32
+
+struct uring;
+
+struct uring *uring_open(unsigned depth);
+void uring_close(struct uring *);
+
+/* Enfileira uma operação. Retorna -1 se a fila de submissão estiver cheia. */
+int uring_prep_read(struct uring *, int fd, void *buf, unsigned len, uint64_t offset, uint64_t user_data);
+int uring_prep_write(struct uring *, int fd, const void *buf, unsigned len, uint64_t offset, uint64_t user_data);
+
+/* Submete o que foi enfileirado e espera até `wait_nr` conclusões. */
+int uring_submit(struct uring *, unsigned wait_nr);
+
+/* Retira uma conclusão, se houver. Retorna 1 se retirou e 0 se a fila está vazia. */
+int uring_reap(struct uring *, uint64_t *user_data, int32_t *res);
+
+/*
+ * Copia `size` bytes da cadeia de clusters que começa em `src`, mantendo até
+ * img->ring_depth clusters em voo e seguindo a FAT à frente dos dados. Com dst != 0 os
+ * dados vão para a cadeia `dst` da própria imagem; com dst == 0, vão em ordem
+ * para `out_fd`. Retorna 0 em sucesso e -1 em erro (com errno).
+ */
+int uring_copy_chain(struct fat_image *, struct fat_bpb *,
+                     uint32_t src, uint32_t dst, int out_fd, uint64_t size);
+
+#endif
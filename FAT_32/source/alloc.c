@@ -0,0 +1,125 @@
+#include "alloc.h"
+#include "fattable.h"
+#include <stdlib.h>
+#include <errno.h>
+
+struct fat32_newcluster_info fat32_find_free_cluster(struct fat_image *img, struct fat_bpb *bpb)
+{
+	// Reserva no bitmap atômico, a partir do cursor da thread (uma palavra de 64 clusters por vez)
+	uint32_t cluster = fat_claim(img->fat);
+	if (cluster == 0)
+	{
+		errno = ENOSPC;
+		return (struct fat32_newcluster_info) { .cluster = 0, .address = 0 };
+	}
+
+	return (struct fat32_newcluster_info) { .cluster = cluster, .address = fat_entry_address(cluster, 0, bpb) };
+}
+
+/*
+ * Procura `count` clusters livres consecutivos no bitmap de livres.
+ * Retorna o primeiro cluster do trecho, ou 0 se não houver trecho desse tamanho.
+ */
+uint32_t fat32_find_free_run(struct fat_image *img, struct fat_bpb *bpb, uint32_t count)
+{
+	(void) bpb;
+
+	uint32_t first = fat_find_free_run(img->fat, count);
+	if (first == 0)
+		errno = ENOSPC;
+
+	return first;
+}
+
+static int compare_extent_start(const void *a, const void *b)
+{
+	const struct extent *x = a, *y = b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+/*
+ * Desfaz uma alocação pela metade: libera a cadeia já encadeada de `first` até
+ * `last` (exclusive) e devolve `last`, que foi reservado mas ainda não tem valor.
+ * Preserva errno.
+ */
+static void unwind_chain(struct fat_image *img, uint32_t first, uint32_t last)
+{
+	int saved = errno;
+
+	for (uint32_t c = first; c != 0 && c != last; )
+	{
+		uint32_t next = fat_get(img->fat, c);
+		(void) fat_set(img->fat, c, 0);
+		c = next;
+	}
+
+	if (last != 0)
+		fat_release(img->fat, last);
+
+	errno = saved;
+}
+
+/*
+ * Aloca uma cadeia de `count` clusters com o mínimo de trechos: o menor trecho
+ * livre em que ela cabe inteira, ou os maiores trechos até completar. Os
+ * pedaços são encadeados em ordem de endereço.
+ */
+uint32_t fat32_alloc_chain(struct fat_image *img, struct fat_bpb *bpb, uint32_t count, uint32_t *clusters, size_t *pieces)
+{
+	(void) bpb;
+
+	size_t n;
+	struct extent *plan = fat_plan_extents(img->fat, count, &n);
+	if (plan == NULL)
+		return 0;
+
+	/* Em ordem de endereço, a leitura sequencial do arquivo anda sempre para frente no disco. */
+	qsort(plan, n, sizeof(struct extent), compare_extent_start);
+
+	/*
+	 * Cada cluster do plano é reservado no bitmap atômico; se outra thread já o
+	 * tomou, entra no lugar um cluster qualquer reservado com fat_claim().
+	 */
+	uint32_t first = 0, prev = 0, k = 0;
+	size_t   runs  = 0; // Trechos da cadeia de fato montada, que pode fugir do plano
+	for (size_t p = 0; p < n; p++)
+	{
+		for (uint32_t planned = plan[p].start; planned < plan[p].start + plan[p].length; planned++)
+		{
+			uint32_t c = fat_reserve(img->fat, planned) ? planned : fat_claim(img->fat);
+			if (c == 0)
+			{
+				errno = ENOSPC;
+				goto fail;
+			}
+
+			if (prev != 0 && fat_set(img->fat, prev, c) != 0)
+			{
+				fat_release(img->fat, c);
+				goto fail;
+			}
+
+			if (first == 0)
+				first = c;
+			if (c != prev + 1)
+				runs++;
+			if (clusters != NULL)
+				clusters[k++] = c;
+			prev = c;
+		}
+	}
+
+	if (fat_set(img->fat, prev, FAT32_EOF_HI) != 0)
+		goto fail;
+
+	if (pieces != NULL)
+		*pieces = runs;
+
+	free(plan);
+	return first;
+
+fail:
+	unwind_chain(img, first, prev);
+	free(plan);
+	return 0;
+}
@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Blocos sujos adjacentes são escritos juntos, até este tanto por escrita. */
+#define CACHE_FLUSH_RUN 32
+
+static size_t hash_slot(struct block_cache *c, uint64_t number)
+{
+	return (size_t) ((number * 0x9E3779B97F4A7C15ull) >> 32) & c->table_mask;
+}
+
+static void lru_unlink(struct cache_block *b)
+{
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+}
+
+/* Coloca o bloco na ponta mais recente da lista. */
+static void lru_push(struct block_cache *c, struct cache_block *b)
+{
+	b->next = &c->lru;
+	b->prev = c->lru.prev;
+	c->lru.prev->next = b;
+	c->lru.prev = b;
+}
+
+/* Coloca o bloco (já fora da tabela) na ponta menos recente da lista. */
+static void lru_push_old(struct block_cache *c, struct cache_block *b)
+{
+	b->valid = false;
+	b->dirty = false;
+	b->prev = &c->lru;
+	b->next = c->lru.next;
+	c->lru.next->prev = b;
+	c->lru.next = b;
+}
+
+static struct cache_block *lookup(struct block_cache *c, uint64_t number)
+{
+	struct cache_block *b = c->table[hash_slot(c, number)];
+
+	while (b != NULL && b->number != number)
+		b = b->hnext;
+
+	return b;
+}
+
+static void table_remove(struct block_cache *c, struct cache_block *b)
+{
+	struct cache_block **p = &c->table[hash_slot(c, b->number)];
+
+	while (*p != b)
+		p = &(*p)->hnext;
+
+	*p = b->hnext;
+}
+
+static int write_back(struct block_cache *c, struct cache_block *b)
+{
+	if (!b->dirty)
+		return 0;
+
+	if (c->write(c->ctx, b->number * CACHE_BLOCK, b->data, b->len) != 0)
+		return -1;
+
+	b->dirty = false;
+	c->writebacks++;
+	return 0;
+}
+
+struct block_cache *cache_create(size_t budget, size_t align, uint64_t limit,
+                                 cache_io_fn read, cache_io_fn write, void *ctx)
+{
+	size_t capacity = budget / CACHE_BLOCK;
+	if (capacity < 2)
+		capacity = 2;
+
+	struct block_cache *c = calloc(1, sizeof(struct block_cache));
+	if (c == NULL)
+		return NULL;
+
+	size_t table_size = 1;
+	while (table_size < capacity * 2)
+		table_size <<= 1;
+
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+
+	c->capacity   = capacity;
+	c->limit      = limit;
+	c->table_mask = table_size - 1;
+	c->read       = read;
+	c->write      = write;
+	c->ctx        = ctx;
+	c->lru.prev   = c->lru.next = &c->lru;
+
+	c->blocks = calloc(capacity, sizeof(struct cache_block));
+	c->table  = calloc(table_size, sizeof(struct cache_block *));
+	if (c->blocks == NULL || c->table == NULL
+	 || posix_memalign((void **) &c->pool, align, capacity * CACHE_BLOCK) != 0)
+	{
+		c->pool = NULL;
+		cache_destroy(c);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < capacity; i++)
+		c->blocks[i].data = c->pool + i * CACHE_BLOCK;
+
+	return c;
+}
+
+void cache_destroy(struct block_cache *c)
+{
+	if (c == NULL)
+		return;
+
+	free(c->pool);
+	free(c->table);
+	free(c->blocks);
+	free(c);
+}
+
+/*
+ * Bloco `number` na cache, carregando-o do disco se preciso (a menos que o
+ * chamador vá sobrescrevê-lo inteiro). Ao faltar espaço, descarta o bloco
+ * usado há mais tempo, escrevendo-o antes se estiver sujo.
+ */
+static struct cache_block *get_block(struct block_cache *c, uint64_t number, bool overwrite)
+{
+	struct cache_block *b = lookup(c, number);
+
+	if (b != NULL)
+	{
+		c->hits++;
+		lru_unlink(b);
+		lru_push(c, b);
+		return b;
+	}
+
+	c->misses++;
+
+	uint64_t start = number * CACHE_BLOCK;
+	if (start >= c->limit)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (c->used < c->capacity)
+		b = &c->blocks[c->used++];
+	else
+	{
+		b = c->lru.next;
+		if (write_back(c, b) != 0)
+			return NULL;
+		lru_unlink(b);
+		if (b->valid)
+			table_remove(c, b);
+	}
+
+	b->number = number;
+	b->len    = c->limit - start < CACHE_BLOCK ? c->limit - start : CACHE_BLOCK;
+	b->dirty  = false;
+	b->valid  = false;
+
+	if (!overwrite && c->read(c->ctx, start, b->data, b->len) != 0)
+	{
+		/* O bloco fica livre, na ponta LRU, para ser o próximo reaproveitado. */
+		lru_push_old(c, b);
+		return NULL;
+	}
+
+	b->valid = true;
+	size_t slot = hash_slot(c, number);
+	b->hnext = c->table[slot];
+	c->table[slot] = b;
+	lru_push(c, b);
+
+	return b;
+}
+
+int cache_read(struct block_cache *c, uint64_t offset, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len > 0)
+	{
+		uint64_t number = offset / CACHE_BLOCK;
+		size_t   in     = offset % CACHE_BLOCK;
+		size_t   n      = CACHE_BLOCK - in < len ? CACHE_BLOCK - in : len;
+
+		struct cache_block *b = get_block(c, number, false);
+		if (b == NULL)
+			return -1;
+		if (in + n > b->len)
+		{
+			errno = EIO;
+			return -1;
+		}
+
+		memcpy(p, b->data + in, n);
+		p += n; offset += n; len -= n;
+	}
+
+	return 0;
+}
+
+int cache_write(struct block_cache *c, uint64_t offset, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len > 0)
+	{
+		uint64_t number = offset / CACHE_BLOCK;
+		size_t   in     = offset % CACHE_BLOCK;
+		size_t   n      = CACHE_BLOCK - in < len ? CACHE_BLOCK - in : len;
+
+		/* Blocos sobrescritos por inteiro não precisam ser lidos antes. */
+		uint64_t start = number * CACHE_BLOCK;
+		size_t   blen  = c->limit > start && c->limit - start < CACHE_BLOCK ? c->limit - start : CACHE_BLOCK;
+
+		struct cache_block *b = get_block(c, number, in == 0 && n == blen);
+		if (b == NULL)
+			return -1;
+		if (in + n > b->len)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+
+		memcpy(b->data + in, p, n);
+		b->dirty = true;
+		p += n; offset += n; len -= n;
+	}
+
+	return 0;
+}
+
+static int compare_blocks(const void *a, const void *b)
+{
+	uint64_t x = (*(struct cache_block * const *) a)->number;
+	uint64_t y = (*(struct cache_block * const *) b)->number;
+
+	return (x > y) - (x < y);
+}
+
+int cache_flush(struct block_cache *c)
+{
+	size_t ndirty = 0;
+
+	for (size_t i = 0; i < c->used; i++)
+		if (c->blocks[i].dirty)
+			ndirty++;
+
+	if (ndirty == 0)
+		return 0;
+
+	struct cache_block **dirty = malloc(ndirty * sizeof(struct cache_block *));
+	uint8_t *stage = NULL;
+	if (dirty == NULL || posix_memalign((void **) &stage, CACHE_BLOCK, CACHE_FLUSH_RUN * CACHE_BLOCK) != 0)
+	{
+		/* Sem memória para agrupar: escreve bloco a bloco. */
+		free(dirty);
+		for (size_t i = 0; i < c->used; i++)
+			if (write_back(c, &c->blocks[i]) != 0)
+				return -1;
+		return 0;
+	}
+
+	ndirty = 0;
+	for (size_t i = 0; i < c->used; i++)
+		if (c->blocks[i].dirty)
+			dirty[ndirty++] = &c->blocks[i];
+
+	/* Em ordem de offset, juntando blocos consecutivos numa só escrita. */
+	qsort(dirty, ndirty, sizeof(struct cache_block *), compare_blocks);
+
+	int ret = 0;
+	for (size_t i = 0; i < ndirty && ret == 0; )
+	{
+		size_t run = 1;
+		while (i + run < ndirty && run < CACHE_FLUSH_RUN
+		    && dirty[i + run]->number == dirty[i]->number + run
+		    && dirty[i + run - 1]->len == CACHE_BLOCK)
+			run++;
+
+		size_t len = 0;
+		for (size_t j = 0; j < run; j++)
+		{
+			memcpy(stage + len, dirty[i + j]->data, dirty[i + j]->len);
+			len += dirty[i + j]->len;
+		}
+
+		ret = c->write(c->ctx, dirty[i]->number * CACHE_BLOCK, stage, len);
+		if (ret == 0)
+		{
+			for (size_t j = 0; j < run; j++)
+				dirty[i + j]->dirty = false;
+			c->writebacks++;
+		}
+
+		i += run;
+	}
+
+	free(stage);
+	free(dirty);
+	return ret;
+}
+
+/*
+ * Chama fn para cada bloco em cache que intersecta [offset, offset + len),
+ * com o trecho de sobreposição. Percorre o intervalo ou a cache, o que for
+ * menor.
+ */
+static void for_each_overlap(struct block_cache *c, uint64_t offset, size_t len,
+                             void (*fn)(struct block_cache *, struct cache_block *, uint64_t from, uint64_t to, void *arg),
+                             void *arg)
+{
+	if (len == 0)
+		return;
+
+	uint64_t first = offset / CACHE_BLOCK;
+	uint64_t last  = (offset + len - 1) / CACHE_BLOCK;
+
+	if (last - first < c->used)
+	{
+		for (uint64_t number = first; number <= last; number++)
+		{
+			struct cache_block *b = lookup(c, number);
+			if (b == NULL) continue;
+
+			uint64_t start = number * CACHE_BLOCK;
+			uint64_t from  = offset > start ? offset : start;
+			uint64_t to    = offset + len < start + b->len ? offset + len : start + b->len;
+			if (from < to)
+				fn(c, b, from, to, arg);
+		}
+		return;
+	}
+
+	for (size_t i = 0; i < c->used; i++)
+	{
+		struct cache_block *b = &c->blocks[i];
+		if (!b->valid || b->number < first || b->number > last) continue;
+
+		uint64_t start = b->number * CACHE_BLOCK;
+		uint64_t from  = offset > start ? offset : start;
+		uint64_t to    = offset + len < start + b->len ? offset + len : start + b->len;
+		if (from < to)
+			fn(c, b, from, to, arg);
+	}
+}
+
+struct span
+{
+	uint64_t offset;
+	uint8_t *buf;
+};
+
+static void overlay_one(struct block_cache *c, struct cache_block *b, uint64_t from, uint64_t to, void *arg)
+{
+	struct span *s = arg;
+	(void) c;
+
+	if (b->dirty)
+		memcpy(s->buf + (from - s->offset), b->data + (from - b->number * CACHE_BLOCK), to - from);
+}
+
+static void update_one(struct block_cache *c, struct cache_block *b, uint64_t from, uint64_t to, void *arg)
+{
+	struct span *s = arg;
+	(void) c;
+
+	memcpy(b->data + (from - b->number * CACHE_BLOCK), s->buf + (from - s->offset), to - from);
+}
+
+static void invalidate_one(struct block_cache *c, struct cache_block *b, uint64_t from, uint64_t to, void *arg)
+{
+	(void) from; (void) to; (void) arg;
+
+	table_remove(c, b);
+	lru_unlink(b);
+	lru_push_old(c, b);
+}
+
+void cache_overlay(struct block_cache *c, uint64_t offset, void *buf, size_t len)
+{
+	struct span s = { offset, buf };
+	for_each_overlap(c, offset, len, overlay_one, &s);
+}
+
+void cache_update(struct block_cache *c, uint64_t offset, const void *buf, size_t len)
+{
+	struct span s = { offset, (uint8_t *) buf };
+	for_each_overlap(c, offset, len, update_one, &s);
+}
+
+void cache_invalidate(struct block_cache *c, uint64_t offset, size_t len)
+{
+	for_each_overlap(c, offset, len, invalidate_one, NULL);
+}
@@ -0,0 +1,234 @@
+#include "chain.h"
+#include "fat32.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static int push(struct chain *c, uint32_t first, uint32_t length)
+{
+	if (c->count == c->cap)
+	{
+		size_t cap = c->cap ? c->cap * 2 : 16;
+		struct chain_extent *extents = realloc(c->extents, cap * sizeof(struct chain_extent));
+		if (extents == NULL)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+		c->extents = extents;
+		c->cap     = cap;
+	}
+
+	c->extents[c->count++] = (struct chain_extent) { first, length, c->clusters };
+	c->clusters += length;
+	return 0;
+}
+
+int chain_resolve(struct fat_table *t, uint32_t start, struct chain *c)
+{
+	c->start      = start;
+	c->clusters   = 0;
+	c->count      = 0;
+	c->generation = atomic_load(&t->generation);
+
+	uint32_t cluster = start;
+	while (cluster >= 2 && cluster < t->limit)
+	{
+		uint32_t next;
+		uint32_t length = fat_follow(t, cluster, &next);
+
+		/* Uma cadeia sem ciclo não passa do número de clusters do volume. */
+		if (c->clusters + (uint64_t) length > t->limit)
+		{
+			errno = ELOOP;
+			return -1;
+		}
+
+		if (push(c, cluster, length) != 0)
+			return -1;
+
+		cluster = next;
+	}
+
+	return 0;
+}
+
+void chain_free(struct chain *c)
+{
+	free(c->extents);
+	memset(c, 0, sizeof(struct chain));
+}
+
+struct chain_cache *chain_cache_create(void)
+{
+	struct chain_cache *cache = calloc(1, sizeof(struct chain_cache));
+	if (cache == NULL)
+		return NULL;
+
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+void chain_cache_free(struct chain_cache *cache)
+{
+	if (cache == NULL)
+		return;
+
+	for (size_t i = 0; i < CHAIN_CACHE_SIZE; i++)
+		free(cache->slots[i].extents);
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+/* Mapa em cache (resolvido de novo se a FAT mudou); chamar com a trava. */
+static struct chain *get_locked(struct fat_image *img, uint32_t start)
+{
+	struct chain_cache *cache = img->chains;
+	uint64_t generation = atomic_load(&img->fat->generation);
+	struct chain *slot = &cache->slots[0];
+	bool found = false;
+
+	/* Procura o mapa; se não houver, fica com o usado há mais tempo. */
+	for (size_t i = 0; i < CHAIN_CACHE_SIZE; i++)
+	{
+		struct chain *c = &cache->slots[i];
+
+		if (c->used != 0 && c->start == start)
+		{
+			slot  = c;
+			found = true;
+			break;
+		}
+		if (c->used < slot->used)
+			slot = c;
+	}
+
+	slot->used = ++cache->tick;
+
+	if (found && slot->generation == generation)
+	{
+		cache->hits++;
+		return slot;
+	}
+
+	cache->misses++;
+	if (chain_resolve(img->fat, start, slot) != 0)
+	{
+		slot->used = 0;
+		return NULL;
+	}
+
+	return slot;
+}
+
+const struct chain *chain_get(struct fat_image *img, uint32_t start)
+{
+	pthread_mutex_lock(&img->chains->lock);
+	const struct chain *c = get_locked(img, start);
+	pthread_mutex_unlock(&img->chains->lock);
+
+	return c;
+}
+
+int chain_lookup(struct fat_image *img, uint32_t start, struct chain *out)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&img->chains->lock);
+
+	const struct chain *c = get_locked(img, start);
+	if (c != NULL)
+	{
+		struct chain_extent *extents = out->extents;
+		size_t cap = out->cap;
+
+		if (cap < c->count)
+		{
+			extents = realloc(out->extents, c->count * sizeof(struct chain_extent));
+			cap     = c->count;
+		}
+
+		if (extents == NULL && c->count != 0)
+			errno = ENOMEM;
+		else
+		{
+			*out = *c;
+			out->extents = extents;
+			out->cap     = cap;
+			if (c->count != 0)
+				memcpy(out->extents, c->extents, c->count * sizeof(struct chain_extent));
+			ret = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&img->chains->lock);
+	return ret;
+}
+
+/* Cursor */
+
+void chain_begin(struct chain_cursor *cur, const struct chain *c)
+{
+	cur->chain  = c;
+	cur->extent = 0;
+	cur->offset = 0;
+}
+
+uint64_t chain_span(struct chain_cursor *cur, struct fat_bpb *bpb, uint64_t *address)
+{
+	if (cur->extent >= cur->chain->count)
+		return 0;
+
+	const struct chain_extent *e = &cur->chain->extents[cur->extent];
+	const uint32_t cluster_width = bpb->bytes_p_sect * bpb->sector_p_clust;
+
+	*address = cluster_to_address(e->first, bpb) + cur->offset;
+	return (uint64_t) e->length * cluster_width - cur->offset;
+}
+
+void chain_advance(struct chain_cursor *cur, struct fat_bpb *bpb, uint64_t len)
+{
+	if (cur->extent >= cur->chain->count)
+		return;
+
+	const struct chain_extent *e = &cur->chain->extents[cur->extent];
+	const uint32_t cluster_width = bpb->bytes_p_sect * bpb->sector_p_clust;
+
+	cur->offset += len;
+	if (cur->offset >= (uint64_t) e->length * cluster_width)
+	{
+		cur->extent++;
+		cur->offset = 0;
+	}
+}
+
+void chain_seek(struct chain_cursor *cur, struct fat_bpb *bpb, uint64_t offset)
+{
+	const struct chain *c = cur->chain;
+	const uint32_t cluster_width = bpb->bytes_p_sect * bpb->sector_p_clust;
+	uint64_t index = offset / cluster_width;
+
+	if (index >= c->clusters)
+	{
+		cur->extent = c->count;
+		cur->offset = 0;
+		return;
+	}
+
+	/* Último trecho que começa antes (ou em cima) do cluster procurado. */
+	size_t lo = 0, hi = c->count;
+	while (hi - lo > 1)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (c->extents[mid].index <= index)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	cur->extent = lo;
+	cur->offset = (index - c->extents[lo].index) * cluster_width + offset % cluster_width;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
@@ -6,69 +7,92 @@
 #include "commands.h"
 #include "fat32.h"
 #include "support.h"
+#include "uring.h"
+#include "fattable.h"
+#include "chain.h"
+#include "directory.h"
+#include "output.h"
 #include <errno.h>
 #include <err.h>
 #include <error.h>
 #include <assert.h>
 #include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <time.h>
 /*
-Para refatorar a função find_in_root para o padrão FAT32, precisamos
-garantir que ela funcione de maneira similar, 
-mas levando em consideração as diferenças entre FAT16 e FAT32,
-como o tamanho do nome do arquivo (agora usando FAT32STR_SIZE),
-e o formato de nome do arquivo.*/
-struct far_dir_searchres find_in_root(struct fat_dir *dirs, char *filename, struct fat_bpb *bpb) {
+ * Procura `filename` (no formato FAT32) no diretório raiz pelo índice de nomes
+ * (ver directory.h). Se o índice não puder ser montado, varre o diretório um
+ * cluster por vez até achar. Encerra o processo se o diretório não puder ser
+ * lido.
+ */
+struct far_dir_searchres find_in_root(struct fat_image *img, char *filename, struct fat_bpb *bpb) {
     struct far_dir_searchres res = { .found = false };
 
-    // Itera sobre as entradas de diretório
-    for (size_t i = 0; i < bpb->n_fat; i++) {
-        // Ignora entradas livres ou inválidas
-        if (dirs[i].name[0] == DIR_FREE_ENTRY || dirs[i].name[0] == '\0')
+    struct dir_location loc;
+    int indexed = dir_index_find(img, bpb, bpb->root_cluster, filename, &loc);
+    if (indexed >= 0) {
+        if (indexed == 1) {
+            res.found   = true;
+            res.fdir    = loc.entry;
+            res.idx     = loc.index;
+            res.address = loc.address;
+        }
+        return res;
+    }
+
+    struct dir_iter it;
+    if (dir_open(&it, img, bpb, bpb->root_cluster) != 0)
+        error_at_line(EXIT_FAILURE, errno, __FILE__, __LINE__, "Erro ao ler estrutura do diretório raiz");
+
+    // Salta de uma entrada com o nome fornecido para a próxima (ver dirscan.h)
+    const struct fat_dir *entry;
+    while ((entry = dir_next_named(&it, filename)) != NULL) {
+        // Ignora entradas livres, nomes longos (LFN) e o rótulo do volume
+        if (entry->name[0] == DIR_FREE_ENTRY || (entry->attr & DIR_ATTR_VOLUMEID))
             continue;
 
-        // Compara o nome do arquivo armazenado com o nome fornecido
-        if (memcmp((char *) dirs[i].name, filename, FAT32STR_SIZE) == 0) {
-            res.found = true;
-            res.fdir  = dirs[i];
-            res.idx   = i;
-            break;
-        }
+        res.found   = true;
+        res.fdir    = *entry;
+        res.idx     = it.index;
+        res.address = it.address;
+        break;
     }
 
+    if (it.error != 0)
+        error_at_line(EXIT_FAILURE, it.error, __FILE__, __LINE__, "Erro ao ler estrutura do diretório raiz");
+
+    dir_close(&it);
     return res;
 }
 
-struct fat_dir *ls(FILE *fp, struct fat_bpb *bpb) {
-    // Calcula o endereço do diretório raiz no FAT32.
-    uint32_t root_address = bpb_root_dir_address(bpb);
-    uint32_t root_size = sizeof(struct fat_dir) * bpb->n_fat;
+/* Entrada livre no diretório raiz (que cresce, se estiver cheio); encerra o processo se não houver. */
+static uint64_t root_free_slot(struct fat_image *img, struct fat_bpb *bpb, size_t *index) {
+    uint64_t address = dir_free_slot(img, bpb, bpb->root_cluster, index);
+    if (address == 0)
+        error_at_line(EXIT_FAILURE, errno, __FILE__, __LINE__, "Não foi possível alocar uma entrada no diretório raiz.");
 
-    // Aloca memória para armazenar as entradas do diretório.
-    struct fat_dir *dirs = malloc(root_size);
-    if (dirs == NULL) {
-        error_at_line(EXIT_FAILURE, ENOMEM, __FILE__, __LINE__, "Erro ao alocar memória para diretórios");
-    }
+    return address;
+}
 
-    // Lê as entradas do diretório raiz do disco.
-    if (read_bytes(fp, root_address, dirs, root_size) == RB_ERROR) {
-        free(dirs);
-        error_at_line(EXIT_FAILURE, EIO, __FILE__, __LINE__, "Erro ao ler diretório raiz");
-    }
+void ls(struct fat_image *img, struct fat_bpb *bpb) {
+    struct dir_iter it;
+    if (dir_open(&it, img, bpb, bpb->root_cluster) != 0)
+        error_at_line(EXIT_FAILURE, errno, __FILE__, __LINE__, "Erro ao ler diretório raiz");
 
-    // Aqui, podemos fazer um loop para listar apenas os arquivos válidos (não livres).
-    for (int i = 0; i < bpb->n_fat; i++) {
-        // Verifica se a entrada está livre ou não (indicado por DIR_FREE_ENTRY ou '\0').
-        if (dirs[i].name[0] != DIR_FREE_ENTRY && dirs[i].name[0] != '\0') {
-            // Aqui você pode processar os arquivos encontrados, por exemplo, imprimir o nome
-            printf("%s\n", dirs[i].name);
-        }
-    }
+    // Cada entrada é impressa assim que o cluster dela é lido.
+    show_files(&it);
+
+    if (it.error != 0)
+        error_at_line(EXIT_FAILURE, it.error, __FILE__, __LINE__, "Erro ao ler diretório raiz");
 
-    free(dirs); // Libera a memória alocada
-    return dirs;
+    dir_close(&it);
 }
 
-void mv(FILE *fp, char *source, char *dest, struct fat_bpb *bpb) {
+void mv(struct fat_image *img, char *source, char *dest, struct fat_bpb *bpb) {
     char source_rname[FAT32STR_SIZE_WNULL], dest_rname[FAT32STR_SIZE_WNULL];
 
     // Converte os nomes dos arquivos para o formato FAT32.
@@ -78,50 +102,32 @@ void mv(FILE *fp, char *source, char *dest, struct fat_bpb *bpb) {
         exit(EXIT_FAILURE);
     }
 
-    uint32_t root_address = bpb_root_dir_address(bpb);
-    uint32_t root_size = sizeof(struct fat_dir) * bpb->n_fat;
-
-    struct fat_dir *root = malloc(root_size);
-    if (root == NULL) {
-        error_at_line(EXIT_FAILURE, ENOMEM, __FILE__, __LINE__, "Erro ao alocar memória para o diretório raiz");
-    }
-
-    if (read_bytes(fp, root_address, root, root_size) == RB_ERROR) {
-        free(root);
-        error_at_line(EXIT_FAILURE, EIO, __FILE__, __LINE__, "Erro ao ler estrutura do diretório raiz");
-    }
-
-    struct far_dir_searchres dir1 = find_in_root(root, source_rname, bpb);
-    struct far_dir_searchres dir2 = find_in_root(root, dest_rname, bpb);
+    struct far_dir_searchres dir1 = find_in_root(img, source_rname, bpb);
+    struct far_dir_searchres dir2 = find_in_root(img, dest_rname, bpb);
 
     // Verifica se o destino já existe (não pode substituir)
-    if (dir2.found) {
-        free(root);
+    if (dir2.found)
         error(EXIT_FAILURE, 0, "Não permitido substituir arquivo %s via mv.", dest);
-    }
 
     // Verifica se a origem existe
-    if (!dir1.found) {
-        free(root);
+    if (!dir1.found)
         error(EXIT_FAILURE, 0, "Não foi possível encontrar o arquivo %s.", source);
-    }
 
     // Mover o arquivo (renomeando no diretório)
     memcpy(dir1.fdir.name, dest_rname, sizeof(char) * FAT32STR_SIZE);
 
     // Calcula o endereço da entrada do diretório que será atualizada
-    uint32_t source_address = sizeof(struct fat_dir) * dir1.idx + root_address;
+    uint64_t source_address = dir1.address;
 
     // Escreve a nova entrada de diretório no disco
-    (void) fseek(fp, source_address, SEEK_SET);
-    (void) fwrite(&dir1.fdir, sizeof(struct fat_dir), 1, fp);
+    (void) write_bytes(img, source_address, &dir1.fdir, sizeof(struct fat_dir));
+    dir_index_update(img, bpb->root_cluster, source_rname, dest_rname, dir1.idx, source_address);
 
     printf("mv %s → %s.\n", source, dest);
-    free(root);
     return;
 }
 
-void rm(FILE* fp, char* filename, struct fat_bpb* bpb) {
+void rm(struct fat_image* img, char* filename, struct fat_bpb* bpb) {
     char fat32_rname[FAT32STR_SIZE_WNULL];
 
     // Converte o nome do arquivo para o formato FAT32
@@ -130,103 +136,168 @@ void rm(FILE* fp, char* filename, struct fat_bpb* bpb) {
         exit(EXIT_FAILURE);
     }
 
-    uint32_t root_address = bpb_root_dir_address(bpb);
-    uint32_t root_size = sizeof(struct fat_dir) * bpb->n_fat;
-
-    struct fat_dir *root = malloc(root_size);
-    if (root == NULL) {
-        error_at_line(EXIT_FAILURE, ENOMEM, __FILE__, __LINE__, "Erro ao alocar memória para o diretório raiz");
-    }
-
-    if (read_bytes(fp, root_address, root, root_size) == RB_ERROR) {
-        free(root);
-        error_at_line(EXIT_FAILURE, EIO, __FILE__, __LINE__, "Erro ao ler estrutura do diretório raiz");
-    }
-
     // Encontra a entrada do arquivo a ser removido
-    struct far_dir_searchres dir = find_in_root(root, fat32_rname, bpb);
-    if (!dir.found) {
-        free(root);
+    struct far_dir_searchres dir = find_in_root(img, fat32_rname, bpb);
+    if (!dir.found)
         error(EXIT_FAILURE, 0, "Não foi possível encontrar o arquivo %s.", filename);
-    }
 
     // Marca a entrada como livre (define o primeiro byte como DIR_FREE_ENTRY)
     dir.fdir.name[0] = DIR_FREE_ENTRY;
 
     // Calcula o endereço da entrada de diretório a ser deletada
-    uint32_t file_address = sizeof(struct fat_dir) * dir.idx + root_address;
+    uint64_t file_address = dir.address;
 
     // Escreve a entrada atualizada de volta ao disco
-    (void) fseek(fp, file_address, SEEK_SET);
-    (void) fwrite(&dir.fdir, sizeof(struct fat_dir), 1, fp);
+    (void) write_bytes(img, file_address, &dir.fdir, sizeof(struct fat_dir));
+    dir_index_update(img, bpb->root_cluster, fat32_rname, NULL, dir.idx, file_address);
 
-    /* Liberação dos clusters */
-    uint32_t fat_address = bpb_fat_address(bpb);
-    uint32_t cluster_number = dir.fdir.starting_cluster_low;
-    uint32_t null = 0x00000000;  // Em FAT32, o valor de cluster livre é 0x00000000
+    /* Liberação dos clusters (na FAT em memória; vai ao disco na descarga) */
+    uint32_t cluster_number = fat_dir_cluster(&dir.fdir);
     size_t count = 0;
 
     // Continua liberando os clusters até encontrar EOF
     while (cluster_number >= 0x00000002 && cluster_number <= 0x0FFFFFF7) {
-        uint32_t infat_cluster_address = fat_address + cluster_number * 4;  // Cada entrada FAT32 tem 4 bytes
-        uint32_t next_cluster;
-
         // Lê o próximo cluster da FAT
-        read_bytes(fp, infat_cluster_address, &next_cluster, sizeof(uint32_t));
+        uint32_t next = next_cluster(img, bpb, cluster_number);
 
-        // Marca o cluster como livre
-        (void) fseek(fp, infat_cluster_address, SEEK_SET);
-        (void) fwrite(&null, sizeof(uint32_t), 1, fp);
+        // Marca o cluster como livre (em FAT32, o valor de cluster livre é 0x00000000)
+        if (fat_set(img->fat, cluster_number, 0x00000000) != 0)
+            error_at_line(EXIT_FAILURE, errno, __FILE__, __LINE__, "Erro ao atualizar a FAT");
 
-        cluster_number = next_cluster;
+        cluster_number = next;
         count++;
     }
 
     printf("rm %s, %li clusters apagados.\n", filename, count);
-    free(root);
     return;
 }
-uint32_t next_cluster(FILE *fp, struct fat_bpb *bpb, uint32_t cluster) {
-    uint32_t fat_offset = cluster * 4; // Cada entrada na FAT32 tem 4 bytes
-    uint32_t fat_address = bpb_fat_address(bpb) + fat_offset;
-    uint32_t next_cluster;
-
-    if (read_bytes(fp, fat_address, &next_cluster, sizeof(next_cluster)) != RB_OK) {
-        perror("Erro ao ler próximo cluster na FAT");
-        return FAT32_EOF_HI; // Retorna EOF se houver erro
+/*
+ * lê dados de um offset específico na imagem
+ * retorna RB_ERROR em caso de erro ou RB_OK em caso de sucesso
+ */
+int read_bytes(struct fat_image *img, uint64_t offset, void *buff, unsigned int len)
+{
+
+	if (image_pread(img, offset, buff, len) != 0)
+	{
+		error_at_line(0, errno, __FILE__, __LINE__, "warning: error reading %u bytes at %" PRIu64, len, offset);
+		return RB_ERROR;
+	}
+
+	return RB_OK;
+}
+
+/*
+ * escreve dados em um offset específico na imagem
+ * retorna RB_ERROR em caso de erro ou RB_OK em caso de sucesso
+ */
+int write_bytes(struct fat_image *img, uint64_t offset, const void *buff, unsigned int len)
+{
+
+	if (image_pwrite(img, offset, buff, len) != 0)
+	{
+		error_at_line(0, errno, __FILE__, __LINE__, "warning: error writing %u bytes at %" PRIu64, len, offset);
+		return RB_ERROR;
+	}
+
+	return RB_OK;
+}
+
+/* Leituras com buffer movem até tanto de cada vez (dentro de um trecho contíguo). */
+#define DATA_CHUNK (4 * 1024 * 1024)
+
+/*
+ * Libera a cadeia de um arquivo novo que não chegou a ter entrada no
+ * diretório, para que ela não fique ocupando clusters sem dono. Preserva errno.
+ */
+static void free_chain(struct fat_image *img, struct fat_bpb *bpb, uint32_t cluster)
+{
+    int saved = errno;
+
+    for (uint32_t freed = 0; cluster >= 2 && cluster < img->fat->limit && freed < img->fat->limit; freed++) {
+        uint32_t next = next_cluster(img, bpb, cluster);
+        if (fat_set(img->fat, cluster, 0) != 0)
+            break;
+        cluster = next;
     }
 
-    return next_cluster & 0x0FFFFFFF; // Aplica máscara de 28 bits
+    errno = saved;
 }
-struct fat32_newcluster_info fat32_find_free_cluster(FILE* fp, struct fat_bpb* bpb)
+
+/*
+ * Falha depois de alocar a cadeia de um arquivo novo: devolve os clusters
+ * antes de sair, já que no modo batch a FAT ainda é descarregada no atexit().
+ */
+#define CHAIN_ERROR(img, bpb, first, errnum, ...) do {                        \
+        free_chain(img, bpb, first);                                          \
+        error_at_line(EXIT_FAILURE, errnum, __FILE__, __LINE__, __VA_ARGS__); \
+    } while (0)
+
+/* Mapa da cadeia do arquivo em trechos contíguos (ver chain.h). */
+static const struct chain *file_chain(struct fat_image *img, uint32_t cluster)
 {
-    uint32_t cluster = 2;  // Iniciar a busca a partir do cluster 2
-    uint32_t fat_address = bpb_fat_address(bpb);  // Endereço do início da tabela FAT
-    uint32_t total_clusters = bpb_fdata_cluster_count(bpb);  // Total de clusters
+    const struct chain *chain = chain_get(img, cluster);
+    if (chain == NULL)
+        error_at_line(EXIT_FAILURE, errno, __FILE__, __LINE__, "Erro ao seguir a cadeia de clusters");
 
-    // Percorrer todos os clusters disponíveis
-    for (cluster = 2; cluster < total_clusters; cluster++)
-    {
-        uint32_t entry;
-        uint32_t entry_address = fat_address + cluster * 4;  // Cada entrada tem 4 bytes
+    return chain;
+}
 
-        // Ler a entrada correspondente no FAT32
-        (void) read_bytes(fp, entry_address, &entry, sizeof(uint32_t));
+/* Buffer para mover `size` bytes: múltiplo do cluster, até DATA_CHUNK. */
+static size_t chunk_size(uint64_t size, uint32_t cluster_width)
+{
+    uint64_t rounded = (size + cluster_width - 1) / cluster_width * cluster_width;
+    if (rounded == 0)
+        rounded = cluster_width;
 
-        // Verificar se o cluster está livre (entrada 0x00000000)
-        if (entry == 0x00000000)
-        {
-            // Retornar informações sobre o cluster livre encontrado
-            return (struct fat32_newcluster_info) { .cluster = cluster, .address = entry_address };
+    return MIN(rounded, (uint64_t) DATA_CHUNK / cluster_width * cluster_width);
+}
+
+/*
+ * Copia [src, src + len) para [dst, dst + len) dentro da própria imagem sem
+ * passar pelo espaço de usuário: primeiro tenta um clone (reflink) do trecho
+ * alinhado ao bloco do host, e o resto vai por copy_file_range(). Retorna
+ * quantos bytes foram copiados assim; o que faltar (o kernel pode recusar, por
+ * exemplo, a cauda desalinhada no --direct) fica para o caminho com buffer.
+ */
+static uint64_t copy_range(struct fat_image *img, uint64_t src, uint64_t dst, uint64_t len)
+{
+    uint64_t copied = 0;
+
+    /* Reflink: em hosts CoW (btrfs, XFS...) a cópia vira só metadado. */
+    uint64_t aligned = len - len % img->host_block;
+    if (!img->no_clone && aligned != 0 && src % img->host_block == 0 && dst % img->host_block == 0) {
+        struct file_clone_range range = {
+            .src_fd = img->fd, .src_offset = src, .src_length = aligned, .dest_offset = dst
+        };
+
+        if (ioctl(img->fd, FICLONERANGE, &range) == 0) {
+            src += aligned;
+            dst += aligned;
+            len -= aligned;
+            copied += aligned;
+        } else if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV) {
+            /* O host não sabe clonar: não adianta tentar de novo nesta imagem. Outros erros valem só para este trecho. */
+            img->no_clone = true;
         }
     }
 
-    // Se nenhum cluster livre for encontrado, retornar um valor nulo ou de erro
-    return (struct fat32_newcluster_info) { .cluster = 0, .address = 0 };
-}
+    loff_t in = src, out = dst;
 
+    while (len > 0) {
+        ssize_t n = copy_file_range(img->fd, &in, img->fd, &out, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len -= n;
+        copied += n;
+    }
 
-void cp(FILE *fp, char* source, char* dest, struct fat_bpb *bpb)
+    return copied;
+}
+
+void cp(struct fat_image *img, char* source, char* dest, struct fat_bpb *bpb)
 {
     /* Manipulação de diretório */
     char source_rname[FAT32STR_SIZE_WNULL], dest_rname[FAT32STR_SIZE_WNULL];
@@ -240,19 +311,11 @@ void cp(FILE *fp, char* source, char* dest, struct fat_bpb *bpb)
         exit(EXIT_FAILURE);
     }
 
-    uint32_t root_address = bpb_root_dir_address(bpb);
-    uint32_t root_size = sizeof(struct fat_dir) * bpb->n_fat;
-
-    struct fat_dir root[root_size];
-
-    if (read_bytes(fp, root_address, &root, root_size) == RB_ERROR)
-        error_at_line(EXIT_FAILURE, EIO, __FILE__, __LINE__, "Erro ao ler estrutura do diretório raiz");
-
-    struct far_dir_searchres dir1 = find_in_root(root, source_rname, bpb);
+    struct far_dir_searchres dir1 = find_in_root(img, source_rname, bpb);
     if (!dir1.found)
         error(EXIT_FAILURE, 0, "Não foi possível encontrar o arquivo %s.", source);
 
-    if (find_in_root(root, dest_rname, bpb).found)
+    if (find_in_root(img, dest_rname, bpb).found)
         error(EXIT_FAILURE, 0, "Não permitido substituir arquivo %s via cp.", dest);
 
     struct fat_dir new_dir = dir1.fdir;
@@ -260,24 +323,9 @@ void cp(FILE *fp, char* source, char* dest, struct fat_bpb *bpb)
 
     /* Dentry */
 
-    bool dentry_failure = true;
-
-    /* Procura-se uma entrada livre no diretório raiz */
-    for (int i = 0; i < bpb->n_fat; i++) {
-        if (root[i].name[0] == DIR_FREE_ENTRY || root[i].name[0] == '\0') {
-
-            uint32_t dest_address = sizeof(struct fat_dir) * i + root_address;
-
-            (void) fseek(fp, dest_address, SEEK_SET);
-            (void) fwrite(&new_dir, sizeof(struct fat_dir), 1, fp);
-
-            dentry_failure = false;
-            break;
-        }
-    }
-
-    if (dentry_failure)
-        error_at_line(EXIT_FAILURE, ENOSPC, __FILE__, __LINE__, "Não foi possível alocar uma entrada no diretório raiz.");
+    /* Procura-se uma entrada livre no diretório raiz (que cresce, se estiver cheio) */
+    size_t dest_index;
+    uint64_t dest_address = root_free_slot(img, bpb, &dest_index);
 
     /* Agora é necessário alocar os clusters para o novo arquivo. */
 
@@ -285,63 +333,115 @@ void cp(FILE *fp, char* source, char* dest, struct fat_bpb *bpb)
 
     /* Clusters */
     {
-        struct fat32_newcluster_info next_cluster, prev_cluster = { .cluster = FAT32_EOF_LO };
-
-        uint32_t cluster_count = dir1.fdir.file_size / bpb->bytes_p_sect / bpb->sector_p_clust + 1;
-
-        while (cluster_count--) {
-            prev_cluster = next_cluster;
-            next_cluster = fat32_find_free_cluster(fp, bpb); // Função para encontrar um cluster livre
-
-            if (next_cluster.cluster == 0x0)
-                error_at_line(EXIT_FAILURE, EIO, __FILE__, __LINE__, "Disco cheio (imagem foi corrompida)");
+        const uint32_t cluster_width = bpb->bytes_p_sect * bpb->sector_p_clust;
 
-            (void) fseek(fp, next_cluster.address, SEEK_SET);
-            (void) fwrite(&prev_cluster.cluster, sizeof(uint32_t), 1, fp);
+        uint32_t cluster_count = ((uint64_t) dir1.fdir.file_size + cluster_width - 1) / cluster_width;
+        uint32_t first = 0;
 
-            count++;
+        /* A cadeia inteira sai de uma vez do alocador de trechos, contígua sempre que couber. */
+        if (cluster_count != 0) {
+            first = fat32_alloc_chain(img, bpb, cluster_count, NULL, NULL);
+            if (first == 0)
+                error_at_line(EXIT_FAILURE, errno, __FILE__, __LINE__, "Disco cheio");
         }
+        count = cluster_count;
 
         /* O cluster de início é guardado na entrada do diretório. */
-        new_dir.starting_cluster_low = next_cluster.cluster;
-        new_dir.ea_index = prev_cluster.cluster >> 16;  // Ajuste do cluster alto
+        new_dir.starting_cluster_low = first & 0xFFFF;
+        new_dir.ea_index = first >> 16;  // Ajuste do cluster alto
     }
 
     /* Copy */
     {
-        const uint32_t fat_address = bpb_fat_address(bpb);
-        const uint32_t data_region_start = bpb_data_address(bpb);
         const uint32_t cluster_width = bpb->bytes_p_sect * bpb->sector_p_clust;
 
         size_t bytes_to_copy = new_dir.file_size;
 
-        uint32_t source_cluster_number = dir1.fdir.starting_cluster_low;
-        uint32_t destin_cluster_number = new_dir.starting_cluster_low;
+        uint32_t source_cluster_number = fat_dir_cluster(&dir1.fdir);
+        uint32_t destin_cluster_number = fat_dir_cluster(&new_dir);
 
-        while (bytes_to_copy != 0) {
-
-            uint32_t source_cluster_address = cluster_to_address(source_cluster_number, bpb);
-            uint32_t destin_cluster_address = cluster_to_address(destin_cluster_number, bpb);
-
-            size_t copied_in_this_sector = MIN(bytes_to_copy, cluster_width);
-
-            char filedata[cluster_width];
-
-            /* Lê da fonte e escreve no destino */
-            (void) read_bytes(fp, source_cluster_address, filedata, copied_in_this_sector);
-            (void) fseek(fp, destin_cluster_address, SEEK_SET);
-            (void) fwrite(filedata, sizeof(char), copied_in_this_sector, fp);
+        /* Modo io_uring: vários clusters em voo, seguindo a FAT à frente dos dados */
+        if (img->ring != NULL && image_is_aligned(img, bpb_data_address(bpb), cluster_width)) {
+            if (uring_copy_chain(img, bpb, source_cluster_number, destin_cluster_number, -1, bytes_to_copy) != 0)
+                CHAIN_ERROR(img, bpb, destin_cluster_number, errno, "Erro ao copiar clusters");
+            bytes_to_copy = 0;
+        }
 
-            bytes_to_copy -= copied_in_this_sector;
+        struct chain_cursor source, destin;
+        const struct chain *source_chain = chain_get(img, source_cluster_number);
+        const struct chain *destin_chain = source_chain != NULL ? chain_get(img, destin_cluster_number) : NULL;
+        if (destin_chain == NULL)
+            CHAIN_ERROR(img, bpb, destin_cluster_number, errno, "Erro ao seguir a cadeia de clusters");
+        chain_begin(&source, source_chain);
+        chain_begin(&destin, destin_chain);
+
+        /*
+         * Cópia no kernel: cada trecho em que fonte e destino são contíguos ao
+         * mesmo tempo vai inteiro para copy_file_range() (ou vira reflink).
+         */
+        if (bytes_to_copy != 0) {
+            if (image_sync_buffers(img) != 0)
+                CHAIN_ERROR(img, bpb, destin_cluster_number, errno, "Erro ao descarregar escritas pendentes");
+
+            while (bytes_to_copy != 0) {
+                uint64_t source_address, destin_address;
+                uint64_t span = MIN(chain_span(&source, bpb, &source_address),
+                                    chain_span(&destin, bpb, &destin_address));
+                span = MIN(span, bytes_to_copy);
+
+                if (span == 0)
+                    CHAIN_ERROR(img, bpb, destin_cluster_number, EIO, "Cadeia de clusters menor que o arquivo");
+
+                uint64_t copied = copy_range(img, source_address, destin_address, span);
+                image_invalidate(img, destin_address, copied);
+
+                bytes_to_copy -= copied;
+                chain_advance(&source, bpb, copied);
+                chain_advance(&destin, bpb, copied);
+
+                if (copied < span)
+                    break;
+            }
+        }
 
-            uint32_t source_next_cluster_address = fat_address + source_cluster_number * sizeof(uint32_t);
-            uint32_t destin_next_cluster_address = fat_address + destin_cluster_number * sizeof(uint32_t);
+        /* Buffer alinhado ao setor, para o modo --direct */
+        size_t chunk = chunk_size(bytes_to_copy, cluster_width);
+        char *filedata = image_alloc(img, chunk);
+        if (filedata == NULL)
+            CHAIN_ERROR(img, bpb, destin_cluster_number, ENOMEM, "Erro ao alocar buffer de cluster");
 
-            (void) read_bytes(fp, source_next_cluster_address, &source_cluster_number, sizeof(uint32_t));
-            (void) read_bytes(fp, destin_next_cluster_address, &destin_cluster_number, sizeof(uint32_t));
+        while (bytes_to_copy != 0) {
+            uint64_t source_address, destin_address;
+            uint64_t span = MIN(chain_span(&source, bpb, &source_address),
+                                chain_span(&destin, bpb, &destin_address));
+            span = MIN(MIN(span, bytes_to_copy), chunk);
+
+            if (span == 0)
+                CHAIN_ERROR(img, bpb, destin_cluster_number, EIO, "Cadeia de clusters menor que o arquivo");
+
+            /* Lê da fonte (direto do mapeamento, se houver) e escreve no destino */
+            const void *source_data = image_at(img, source_address, span);
+            if (source_data == NULL) {
+                if (read_bytes(img, source_address, filedata, span) == RB_ERROR)
+                    CHAIN_ERROR(img, bpb, destin_cluster_number, EIO, "Erro ao ler clusters");
+                source_data = filedata;
+            }
+            if (write_bytes(img, destin_address, source_data, span) == RB_ERROR)
+                CHAIN_ERROR(img, bpb, destin_cluster_number, EIO, "Erro ao escrever clusters");
+
+            bytes_to_copy -= span;
+            chain_advance(&source, bpb, span);
+            chain_advance(&destin, bpb, span);
         }
+
+        free(filedata);
     }
 
+    /* Só agora, com a cadeia e os dados no lugar, a entrada nova vai para o disco. */
+    if (write_bytes(img, dest_address, &new_dir, sizeof(struct fat_dir)) == RB_ERROR)
+        CHAIN_ERROR(img, bpb, fat_dir_cluster(&new_dir), EIO, "Erro ao gravar a entrada de %s", dest);
+    dir_index_update(img, bpb->root_cluster, NULL, (const char *) new_dir.name, dest_index, dest_address);
+
     printf("cp %s → %s, %i clusters copiados.\n", source, dest, count);
 
     return;
@@ -351,7 +451,38 @@ void cp(FILE *fp, char* source, char* dest, struct fat_bpb *bpb)
 // Adicionamos o uso da função fat32_find_free_cluster() para localizar clusters livres.
 // Garantimos que os cálculos de alocação de clusters e cópia de dados estejam corretos para o FAT32.
 
-void cat(FILE* fp, char* filename, struct fat_bpb* bpb)
+/*
+ * Envia [offset, offset + len) da imagem para out_fd com sendfile(), sem passar
+ * por buffers em espaço de usuário. Retorna -1 se o sendfile() não puder ser
+ * usado (nada foi enviado), para que quem chamou use o caminho com buffer.
+ */
+static int send_range(int out_fd, struct fat_image *img, uint64_t offset, uint64_t len)
+{
+    off_t off = offset;
+    bool sent_any = false;
+
+    while (len > 0) {
+        ssize_t n = sendfile(out_fd, img->fd, &off, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (!sent_any)
+                return -1;
+            error_at_line(EXIT_FAILURE, n < 0 ? errno : EIO, __FILE__, __LINE__, "Erro ao enviar clusters");
+        }
+        sent_any = true;
+        len -= n;
+    }
+
+    return 0;
+}
+
+void cat(struct fat_image* img, char* filename, struct fat_bpb* bpb)
+{
+    cat_range(img, filename, bpb, 0, UINT64_MAX);
+}
+
+void cat_range(struct fat_image* img, char* filename, struct fat_bpb* bpb, uint64_t offset, uint64_t length)
 {
     char rname[FAT32STR_SIZE_WNULL];
     bool badname = cstr_to_fat32wnull(filename, rname); // Converte para o formato de nome compatível
@@ -361,48 +492,273 @@ void cat(FILE* fp, char* filename, struct fat_bpb* bpb)
         exit(EXIT_FAILURE);
     }
 
-    uint32_t root_address = bpb_root_dir_address(bpb);
-    uint32_t root_size    = sizeof(struct fat_dir) * bpb->n_fat;  // Ajuste para FAT32
-    struct fat_dir root[root_size];
-
-    if (read_bytes(fp, root_address, &root, root_size) == RB_ERROR)
-        error_at_line(EXIT_FAILURE, EIO, __FILE__, __LINE__, "Erro ao ler estrutura do diretório raiz");
-
     // Função para buscar no diretório raiz
-    struct far_dir_searchres dir = find_in_root(&root[0], rname, bpb);
+    struct far_dir_searchres dir = find_in_root(img, rname, bpb);
     if (!dir.found)
         error(EXIT_FAILURE, 0, "Não foi possível encontrar o %s.", filename);
 
-    size_t bytes_to_read = dir.fdir.file_size;
-    uint32_t data_region_start = bpb_data_address(bpb);  // Endereço da região de dados
-    uint32_t fat_address = bpb_fat_address(bpb);  // Endereço da tabela FAT
-
-    uint32_t cluster_number = dir.fdir.starting_cluster_low; // FAT32 usa 32 bits para o número do cluster
+    /* O intervalo pedido, cortado no fim do arquivo */
+    if (offset >= dir.fdir.file_size)
+        return;
+    uint64_t bytes_to_read = MIN(length, dir.fdir.file_size - offset);
 
     const uint32_t cluster_width = bpb->bytes_p_sect * bpb->sector_p_clust;
 
-    while (bytes_to_read != 0)
+    /* A posição vem do mapa da cadeia: uma busca binária, sem seguir a FAT. */
+    struct chain_cursor cursor;
+    chain_begin(&cursor, file_chain(img, fat_dir_cluster(&dir.fdir)));
+    chain_seek(&cursor, bpb, offset);
+
+    /* Modo io_uring: vários clusters em voo, saindo em ordem para a stdout */
+    if (img->ring != NULL && offset % cluster_width == 0 && cursor.extent < cursor.chain->count
+     && image_is_aligned(img, bpb_data_address(bpb), cluster_width))
     {
-        // Calcular o endereço físico do cluster
-        uint32_t cluster_address = cluster_to_address(cluster_number, bpb);
-        
-        size_t read_in_this_sector = MIN(bytes_to_read, cluster_width);
-        char filedata[cluster_width];
+        const struct chain_extent *e = &cursor.chain->extents[cursor.extent];
+        uint32_t cluster_number = e->first + cursor.offset / cluster_width;
 
-        // Lê o cluster e imprime no terminal
-        read_bytes(fp, cluster_address, filedata, read_in_this_sector);
-        printf("%.*s", (signed)read_in_this_sector, filedata);
+        fflush(stdout);
+        if (uring_copy_chain(img, bpb, cluster_number, 0, STDOUT_FILENO, bytes_to_read) != 0)
+            error_at_line(EXIT_FAILURE, errno, __FILE__, __LINE__, "Erro ao ler clusters");
+        return;
+    }
 
-        bytes_to_read -= read_in_this_sector;
+    /*
+     * Zero-copy: cada trecho de clusters contíguos vai direto da imagem para a
+     * stdout. Fica de fora no --direct, já que o sendfile() passa pelo page cache.
+     */
+    if (!(img->flags & IMAGE_DIRECT) && bytes_to_read != 0)
+    {
+        fflush(stdout);
+        if (image_sync_buffers(img) != 0)
+            error_at_line(EXIT_FAILURE, errno, __FILE__, __LINE__, "Erro ao descarregar escritas pendentes");
 
-        // Calcular o próximo cluster na FAT32
-        uint32_t next_cluster_address = fat_address + cluster_number * 4;  // FAT32 usa 4 bytes por entrada
-        read_bytes(fp, next_cluster_address, &cluster_number, sizeof(uint32_t));
+        uint64_t address, span;
+        while (bytes_to_read != 0 && (span = MIN(chain_span(&cursor, bpb, &address), bytes_to_read)) != 0)
+        {
+            /* Sem sendfile() para esta saída: segue pelo caminho com buffer. */
+            if (send_range(STDOUT_FILENO, img, address, span) != 0)
+                break;
 
-        // Verificar se atingiu o final do arquivo
-        if (cluster_number >= FAT32_EOF_LO && cluster_number <= FAT32_EOF_HI)
-            break;
+            bytes_to_read -= span;
+            chain_advance(&cursor, bpb, span);
+        }
+    }
+
+    /* Buffer alinhado ao setor, para o modo --direct */
+    size_t chunk = chunk_size(bytes_to_read, cluster_width);
+    char *filedata = image_alloc(img, chunk);
+    if (filedata == NULL)
+        error_at_line(EXIT_FAILURE, ENOMEM, __FILE__, __LINE__, "Erro ao alocar buffer de cluster");
+
+    /* Um trecho contíguo é lido em pedaços de até DATA_CHUNK; a cadeia acaba no EOF. */
+    uint64_t address, span;
+    while (bytes_to_read != 0 && (span = MIN(chain_span(&cursor, bpb, &address), bytes_to_read)) != 0)
+    {
+        span = MIN(span, chunk);
+
+        // Lê o trecho (direto do mapeamento, se houver) e imprime no terminal
+        const char *data = image_at(img, address, span);
+        if (data == NULL) {
+            if (read_bytes(img, address, filedata, span) == RB_ERROR)
+                error_at_line(EXIT_FAILURE, EIO, __FILE__, __LINE__, "Erro ao ler clusters");
+            data = filedata;
+        }
+        if (fwrite(data, 1, span, stdout) != span)
+            error_at_line(EXIT_FAILURE, errno, __FILE__, __LINE__, "Erro ao escrever na saída");
+
+        bytes_to_read -= span;
+        chain_advance(&cursor, bpb, span);
     }
 
+    free(filedata);
     return;
 }
+
+/*
+ * Copia um arquivo da imagem para o sistema de arquivos do host.
+ *
+ * O destino é pré-alocado com fallocate() e a cadeia é lida em trechos
+ * contíguos grandes (até DATA_CHUNK bytes por leitura), em vez de um cluster
+ * por vez. No fim, mostra a vazão obtida.
+ */
+void export(struct fat_image *img, char *source, char *dest, struct fat_bpb *bpb)
+{
+    char rname[FAT32STR_SIZE_WNULL];
+    if (cstr_to_fat32wnull(source, rname))
+    {
+        fprintf(stderr, "Nome de arquivo inválido.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct far_dir_searchres dir = find_in_root(img, rname, bpb);
+    if (!dir.found)
+        error(EXIT_FAILURE, 0, "Não foi possível encontrar o %s.", source);
+
+    int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0)
+        error(EXIT_FAILURE, errno, "Não foi possível criar %s", dest);
+
+    const uint32_t cluster_width = bpb->bytes_p_sect * bpb->sector_p_clust;
+    uint64_t bytes_to_copy = dir.fdir.file_size;
+    uint32_t cluster_number = fat_dir_cluster(&dir.fdir);
+
+    /* Reserva o espaço de uma vez; se o host não suportar, segue sem. */
+    if (bytes_to_copy != 0 && fallocate(out, 0, 0, bytes_to_copy) != 0 && errno == ENOSPC)
+        error(EXIT_FAILURE, errno, "Sem espaço para %s", dest);
+
+    struct chain_cursor cursor;
+    chain_begin(&cursor, file_chain(img, cluster_number));
+
+    size_t chunk = chunk_size(bytes_to_copy, cluster_width);
+    char *buffer = image_alloc(img, chunk);
+    if (buffer == NULL)
+        error_at_line(EXIT_FAILURE, ENOMEM, __FILE__, __LINE__, "Erro ao alocar buffer de exportação");
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t written = 0;
+    while (bytes_to_copy != 0)
+    {
+        uint64_t address;
+        uint64_t run_bytes = MIN(MIN(chain_span(&cursor, bpb, &address), bytes_to_copy), chunk);
+        if (run_bytes == 0)
+            error_at_line(EXIT_FAILURE, EIO, __FILE__, __LINE__, "Cadeia de clusters menor que o arquivo");
+
+        if (read_bytes(img, address, buffer, run_bytes) == RB_ERROR)
+            error_at_line(EXIT_FAILURE, EIO, __FILE__, __LINE__, "Erro ao ler clusters");
+
+        for (uint64_t done = 0; done < run_bytes; )
+        {
+            ssize_t n = write(out, buffer + done, run_bytes - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                error(EXIT_FAILURE, errno, "Erro ao escrever %s", dest);
+            done += n;
+        }
+
+        written += run_bytes;
+        bytes_to_copy -= run_bytes;
+        chain_advance(&cursor, bpb, run_bytes);
+    }
+
+    if (close(out) != 0)
+        error(EXIT_FAILURE, errno, "Erro ao fechar %s", dest);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(buffer);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double mib = written / (1024.0 * 1024.0);
+
+    printf("export %s → %s, %" PRIu64 " bytes em %.3f s (%.1f MiB/s).\n",
+           source, dest, written, seconds, seconds > 0 ? mib / seconds : 0.0);
+}
+
+/*
+ * Copia um arquivo do host para a imagem.
+ *
+ * Os clusters vêm de fat32_alloc_chain(): o menor trecho livre em que o
+ * arquivo cabe inteiro ou, sem um trecho desse tamanho, os maiores trechos até
+ * completar. Os dados seguem em escritas sequenciais grandes, um trecho
+ * contíguo por vez, e a entrada do diretório só é gravada no fim.
+ */
+void import(struct fat_image *img, char *source, char *dest, struct fat_bpb *bpb)
+{
+    char rname[FAT32STR_SIZE_WNULL];
+    if (cstr_to_fat32wnull(dest, rname))
+    {
+        fprintf(stderr, "Nome de arquivo inválido.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (find_in_root(img, rname, bpb).found)
+        error(EXIT_FAILURE, 0, "Não permitido substituir arquivo %s via import.", dest);
+
+    int in = open(source, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) != 0)
+        error(EXIT_FAILURE, errno, "Não foi possível abrir %s", source);
+
+    if (st.st_size > UINT32_MAX)
+        error(EXIT_FAILURE, EFBIG, "%s é grande demais para o FAT32", source);
+
+    /* Só com a origem aberta e dentro do limite o diretório pode crescer para a entrada. */
+    size_t dest_index;
+    uint64_t dest_address = root_free_slot(img, bpb, &dest_index);
+
+    const uint32_t cluster_width = bpb->bytes_p_sect * bpb->sector_p_clust;
+    const uint32_t cluster_count = ((uint64_t) st.st_size + cluster_width - 1) / cluster_width;
+
+    uint32_t *clusters = malloc(sizeof(uint32_t) * (cluster_count + 1));
+    if (clusters == NULL)
+        error_at_line(EXIT_FAILURE, ENOMEM, __FILE__, __LINE__, "Erro ao alocar lista de clusters");
+
+    /* Clusters: o menor trecho livre em que o arquivo cabe, ou os maiores até completar */
+    uint32_t first = 0; // Arquivo vazio não ocupa clusters
+    size_t pieces = 1;
+
+    if (cluster_count != 0)
+    {
+        first = fat32_alloc_chain(img, bpb, cluster_count, clusters, &pieces);
+        if (first == 0)
+            error(EXIT_FAILURE, errno, "Não há espaço na imagem para %s", source);
+    }
+
+    /* Dados: um trecho de clusters contíguos por vez, em escritas de até DATA_CHUNK bytes */
+    char *buffer = image_alloc(img, DATA_CHUNK);
+    if (buffer == NULL)
+        CHAIN_ERROR(img, bpb, first, ENOMEM, "Erro ao alocar buffer de importação");
+
+    uint64_t remaining = st.st_size;
+    for (uint32_t i = 0; i < cluster_count; )
+    {
+        uint32_t run = 1;
+        while (i + run < cluster_count && clusters[i + run] == clusters[i] + run)
+            run++;
+
+        uint64_t address = cluster_to_address(clusters[i], bpb);
+        uint64_t run_bytes = MIN(remaining, (uint64_t) run * cluster_width);
+
+        for (uint64_t done = 0; done < run_bytes; )
+        {
+            ssize_t n = read(in, buffer, MIN(run_bytes - done, DATA_CHUNK));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                free_chain(img, bpb, first);
+                error(EXIT_FAILURE, n < 0 ? errno : EIO, "Erro ao ler %s", source);
+            }
+
+            if (write_bytes(img, address + done, buffer, n) == RB_ERROR)
+                CHAIN_ERROR(img, bpb, first, EIO, "Erro ao escrever clusters");
+            done += n;
+        }
+
+        remaining -= run_bytes;
+        i += run;
+    }
+
+    close(in);
+    free(buffer);
+    free(clusters);
+
+    /* Dentry: só vai para o disco com a cadeia e os dados já no lugar. */
+    struct fat_dir new_dir;
+    memset(&new_dir, 0, sizeof(new_dir));
+    memcpy(new_dir.name, rname, FAT32STR_SIZE);
+    new_dir.attr = DIR_ATTR_ARCHIVE;
+    new_dir.starting_cluster_low = first & 0xFFFF;
+    new_dir.ea_index = first >> 16;
+    new_dir.file_size = st.st_size;
+
+    if (write_bytes(img, dest_address, &new_dir, sizeof(struct fat_dir)) == RB_ERROR)
+        CHAIN_ERROR(img, bpb, first, EIO, "Erro ao gravar a entrada de %s", dest);
+    dir_index_update(img, bpb->root_cluster, NULL, (const char *) new_dir.name, dest_index, dest_address);
+
+    if (pieces == 1)
+        printf("import %s → %s, %" PRIu32 " clusters contíguos.\n", source, dest, cluster_count);
+    else
+        printf("import %s → %s, %" PRIu32 " clusters em %zu trechos.\n", source, dest, cluster_count, pieces);
+}
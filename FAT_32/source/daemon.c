@@ -0,0 +1,613 @@
+#define _GNU_SOURCE
+#include "daemon.h"
+#include "obese32.h"
+#include "fat32.h"
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct server
+{
+	struct obese32 **volumes;
+	int              n;
+
+	pthread_mutex_t lock;
+	pthread_cond_t  ready; // Há conexão na fila, ou o daemon está parando
+	int    queue[DAEMON_BACKLOG]; // Conexões com um pedido por ler
+	size_t head, count;
+	int   *back;           // Conexões atendidas, para voltarem ao ppoll() do accept_loop()
+	size_t back_count, back_cap;
+	int    wake[2];        // Pipe que acorda o accept_loop()
+	int   *active;         // Conexão de cada thread (-1 se nenhuma), para o shutdown()
+	bool   stopping;
+};
+
+struct worker
+{
+	struct server *s;
+	unsigned       id;
+	pthread_t      thread;
+	uint8_t       *buffer; // DAEMON_CHUNK bytes
+};
+
+static volatile sig_atomic_t stop_signal;
+
+static void on_signal(int sig)
+{
+	stop_signal = sig;
+}
+
+/* Socket */
+
+/* Lê exatamente `len` bytes; -1 se a conexão fechou ou falhou. */
+static int recv_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len != 0)
+	{
+		ssize_t n = recv(fd, p, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p   += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int send_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len != 0)
+	{
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p   += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Cabeçalho da resposta e, se houver, os dados (`length` bytes em `data`). */
+static int reply(int fd, int status, uint32_t count, const void *data, uint64_t length)
+{
+	struct daemon_response r = { status, count, status == 0 ? length : 0 };
+
+	if (send_all(fd, &r, sizeof(struct daemon_response)) != 0)
+		return -1;
+	return data != NULL && r.length != 0 ? send_all(fd, data, r.length) : 0;
+}
+
+/* Descarta `len` bytes de dados de um pedido que não vai ser atendido. */
+static int drain(int fd, uint8_t *buffer, uint64_t len)
+{
+	while (len != 0)
+	{
+		size_t n = len < DAEMON_CHUNK ? len : DAEMON_CHUNK;
+		if (recv_all(fd, buffer, n) != 0)
+			return -1;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Operações. As funções serve_* retornam -1 só quando a conexão não tem mais como continuar. */
+
+static int serve_ls(int fd, struct obese32 *vol)
+{
+	struct daemon_entry *entries = NULL;
+	size_t count = 0, cap = 0;
+	uint64_t cookie = 0;
+	struct obese32_stat st;
+	int ret;
+
+	while ((ret = obese32_readdir(vol, &cookie, &st)) == 1)
+	{
+		if (count == cap)
+		{
+			size_t grown = cap ? cap * 2 : 64;
+			struct daemon_entry *e = realloc(entries, grown * sizeof(struct daemon_entry));
+			if (e == NULL)
+			{
+				ret = -ENOMEM;
+				break;
+			}
+			entries = e;
+			cap     = grown;
+		}
+
+		struct daemon_entry *e = &entries[count++];
+		strncpy(e->name, st.name, sizeof(e->name));
+		e->attr    = st.attr;
+		e->size    = st.size;
+		e->cluster = st.cluster;
+	}
+
+	ret = reply(fd, ret, count, entries, count * sizeof(struct daemon_entry));
+	free(entries);
+	return ret;
+}
+
+/*
+ * cat e export: o tamanho vai no cabeçalho, então o intervalo é cortado no fim
+ * do arquivo antes de começar. Se o arquivo encolher no meio do envio, a
+ * resposta não tem como ser completada e a conexão é fechada.
+ */
+static int serve_read(int fd, struct obese32 *vol, const char *name, uint64_t offset, uint64_t length, uint8_t *buffer)
+{
+	struct obese32_stat st;
+	int ret = obese32_stat(vol, name, &st);
+	if (ret != 0)
+		return reply(fd, ret, 0, NULL, 0);
+
+	uint64_t left = offset < st.size ? st.size - offset : 0;
+	length = length < left ? length : left;
+
+	if (reply(fd, 0, 0, NULL, length) != 0)
+		return -1;
+
+	while (length != 0)
+	{
+		size_t n = length < DAEMON_CHUNK ? length : DAEMON_CHUNK;
+		if (obese32_pread(vol, name, buffer, n, offset) != (ssize_t) n || send_all(fd, buffer, n) != 0)
+			return -1;
+		offset += n;
+		length -= n;
+	}
+
+	return 0;
+}
+
+static int serve_cp(struct obese32 *vol, const char *name, const char *dest, uint8_t *buffer)
+{
+	struct obese32_stat st;
+	int ret = obese32_stat(vol, name, &st);
+	if (ret == 0 && (st.attr & DIR_ATTR_DIRECTORY))
+		ret = -EISDIR;
+	if (ret == 0)
+		ret = obese32_create(vol, dest);
+	if (ret != 0)
+		return ret;
+
+	for (uint64_t offset = 0; offset < st.size && ret == 0; offset += DAEMON_CHUNK)
+	{
+		size_t n = st.size - offset < DAEMON_CHUNK ? st.size - offset : DAEMON_CHUNK;
+		ssize_t got = obese32_pread(vol, name, buffer, n, offset);
+
+		if (got < 0)
+			ret = got;
+		else if (got == 0)
+			break; // A origem encolhe enquanto é copiada
+		else if ((got = obese32_pwrite(vol, dest, buffer, got, offset)) < 0)
+			ret = got;
+	}
+
+	if (ret != 0)
+		(void) obese32_unlink(vol, dest);
+	return ret;
+}
+
+/* Os dados vêm do socket em pedaços de DAEMON_CHUNK e vão direto para a imagem. */
+static int serve_import(int fd, struct obese32 *vol, const char *name, uint64_t length, uint8_t *buffer)
+{
+	int ret = length > UINT32_MAX ? -EFBIG : obese32_create(vol, name);
+	bool created = ret == 0;
+
+	for (uint64_t offset = 0; offset < length; )
+	{
+		size_t n = length - offset < DAEMON_CHUNK ? length - offset : DAEMON_CHUNK;
+		if (recv_all(fd, buffer, n) != 0)
+		{
+			if (created)
+				(void) obese32_unlink(vol, name);
+			return -1;
+		}
+
+		if (ret == 0)
+		{
+			ssize_t written = obese32_pwrite(vol, name, buffer, n, offset);
+			if (written < 0)
+				ret = written;
+		}
+		offset += n;
+	}
+
+	if (ret != 0 && created)
+		(void) obese32_unlink(vol, name);
+	return reply(fd, ret, 0, NULL, 0);
+}
+
+/* Um pedido da conexão `fd`; -1 se ela acabou (ou não tem mais como continuar). */
+static int serve(struct worker *w, int fd)
+{
+	struct server *s = w->s;
+	struct daemon_request req;
+	char name[256], dest[256];
+
+	if (recv_all(fd, &req, sizeof(struct daemon_request)) != 0)
+		return -1;
+
+	/* Sem o magic, o resto do fluxo não pode ser interpretado. */
+	if (req.magic != DAEMON_MAGIC)
+	{
+		(void) reply(fd, -EPROTO, 0, NULL, 0);
+		return -1;
+	}
+
+	if (recv_all(fd, name, req.name_len) != 0 || recv_all(fd, dest, req.dest_len) != 0)
+		return -1;
+	name[req.name_len] = '\0';
+	dest[req.dest_len] = '\0';
+
+	bool payload = req.op == DAEMON_IMPORT;
+
+	if (req.volume >= s->n)
+	{
+		if (payload && drain(fd, w->buffer, req.length) != 0)
+			return -1;
+		return reply(fd, -ENODEV, 0, NULL, 0);
+	}
+
+	struct obese32 *vol = s->volumes[req.volume];
+
+	switch (req.op)
+	{
+	case DAEMON_LS:
+		return serve_ls(fd, vol);
+	case DAEMON_CAT:
+		return serve_read(fd, vol, name, req.offset, req.length, w->buffer);
+	case DAEMON_EXPORT:
+		return serve_read(fd, vol, name, 0, UINT64_MAX, w->buffer);
+	case DAEMON_CP:
+		return reply(fd, serve_cp(vol, name, dest, w->buffer), 0, NULL, 0);
+	case DAEMON_RM:
+		return reply(fd, obese32_unlink(vol, name), 0, NULL, 0);
+	case DAEMON_MV:
+		return reply(fd, obese32_rename(vol, name, dest), 0, NULL, 0);
+	case DAEMON_IMPORT:
+		return serve_import(fd, vol, name, req.length, w->buffer);
+	case DAEMON_FLUSH:
+		return reply(fd, obese32_flush(vol), 0, NULL, 0);
+	default:
+		return reply(fd, -EOPNOTSUPP, 0, NULL, 0);
+	}
+}
+
+/* Threads */
+
+/* Acorda o ppoll() do accept_loop(); com o pipe cheio, ele já vai acordar. */
+static void wake_up(struct server *s)
+{
+	char c = 0;
+
+	while (write(s->wake[1], &c, 1) < 0 && errno == EINTR)
+		;
+}
+
+/* Acrescenta `fd` a um vetor de descritores. Retorna 0 ou -1 (sem memória). */
+static int fd_push(int **v, size_t *count, size_t *cap, int fd)
+{
+	if (*count == *cap)
+	{
+		size_t grown = *cap ? *cap * 2 : 64;
+		int *p = realloc(*v, grown * sizeof(int));
+		if (p == NULL)
+			return -1;
+		*v   = p;
+		*cap = grown;
+	}
+
+	(*v)[(*count)++] = fd;
+	return 0;
+}
+
+/* Próxima conexão da fila; -1 quando o daemon está parando. */
+static int next_connection(struct worker *w)
+{
+	struct server *s = w->s;
+	int fd = -1;
+
+	pthread_mutex_lock(&s->lock);
+
+	while (s->count == 0 && !s->stopping)
+		pthread_cond_wait(&s->ready, &s->lock);
+
+	if (!s->stopping)
+	{
+		fd = s->queue[s->head];
+		s->head = (s->head + 1) % DAEMON_BACKLOG;
+		s->active[w->id] = fd;
+
+		/* Com a fila cheia, o accept_loop() parou de olhar as conexões. */
+		if (s->count-- == DAEMON_BACKLOG)
+			wake_up(s);
+	}
+
+	pthread_mutex_unlock(&s->lock);
+	return fd;
+}
+
+/*
+ * Cada vez que tira uma conexão da fila, a thread atende um pedido só e a
+ * devolve ao accept_loop(), que espera o próximo. Um cliente parado entre
+ * pedidos não prende uma thread.
+ */
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct server *s = w->s;
+	int fd;
+
+	while ((fd = next_connection(w)) >= 0)
+	{
+		bool open = serve(w, fd) == 0;
+
+		pthread_mutex_lock(&s->lock);
+		s->active[w->id] = -1;
+		open = open && fd_push(&s->back, &s->back_count, &s->back_cap, fd) == 0;
+		pthread_mutex_unlock(&s->lock);
+
+		if (open)
+			wake_up(s);
+		else
+			close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * Espera, num ppoll() só, por conexões novas e por pedidos nas conexões
+ * abertas, e põe na fila as que têm pedido. Com a fila cheia, só o pipe de
+ * `wake` é olhado, até uma thread abrir espaço. Roda até um SIGINT/SIGTERM,
+ * que só é entregue dentro do ppoll(); no fim, fecha as conexões paradas.
+ */
+static void accept_loop(struct server *s, int listener, const sigset_t *waiting)
+{
+	int           *idle = NULL; // Conexões esperando o próximo pedido
+	size_t         idle_count = 0, idle_cap = 0;
+	struct pollfd *fds = NULL;
+	size_t         fds_cap = 0;
+
+	while (!stop_signal)
+	{
+		/* As conexões devolvidas pelas threads voltam a ser olhadas. */
+		pthread_mutex_lock(&s->lock);
+		bool room = s->count < DAEMON_BACKLOG;
+		for (size_t i = 0; i < s->back_count; i++)
+			if (fd_push(&idle, &idle_count, &idle_cap, s->back[i]) != 0)
+			{
+				error(0, ENOMEM, "Conexão descartada");
+				close(s->back[i]);
+			}
+		s->back_count = 0;
+		pthread_mutex_unlock(&s->lock);
+
+		if (fds_cap < idle_count + 2)
+		{
+			struct pollfd *grown = realloc(fds, (idle_cap + 2) * sizeof(struct pollfd));
+			if (grown == NULL)
+			{
+				error(0, ENOMEM, "Erro ao esperar conexões");
+				break;
+			}
+			fds     = grown;
+			fds_cap = idle_cap + 2;
+		}
+
+		nfds_t polled = room ? idle_count : 0;
+		fds[0] = (struct pollfd) { .fd = s->wake[0], .events = POLLIN };
+		fds[1] = (struct pollfd) { .fd = listener, .events = room ? POLLIN : 0 };
+		for (size_t i = 0; i < polled; i++)
+			fds[2 + i] = (struct pollfd) { .fd = idle[i], .events = POLLIN };
+
+		if (ppoll(fds, 2 + polled, NULL, waiting) < 0)
+		{
+			if (errno != EINTR)
+				error(0, errno, "Erro ao esperar conexões");
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN)
+		{
+			char drain[64];
+			while (read(s->wake[0], drain, sizeof(drain)) > 0)
+				;
+		}
+
+		/* Pedido (ou fim da conexão) vai para a fila, enquanto houver espaço. */
+		pthread_mutex_lock(&s->lock);
+		size_t kept = 0;
+		for (size_t i = 0; i < idle_count; i++)
+		{
+			if (i < polled && fds[2 + i].revents != 0 && s->count < DAEMON_BACKLOG)
+			{
+				s->queue[(s->head + s->count++) % DAEMON_BACKLOG] = idle[i];
+				pthread_cond_signal(&s->ready);
+			}
+			else
+				idle[kept++] = idle[i];
+		}
+		idle_count = kept;
+		pthread_mutex_unlock(&s->lock);
+
+		if (fds[1].revents & POLLIN)
+		{
+			int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+			if (fd < 0)
+			{
+				if (errno != EINTR && errno != ECONNABORTED)
+					error(0, errno, "Erro ao aceitar conexão");
+			}
+			else if (fd_push(&idle, &idle_count, &idle_cap, fd) != 0)
+			{
+				error(0, ENOMEM, "Conexão descartada");
+				close(fd);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < idle_count; i++)
+		close(idle[i]);
+	free(idle);
+	free(fds);
+}
+
+static int listen_on(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path))
+		error(EXIT_FAILURE, ENAMETOOLONG, "%s", path);
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		error(EXIT_FAILURE, errno, "Não foi possível criar o socket");
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+		error(EXIT_FAILURE, errno, "Não foi possível usar %s", path);
+
+	if (listen(fd, DAEMON_BACKLOG) != 0)
+	{
+		unlink(path);
+		error(EXIT_FAILURE, errno, "Não foi possível escutar em %s", path);
+	}
+
+	return fd;
+}
+
+int daemon_run(const char *socket_path, char **images, int n, int flags, unsigned workers)
+{
+	if (n > UINT8_MAX + 1)
+		error(EXIT_FAILURE, E2BIG, "No máximo %d imagens", UINT8_MAX + 1);
+
+	struct server s = { .n = n };
+	s.volumes = calloc(n, sizeof(struct obese32 *));
+	s.active  = malloc(workers * sizeof(int));
+	struct worker *pool = calloc(workers, sizeof(struct worker));
+	if (s.volumes == NULL || s.active == NULL || pool == NULL)
+		error_at_line(EXIT_FAILURE, ENOMEM, __FILE__, __LINE__, "Erro ao alocar o daemon");
+
+	for (int i = 0; i < n; i++)
+	{
+		int ret = obese32_open(images[i], flags, &s.volumes[i]);
+		if (ret != 0)
+			error(EXIT_FAILURE, -ret, "Não foi possível abrir %s", images[i]);
+	}
+
+	int listener = listen_on(socket_path);
+
+	/* Os sinais ficam bloqueados em todas as threads e só chegam no ppoll() do accept_loop(). */
+	sigset_t blocked, waiting;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGINT);
+	sigaddset(&blocked, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &blocked, &waiting);
+	sigdelset(&waiting, SIGINT);
+	sigdelset(&waiting, SIGTERM);
+
+	struct sigaction sa = { .sa_handler = on_signal };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (pipe2(s.wake, O_CLOEXEC | O_NONBLOCK) != 0)
+		error(EXIT_FAILURE, errno, "Não foi possível criar o pipe do daemon");
+
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.ready, NULL);
+
+	unsigned started = 0;
+	int err = 0;
+	for (; started < workers; started++)
+	{
+		struct worker *w = &pool[started];
+		*w = (struct worker) { .s = &s, .id = started, .buffer = malloc(DAEMON_CHUNK) };
+		s.active[started] = -1;
+
+		err = w->buffer == NULL ? ENOMEM : pthread_create(&w->thread, NULL, worker_main, w);
+		if (err != 0)
+		{
+			free(w->buffer);
+			break;
+		}
+	}
+
+	int status = EXIT_SUCCESS;
+	if (started == 0)
+	{
+		error(0, err, "Não foi possível criar as threads do daemon");
+		status = EXIT_FAILURE;
+	}
+	else
+	{
+		printf("%d imagem(ns) em %s, %u threads\n", n, socket_path, started);
+		fflush(stdout);
+		accept_loop(&s, listener, &waiting);
+	}
+
+	close(listener);
+	unlink(socket_path);
+
+	/*
+	 * Para as threads: o pedido em andamento termina, e o shutdown() corta a
+	 * leitura de um pedido que ainda esteja chegando.
+	 */
+	pthread_mutex_lock(&s.lock);
+	s.stopping = true;
+	for (unsigned i = 0; i < started; i++)
+		if (s.active[i] >= 0)
+			shutdown(s.active[i], SHUT_RD);
+	pthread_cond_broadcast(&s.ready);
+	pthread_mutex_unlock(&s.lock);
+
+	for (unsigned i = 0; i < started; i++)
+	{
+		pthread_join(pool[i].thread, NULL);
+		free(pool[i].buffer);
+	}
+
+	for (; s.count != 0; s.count--, s.head = (s.head + 1) % DAEMON_BACKLOG)
+		close(s.queue[s.head]);
+	for (size_t i = 0; i < s.back_count; i++)
+		close(s.back[i]);
+
+	for (int i = 0; i < n; i++)
+	{
+		int ret = obese32_close(s.volumes[i]);
+		if (ret != 0)
+		{
+			error(0, -ret, "Erro ao gravar %s", images[i]);
+			status = EXIT_FAILURE;
+		}
+	}
+
+	pthread_cond_destroy(&s.ready);
+	pthread_mutex_destroy(&s.lock);
+	close(s.wake[0]);
+	close(s.wake[1]);
+	free(pool);
+	free(s.back);
+	free(s.active);
+	free(s.volumes);
+
+	return status;
+}
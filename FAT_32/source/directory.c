@@ -0,0 +1,484 @@
+#include "directory.h"
+#include "dirscan.h"
+#include "alloc.h"
+#include "fattable.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+int dir_open(struct dir_iter *it, struct fat_image *img, struct fat_bpb *bpb, uint32_t cluster)
+{
+	memset(it, 0, sizeof(struct dir_iter));
+	it->img = img;
+	it->bpb = bpb;
+
+	if (chain_lookup(img, cluster, &it->chain) != 0)
+		return -1;
+
+	const uint32_t cluster_width = bpb->bytes_p_sect * bpb->sector_p_clust;
+
+	it->buffer = image_alloc(img, cluster_width);
+	if (it->buffer == NULL)
+	{
+		chain_free(&it->chain);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	chain_begin(&it->cursor, &it->chain);
+	it->per_cluster = cluster_width / sizeof(struct fat_dir);
+	it->next        = it->per_cluster; // Nada lido ainda
+	return 0;
+}
+
+/* Deixa no buffer um cluster com entradas por ler; false no fim da cadeia ou em erro. */
+static bool dir_fill(struct dir_iter *it)
+{
+	if (it->done)
+		return false;
+	if (it->next < it->per_cluster)
+		return true;
+
+	/* Buffer esgotado: o próximo cluster da cadeia */
+	const uint32_t cluster_width = it->per_cluster * sizeof(struct fat_dir);
+	uint64_t address;
+
+	if (chain_span(&it->cursor, it->bpb, &address) == 0)
+	{
+		it->index = it->base != 0 ? it->first + it->per_cluster : 0;
+		it->done  = true;
+		return false;
+	}
+
+	if (image_pread(it->img, address, it->buffer, cluster_width) != 0)
+	{
+		it->error = errno;
+		it->done  = true;
+		return false;
+	}
+
+	chain_advance(&it->cursor, it->bpb, cluster_width);
+
+	if (it->base != 0)
+		it->first += it->per_cluster;
+	it->base = address;
+	it->next = 0;
+	return true;
+}
+
+/* Devolve a entrada `k` do buffer, ou NULL (e o fim da leitura) se ela marcar o fim. */
+static const struct fat_dir *dir_take(struct dir_iter *it, size_t k)
+{
+	const struct fat_dir *entry = &it->buffer[k];
+	uint64_t address = it->base + k * sizeof(struct fat_dir);
+
+	it->index = it->first + k;
+
+	if (entry->name[0] == '\0')
+	{
+		it->end  = address;
+		it->done = true;
+		return NULL;
+	}
+
+	it->next    = k + 1;
+	it->address = address;
+	return entry;
+}
+
+const struct fat_dir *dir_next(struct dir_iter *it)
+{
+	return dir_fill(it) ? dir_take(it, it->next) : NULL;
+}
+
+const struct fat_dir *dir_next_named(struct dir_iter *it, const char *name)
+{
+	while (dir_fill(it))
+	{
+		size_t k = it->next + dir_scan_name(&it->buffer[it->next], it->per_cluster - it->next, name);
+		if (k < it->per_cluster)
+			return dir_take(it, k);
+
+		it->next = it->per_cluster;
+	}
+
+	return NULL;
+}
+
+const struct fat_dir *dir_next_free(struct dir_iter *it)
+{
+	while (dir_fill(it))
+	{
+		size_t k = it->next + dir_scan_free(&it->buffer[it->next], it->per_cluster - it->next);
+		if (k < it->per_cluster)
+			return dir_take(it, k);
+
+		it->next = it->per_cluster;
+	}
+
+	return NULL;
+}
+
+void dir_close(struct dir_iter *it)
+{
+	free(it->buffer);
+	chain_free(&it->chain);
+	it->buffer = NULL;
+}
+
+/* Emenda um cluster zerado no fim da cadeia do diretório; retorna o endereço dele ou 0. */
+static uint64_t dir_grow(struct fat_image *img, struct fat_bpb *bpb, const struct chain *c)
+{
+	if (c->count == 0)
+	{
+		errno = ENOSPC;
+		return 0;
+	}
+
+	const uint32_t cluster_width = bpb->bytes_p_sect * bpb->sector_p_clust;
+	const struct chain_extent *e = &c->extents[c->count - 1];
+
+	uint32_t cluster = fat32_alloc_chain(img, bpb, 1, NULL, NULL);
+	if (cluster == 0)
+		return 0;
+
+	void *zeros = image_alloc(img, cluster_width);
+	if (zeros == NULL)
+	{
+		(void) fat_set(img->fat, cluster, 0);
+		errno = ENOMEM;
+		return 0;
+	}
+	memset(zeros, 0, cluster_width);
+
+	uint64_t address = cluster_to_address(cluster, bpb);
+	int ret = image_pwrite(img, address, zeros, cluster_width);
+	free(zeros);
+
+	if (ret != 0 || fat_set(img->fat, e->first + e->length - 1, cluster) != 0)
+	{
+		int saved = errno;
+		(void) fat_set(img->fat, cluster, 0);
+		errno = saved;
+		return 0;
+	}
+
+	return address;
+}
+
+uint64_t dir_free_slot(struct fat_image *img, struct fat_bpb *bpb, uint32_t cluster, size_t *index)
+{
+	struct dir_iter it;
+	if (dir_open(&it, img, bpb, cluster) != 0)
+		return 0;
+
+	uint64_t address = 0;
+
+	/* Sem entrada apagada: a marca de fim ou, com a cadeia cheia, um cluster novo. */
+	if (dir_next_free(&it) != NULL)
+		address = it.address;
+	else if (it.error == 0)
+		address = it.end != 0 ? it.end : dir_grow(img, bpb, &it.chain);
+	else
+		errno = it.error;
+
+	if (index != NULL)
+		*index = it.index;
+
+	dir_close(&it);
+	return address;
+}
+
+/* Índice de nomes */
+
+/* FNV-1a dos 11 bytes do nome */
+static uint64_t name_hash(const char *name)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < FAT32STR_SIZE; i++)
+	{
+		h ^= (uint8_t) name[i];
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+/* Posição de `name` na tabela, ou NULL */
+static struct dir_name *index_probe(struct dir_index *ix, const char *name)
+{
+	if (ix->cap == 0)
+		return NULL;
+
+	for (size_t i = name_hash(name) & (ix->cap - 1); ; i = (i + 1) & (ix->cap - 1))
+	{
+		struct dir_name *n = &ix->table[i];
+
+		if (n->state == DIR_NAME_EMPTY)
+			return NULL;
+		if (n->state == DIR_NAME_USED && memcmp(n->name, name, FAT32STR_SIZE) == 0)
+			return n;
+	}
+}
+
+/* Refaz a tabela com `cap` posições, deixando para trás os nomes removidos. */
+static int index_resize(struct dir_index *ix, size_t cap)
+{
+	struct dir_name *table = calloc(cap, sizeof(struct dir_name));
+	if (table == NULL)
+		return -1;
+
+	for (size_t k = 0; k < ix->cap; k++)
+	{
+		if (ix->table[k].state != DIR_NAME_USED)
+			continue;
+
+		size_t i = name_hash(ix->table[k].name) & (cap - 1);
+		while (table[i].state != DIR_NAME_EMPTY)
+			i = (i + 1) & (cap - 1);
+		table[i] = ix->table[k];
+	}
+
+	free(ix->table);
+	ix->table = table;
+	ix->cap   = cap;
+	ix->gone  = 0;
+	return 0;
+}
+
+/* Insere `name`, se ainda não estiver na tabela. Retorna 0 ou -1 (sem memória). */
+static int index_insert(struct dir_index *ix, const char *name, size_t index, uint64_t address)
+{
+	/* Ocupação máxima de metade, contando as posições de nomes removidos */
+	if ((ix->used + ix->gone + 1) * 2 > ix->cap)
+	{
+		size_t cap = ix->cap != 0 ? ix->cap : 64;
+		while ((ix->used + 1) * 2 > cap)
+			cap *= 2;
+		if (index_resize(ix, cap) != 0)
+			return -1;
+	}
+
+	struct dir_name *slot = NULL;
+	for (size_t i = name_hash(name) & (ix->cap - 1); ; i = (i + 1) & (ix->cap - 1))
+	{
+		struct dir_name *n = &ix->table[i];
+
+		if (n->state == DIR_NAME_USED && memcmp(n->name, name, FAT32STR_SIZE) == 0)
+		{
+			ix->repeated |= n->address != address;
+			return 0;
+		}
+		if (n->state == DIR_NAME_GONE && slot == NULL)
+			slot = n;
+		if (n->state == DIR_NAME_EMPTY)
+		{
+			if (slot == NULL)
+				slot = n;
+			break;
+		}
+	}
+
+	if (slot->state == DIR_NAME_GONE)
+		ix->gone--;
+
+	memcpy(slot->name, name, FAT32STR_SIZE);
+	slot->state   = DIR_NAME_USED;
+	slot->index   = index;
+	slot->address = address;
+	ix->used++;
+	return 0;
+}
+
+static void index_drop(struct dir_index *ix)
+{
+	free(ix->table);
+	memset(ix, 0, sizeof(struct dir_index));
+}
+
+/* Lê o diretório inteiro para a tabela. Retorna 0 ou -1 (com errno). */
+static int index_build(struct dir_index *ix, struct fat_image *img, struct fat_bpb *bpb, uint32_t cluster)
+{
+	index_drop(ix);
+
+	struct dir_iter it;
+	if (dir_open(&it, img, bpb, cluster) != 0)
+		return -1;
+
+	int ret = 0;
+
+	/*
+	 * dir_scan_free() acha a próxima entrada apagada ou a marca de fim; as
+	 * anteriores estão todas em uso e entram sem olhar o primeiro byte.
+	 */
+	while (ret == 0 && dir_fill(&it))
+	{
+		size_t end = it.next + dir_scan_free(&it.buffer[it.next], it.per_cluster - it.next);
+
+		for (size_t k = it.next; ret == 0 && k < end; k++)
+		{
+			const struct fat_dir *entry = dir_take(&it, k);
+
+			// Ignora nomes longos (LFN) e o rótulo do volume
+			if (entry->attr & DIR_ATTR_VOLUMEID)
+				continue;
+
+			if (index_insert(ix, (const char *) entry->name, it.index, it.address) != 0)
+			{
+				errno = ENOMEM;
+				ret = -1;
+			}
+		}
+
+		// A apagada fica de fora; a marca de fim encerra a leitura
+		if (ret == 0 && end < it.per_cluster)
+			(void) dir_take(&it, end);
+	}
+
+	if (ret == 0 && it.error != 0)
+	{
+		errno = it.error;
+		ret = -1;
+	}
+
+	dir_close(&it);
+
+	if (ret != 0)
+		index_drop(ix);
+	else
+		ix->cluster = cluster;
+	return ret;
+}
+
+/* Índice do diretório em cache, ou NULL; chamar com a trava. */
+static struct dir_index *index_cached(struct dir_index_cache *cache, uint32_t cluster)
+{
+	for (size_t i = 0; i < DIR_INDEX_CACHE_SIZE; i++)
+		if (cache->slots[i].cluster == cluster && cluster != 0)
+		{
+			cache->slots[i].last = ++cache->tick;
+			return &cache->slots[i];
+		}
+
+	return NULL;
+}
+
+/* Índice do diretório, montado no lugar do usado há mais tempo se preciso; chamar com a trava. */
+static struct dir_index *index_get(struct dir_index_cache *cache, struct fat_image *img, struct fat_bpb *bpb, uint32_t cluster)
+{
+	struct dir_index *ix = index_cached(cache, cluster);
+	if (ix != NULL)
+		return ix;
+
+	ix = &cache->slots[0];
+	for (size_t i = 1; i < DIR_INDEX_CACHE_SIZE; i++)
+		if (cache->slots[i].last < ix->last)
+			ix = &cache->slots[i];
+
+	if (index_build(ix, img, bpb, cluster) != 0)
+		return NULL;
+
+	ix->last = ++cache->tick;
+	return ix;
+}
+
+struct dir_index_cache *dir_index_cache_create(void)
+{
+	struct dir_index_cache *cache = calloc(1, sizeof(struct dir_index_cache));
+	if (cache == NULL)
+		return NULL;
+
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+void dir_index_cache_free(struct dir_index_cache *cache)
+{
+	if (cache == NULL)
+		return;
+
+	for (size_t i = 0; i < DIR_INDEX_CACHE_SIZE; i++)
+		free(cache->slots[i].table);
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+int dir_index_find(struct fat_image *img, struct fat_bpb *bpb, uint32_t cluster, const char *name, struct dir_location *loc)
+{
+	struct dir_index_cache *cache = img->names;
+	int ret = 0;
+
+	pthread_mutex_lock(&cache->lock);
+
+	/* Na segunda volta, o índice acabou de ser montado e a entrada tem de bater. */
+	for (int pass = 0; pass < 2; pass++)
+	{
+		struct dir_index *ix = index_get(cache, img, bpb, cluster);
+		if (ix == NULL)
+		{
+			ret = -1;
+			break;
+		}
+
+		const struct dir_name *n = index_probe(ix, name);
+		if (n == NULL)
+			break;
+
+		if (image_pread(img, n->address, &loc->entry, sizeof(struct fat_dir)) != 0)
+		{
+			ret = -1;
+			break;
+		}
+
+		if (memcmp(loc->entry.name, name, FAT32STR_SIZE) == 0 && !(loc->entry.attr & DIR_ATTR_VOLUMEID))
+		{
+			loc->index   = n->index;
+			loc->address = n->address;
+			ret = 1;
+			break;
+		}
+
+		index_drop(ix);
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+void dir_index_update(struct fat_image *img, uint32_t cluster, const char *old, const char *new,
+                      size_t index, uint64_t address)
+{
+	struct dir_index_cache *cache = img->names;
+
+	pthread_mutex_lock(&cache->lock);
+
+	struct dir_index *ix = index_cached(cache, cluster);
+	if (ix != NULL)
+	{
+		struct dir_name *n = old != NULL ? index_probe(ix, old) : NULL;
+
+		/*
+		 * Se o índice não tinha o nome antigo nessa entrada, ele não bate com o
+		 * disco; com nomes repetidos, tirar um pode revelar o outro. Nos dois
+		 * casos ele é montado de novo na próxima busca.
+		 */
+		if (old != NULL && (n == NULL || n->address != address || ix->repeated))
+			index_drop(ix);
+		else
+		{
+			if (n != NULL)
+			{
+				n->state = DIR_NAME_GONE;
+				ix->used--;
+				ix->gone++;
+			}
+
+			if (new != NULL && index_insert(ix, new, index, address) != 0)
+				index_drop(ix);
+		}
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+}
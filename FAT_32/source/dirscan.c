@@ -0,0 +1,289 @@
+#include "dirscan.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define DIR_SCAN_X86
+#endif
+
+_Static_assert(sizeof(struct fat_dir) == 32, "entradas de diretório de 32 bytes");
+
+/* Escalar */
+
+static size_t scan_name_scalar(const struct fat_dir *entries, size_t count, const char *name)
+{
+	for (size_t i = 0; i < count; i++)
+		if (entries[i].name[0] == '\0' || memcmp(entries[i].name, name, FAT32STR_SIZE) == 0)
+			return i;
+
+	return count;
+}
+
+static size_t scan_free_scalar(const struct fat_dir *entries, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		if (entries[i].name[0] == '\0' || entries[i].name[0] == DIR_FREE_ENTRY)
+			return i;
+
+	return count;
+}
+
+#ifdef DIR_SCAN_X86
+
+/*
+ * O nome é comparado em três palavras de 32 bits: bytes 0-3, 4-7 e 8-10 (o
+ * byte 11, o atributo, fica de fora pela máscara). Cada registrador leva a
+ * mesma palavra de várias entradas, então uma comparação cobre todas elas.
+ */
+struct name_words
+{
+	int32_t w0, w1, w2;
+};
+
+#define WORD2_MASK 0x00FFFFFF
+
+static struct name_words name_split(const char *name)
+{
+	struct name_words n = { 0 };
+
+	memcpy(&n.w0, name, 4);
+	memcpy(&n.w1, name + 4, 4);
+	memcpy(&n.w2, name + 8, FAT32STR_SIZE - 8);
+	return n;
+}
+
+/* SSE2: 4 entradas por volta, transpostas com unpack para uma palavra por registrador */
+
+/* As palavras 0, 1 e 2 (as pedidas, não NULL) das entradas e[0..3] */
+__attribute__((always_inline))
+static inline void sse2_words(const struct fat_dir *e, __m128i *d0, __m128i *d1, __m128i *d2)
+{
+	__m128i v0 = _mm_loadu_si128((const __m128i *) &e[0]);
+	__m128i v1 = _mm_loadu_si128((const __m128i *) &e[1]);
+	__m128i v2 = _mm_loadu_si128((const __m128i *) &e[2]);
+	__m128i v3 = _mm_loadu_si128((const __m128i *) &e[3]);
+
+	__m128i lo01 = _mm_unpacklo_epi32(v0, v1), lo23 = _mm_unpacklo_epi32(v2, v3);
+
+	*d0 = _mm_unpacklo_epi64(lo01, lo23);
+	if (d1 != NULL)
+		*d1 = _mm_unpackhi_epi64(lo01, lo23);
+	if (d2 != NULL)
+		*d2 = _mm_unpacklo_epi64(_mm_unpackhi_epi32(v0, v1), _mm_unpackhi_epi32(v2, v3));
+}
+
+static size_t scan_name_sse2(const struct fat_dir *entries, size_t count, const char *name)
+{
+	const struct name_words n = name_split(name);
+	const __m128i q0 = _mm_set1_epi32(n.w0), q1 = _mm_set1_epi32(n.w1), q2 = _mm_set1_epi32(n.w2);
+	const __m128i mask = _mm_set1_epi32(WORD2_MASK), low = _mm_set1_epi32(0xFF), zero = _mm_setzero_si128();
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i d0, d1, d2;
+		sse2_words(&entries[i], &d0, &d1, &d2);
+
+		__m128i eq  = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi32(d0, q0), _mm_cmpeq_epi32(d1, q1)),
+		                            _mm_cmpeq_epi32(_mm_and_si128(d2, mask), q2));
+		__m128i end = _mm_cmpeq_epi32(_mm_and_si128(d0, low), zero);
+
+		unsigned hit = _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(eq, end)));
+		if (hit != 0)
+			return i + __builtin_ctz(hit);
+	}
+
+	return i + scan_name_scalar(entries + i, count - i, name);
+}
+
+/* Aqui só importa o primeiro byte: os de 16 entradas são empacotados num registrador. */
+static size_t scan_free_sse2(const struct fat_dir *entries, size_t count)
+{
+	const __m128i low = _mm_set1_epi32(0xFF), zero = _mm_setzero_si128();
+	const __m128i gone = _mm_set1_epi8((char) DIR_FREE_ENTRY);
+
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i a, b, c, d;
+		sse2_words(&entries[i], &a, NULL, NULL);
+		sse2_words(&entries[i + 4], &b, NULL, NULL);
+		sse2_words(&entries[i + 8], &c, NULL, NULL);
+		sse2_words(&entries[i + 12], &d, NULL, NULL);
+
+		__m128i first = _mm_packus_epi16(_mm_packs_epi32(_mm_and_si128(a, low), _mm_and_si128(b, low)),
+		                                 _mm_packs_epi32(_mm_and_si128(c, low), _mm_and_si128(d, low)));
+
+		unsigned hit = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(first, zero), _mm_cmpeq_epi8(first, gone)));
+		if (hit != 0)
+			return i + __builtin_ctz(hit);
+	}
+
+	return i + scan_free_scalar(entries + i, count - i);
+}
+
+/*
+ * AVX2: a mesma transposição, com as entradas e[0..3] na metade de baixo do
+ * registrador e e[k..k+3] na de cima (o unpack age em cada metade).
+ */
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i avx2_pair(const struct fat_dir *lo, const struct fat_dir *hi)
+{
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) lo)),
+	                               _mm_loadu_si128((const __m128i *) hi), 1);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void avx2_words(const struct fat_dir *e, size_t k, __m256i *d0, __m256i *d1, __m256i *d2)
+{
+	__m256i v0 = avx2_pair(&e[0], &e[k]);
+	__m256i v1 = avx2_pair(&e[1], &e[k + 1]);
+	__m256i v2 = avx2_pair(&e[2], &e[k + 2]);
+	__m256i v3 = avx2_pair(&e[3], &e[k + 3]);
+
+	__m256i lo01 = _mm256_unpacklo_epi32(v0, v1), lo23 = _mm256_unpacklo_epi32(v2, v3);
+
+	*d0 = _mm256_unpacklo_epi64(lo01, lo23);
+	if (d1 != NULL)
+		*d1 = _mm256_unpackhi_epi64(lo01, lo23);
+	if (d2 != NULL)
+		*d2 = _mm256_unpacklo_epi64(_mm256_unpackhi_epi32(v0, v1), _mm256_unpackhi_epi32(v2, v3));
+}
+
+/* 8 entradas por volta: e[0..3] e e[4..7], na ordem */
+__attribute__((target("avx2")))
+static size_t scan_name_avx2(const struct fat_dir *entries, size_t count, const char *name)
+{
+	const struct name_words n = name_split(name);
+	const __m256i q0 = _mm256_set1_epi32(n.w0), q1 = _mm256_set1_epi32(n.w1), q2 = _mm256_set1_epi32(n.w2);
+	const __m256i mask = _mm256_set1_epi32(WORD2_MASK), low = _mm256_set1_epi32(0xFF), zero = _mm256_setzero_si256();
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i d0, d1, d2;
+		avx2_words(&entries[i], 4, &d0, &d1, &d2);
+
+		__m256i eq  = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi32(d0, q0), _mm256_cmpeq_epi32(d1, q1)),
+		                               _mm256_cmpeq_epi32(_mm256_and_si256(d2, mask), q2));
+		__m256i end = _mm256_cmpeq_epi32(_mm256_and_si256(d0, low), zero);
+
+		unsigned hit = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_or_si256(eq, end)));
+		if (hit != 0)
+			return i + __builtin_ctz(hit);
+	}
+
+	/* O resto vai para o código SSE2, que não pode encontrar as metades de cima sujas. */
+	_mm256_zeroupper();
+	return i + scan_name_sse2(entries + i, count - i, name);
+}
+
+/*
+ * 32 entradas por volta. Cada metade do pack junta os primeiros bytes de 16
+ * entradas, então a metade de baixo cobre e[0..15] e a de cima, e[16..31].
+ */
+__attribute__((target("avx2")))
+static size_t scan_free_avx2(const struct fat_dir *entries, size_t count)
+{
+	const __m256i low = _mm256_set1_epi32(0xFF), zero = _mm256_setzero_si256();
+	const __m256i gone = _mm256_set1_epi8((char) DIR_FREE_ENTRY);
+
+	size_t i = 0;
+	for (; i + 32 <= count; i += 32)
+	{
+		__m256i a, b, c, d;
+		avx2_words(&entries[i], 16, &a, NULL, NULL);
+		avx2_words(&entries[i + 4], 16, &b, NULL, NULL);
+		avx2_words(&entries[i + 8], 16, &c, NULL, NULL);
+		avx2_words(&entries[i + 12], 16, &d, NULL, NULL);
+
+		__m256i first = _mm256_packus_epi16(_mm256_packs_epi32(_mm256_and_si256(a, low), _mm256_and_si256(b, low)),
+		                                    _mm256_packs_epi32(_mm256_and_si256(c, low), _mm256_and_si256(d, low)));
+
+		uint32_t hit = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(first, zero), _mm256_cmpeq_epi8(first, gone)));
+		if (hit != 0)
+			return i + __builtin_ctz(hit);
+	}
+
+	_mm256_zeroupper();
+	return i + scan_free_sse2(entries + i, count - i);
+}
+
+#endif
+
+/* Escolha da implementação */
+
+static struct
+{
+	size_t (*name)(const struct fat_dir *, size_t, const char *);
+	size_t (*free)(const struct fat_dir *, size_t);
+} scanner;
+
+static pthread_once_t scanner_once = PTHREAD_ONCE_INIT;
+
+static void scanner_pick(void)
+{
+	scanner.name = scan_name_scalar;
+	scanner.free = scan_free_scalar;
+
+#ifdef DIR_SCAN_X86
+	scanner.name = scan_name_sse2;
+	scanner.free = scan_free_sse2;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		scanner.name = scan_name_avx2;
+		scanner.free = scan_free_avx2;
+	}
+#endif
+}
+
+int dir_scan_use(enum dir_scan_isa isa)
+{
+	pthread_once(&scanner_once, scanner_pick);
+
+	switch (isa)
+	{
+	case DIR_SCAN_SCALAR:
+		scanner.name = scan_name_scalar;
+		scanner.free = scan_free_scalar;
+		return 0;
+
+#ifdef DIR_SCAN_X86
+	case DIR_SCAN_SSE2:
+		scanner.name = scan_name_sse2;
+		scanner.free = scan_free_sse2;
+		return 0;
+
+	case DIR_SCAN_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			break;
+		scanner.name = scan_name_avx2;
+		scanner.free = scan_free_avx2;
+		return 0;
+#endif
+
+	default:
+		break;
+	}
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+size_t dir_scan_name(const struct fat_dir *entries, size_t count, const char *name)
+{
+	pthread_once(&scanner_once, scanner_pick);
+	return scanner.name(entries, count, name);
+}
+
+size_t dir_scan_free(const struct fat_dir *entries, size_t count)
+{
+	pthread_once(&scanner_once, scanner_pick);
+	return scanner.free(entries, count);
+}
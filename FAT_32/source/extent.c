@@ -0,0 +1,321 @@
+#include "extent.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Ordem do índice por tamanho: (length, start) */
+static bool length_less(const struct extent *a, const struct extent *b)
+{
+	return a->length < b->length || (a->length == b->length && a->start < b->start);
+}
+
+static bool key_less(int tree, const struct extent *a, const struct extent *b)
+{
+	return tree == EXTENT_BY_START ? a->start < b->start : length_less(a, b);
+}
+
+/* Treap */
+
+/* Insere `n` (sem filhos) na árvore `tree`, subindo-o por rotações conforme a prioridade. */
+static struct extent_node *tree_insert(struct extent_node *root, struct extent_node *n, int tree)
+{
+	if (root == NULL)
+		return n;
+
+	int dir = key_less(tree, &root->e, &n->e);
+	root->child[tree][dir] = tree_insert(root->child[tree][dir], n, tree);
+
+	struct extent_node *c = root->child[tree][dir];
+	if (c->priority <= root->priority)
+		return root;
+
+	root->child[tree][dir] = c->child[tree][!dir];
+	c->child[tree][!dir]   = root;
+	return c;
+}
+
+/* Junta duas árvores em que todas as chaves de `a` são menores que as de `b`. */
+static struct extent_node *tree_join(struct extent_node *a, struct extent_node *b, int tree)
+{
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+
+	if (a->priority > b->priority)
+	{
+		a->child[tree][1] = tree_join(a->child[tree][1], b, tree);
+		return a;
+	}
+
+	b->child[tree][0] = tree_join(a, b->child[tree][0], tree);
+	return b;
+}
+
+/* Tira `n` (que precisa estar lá, com a chave atual) da árvore `tree`. */
+static struct extent_node *tree_remove(struct extent_node *root, struct extent_node *n, int tree)
+{
+	if (root == n)
+	{
+		struct extent_node *joined = tree_join(n->child[tree][0], n->child[tree][1], tree);
+		n->child[tree][0] = n->child[tree][1] = NULL;
+		return joined;
+	}
+
+	int dir = key_less(tree, &root->e, &n->e);
+	root->child[tree][dir] = tree_remove(root->child[tree][dir], n, tree);
+	return root;
+}
+
+/* Trecho com o maior início <= `start`, ou NULL. */
+static struct extent_node *start_floor(struct extent_set *s, uint32_t start)
+{
+	struct extent_node *n = s->root[EXTENT_BY_START], *best = NULL;
+
+	while (n != NULL)
+	{
+		if (n->e.start <= start)
+		{
+			best = n;
+			n = n->child[EXTENT_BY_START][1];
+		}
+		else
+			n = n->child[EXTENT_BY_START][0];
+	}
+
+	return best;
+}
+
+/* Menor trecho que não é menor que `key` no índice por tamanho, ou NULL. */
+static struct extent_node *length_ceil(struct extent_set *s, const struct extent *key)
+{
+	struct extent_node *n = s->root[EXTENT_BY_LENGTH], *best = NULL;
+
+	while (n != NULL)
+	{
+		if (!length_less(&n->e, key))
+		{
+			best = n;
+			n = n->child[EXTENT_BY_LENGTH][0];
+		}
+		else
+			n = n->child[EXTENT_BY_LENGTH][1];
+	}
+
+	return best;
+}
+
+/* Maior trecho menor que `key` no índice por tamanho (o maior de todos, com NULL), ou NULL. */
+static struct extent_node *length_below(struct extent_set *s, const struct extent *key)
+{
+	struct extent_node *n = s->root[EXTENT_BY_LENGTH], *best = NULL;
+
+	while (n != NULL)
+	{
+		if (key == NULL || length_less(&n->e, key))
+		{
+			best = n;
+			n = n->child[EXTENT_BY_LENGTH][1];
+		}
+		else
+			n = n->child[EXTENT_BY_LENGTH][0];
+	}
+
+	return best;
+}
+
+/* Conjunto */
+
+/* xorshift32: as prioridades só precisam ser espalhadas. */
+static uint32_t next_priority(struct extent_set *s)
+{
+	uint32_t x = s->seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return s->seed = x;
+}
+
+/* Acrescenta um trecho novo (sem vizinhos no conjunto) nos dois índices. */
+static int add(struct extent_set *s, struct extent e)
+{
+	struct extent_node *n = calloc(1, sizeof(struct extent_node));
+	if (n == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	n->e        = e;
+	n->priority = next_priority(s);
+	s->root[EXTENT_BY_START]  = tree_insert(s->root[EXTENT_BY_START], n, EXTENT_BY_START);
+	s->root[EXTENT_BY_LENGTH] = tree_insert(s->root[EXTENT_BY_LENGTH], n, EXTENT_BY_LENGTH);
+	s->count++;
+	return 0;
+}
+
+/* Remove o trecho dos dois índices e o libera. */
+static void drop(struct extent_set *s, struct extent_node *n)
+{
+	s->root[EXTENT_BY_START]  = tree_remove(s->root[EXTENT_BY_START], n, EXTENT_BY_START);
+	s->root[EXTENT_BY_LENGTH] = tree_remove(s->root[EXTENT_BY_LENGTH], n, EXTENT_BY_LENGTH);
+	s->count--;
+	free(n);
+}
+
+/*
+ * Troca o trecho de `n` por `e`. O novo início nunca passa por outro trecho
+ * (só encosta nos vizinhos), então o índice por início continua em ordem e só
+ * o por tamanho precisa recolocar o nó.
+ */
+static void change(struct extent_set *s, struct extent_node *n, struct extent e)
+{
+	s->root[EXTENT_BY_LENGTH] = tree_remove(s->root[EXTENT_BY_LENGTH], n, EXTENT_BY_LENGTH);
+	n->e = e;
+	s->root[EXTENT_BY_LENGTH] = tree_insert(s->root[EXTENT_BY_LENGTH], n, EXTENT_BY_LENGTH);
+}
+
+int extent_set_build(struct extent_set *s, const struct extent *sorted, size_t n)
+{
+	memset(s, 0, sizeof(struct extent_set));
+	s->seed = 0x9E3779B9u;
+
+	for (size_t i = 0; i < n; i++)
+		if (add(s, sorted[i]) != 0)
+		{
+			extent_set_free(s);
+			return -1;
+		}
+
+	return 0;
+}
+
+static void free_nodes(struct extent_node *n)
+{
+	while (n != NULL)
+	{
+		struct extent_node *right = n->child[EXTENT_BY_START][1];
+		free_nodes(n->child[EXTENT_BY_START][0]);
+		free(n);
+		n = right;
+	}
+}
+
+void extent_set_free(struct extent_set *s)
+{
+	free_nodes(s->root[EXTENT_BY_START]);
+	memset(s, 0, sizeof(struct extent_set));
+}
+
+int extent_set_insert(struct extent_set *s, uint32_t start, uint32_t length)
+{
+	struct extent_node *left  = start_floor(s, start);
+	struct extent_node *right = start_floor(s, start + length);
+
+	if (left != NULL && left->e.start + left->e.length != start)
+		left = NULL;
+	if (right != NULL && right->e.start != start + length)
+		right = NULL;
+
+	if (left != NULL && right != NULL)
+	{
+		struct extent e = { left->e.start, left->e.length + length + right->e.length };
+		drop(s, right);
+		change(s, left, e);
+	}
+	else if (left != NULL)
+		change(s, left, (struct extent) { left->e.start, left->e.length + length });
+	else if (right != NULL)
+		change(s, right, (struct extent) { start, right->e.length + length });
+	else
+		return add(s, (struct extent) { start, length });
+
+	return 0;
+}
+
+int extent_set_erase(struct extent_set *s, uint32_t start, uint32_t length)
+{
+	struct extent_node *n = start_floor(s, start);
+	uint32_t end = start + length;
+
+	if (n == NULL || end > n->e.start + n->e.length)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+
+	struct extent e = n->e;
+
+	if (start == e.start && end == e.start + e.length)
+		drop(s, n);
+	else if (start == e.start)
+		change(s, n, (struct extent) { end, e.length - length });
+	else if (end == e.start + e.length)
+		change(s, n, (struct extent) { e.start, e.length - length });
+	else
+	{
+		/* No meio: o trecho vira dois. */
+		if (add(s, (struct extent) { end, e.start + e.length - end }) != 0)
+			return -1;
+		change(s, n, (struct extent) { e.start, start - e.start });
+	}
+
+	return 0;
+}
+
+uint32_t extent_set_next(struct extent_set *s, uint32_t from)
+{
+	struct extent_node *n = start_floor(s, from);
+	if (n != NULL && from < n->e.start + n->e.length)
+		return from;
+
+	/* Senão, o início do primeiro trecho depois de `from`. */
+	struct extent_node *best = NULL;
+	for (n = s->root[EXTENT_BY_START]; n != NULL; )
+	{
+		if (n->e.start > from)
+		{
+			best = n;
+			n = n->child[EXTENT_BY_START][0];
+		}
+		else
+			n = n->child[EXTENT_BY_START][1];
+	}
+
+	return best != NULL ? best->e.start : 0;
+}
+
+size_t extent_set_plan(struct extent_set *s, uint32_t count, struct extent *out, size_t max)
+{
+	size_t   n = 0;
+	uint32_t remaining = count;
+
+	/* Os trechos já usados são os de chave >= `used`, e não são olhados de novo. */
+	const struct extent *used = NULL;
+
+	while (remaining > 0 && n < max)
+	{
+		struct extent key = { 0, remaining };
+		struct extent_node *fit = length_ceil(s, &key);
+
+		if (fit != NULL && (used == NULL || length_less(&fit->e, used)))
+		{
+			out[n++] = (struct extent) { fit->e.start, remaining };
+			remaining = 0;
+		}
+		else
+		{
+			struct extent_node *largest = length_below(s, used);
+			if (largest == NULL)
+				break;
+
+			out[n++]   = largest->e;
+			remaining -= largest->e.length;
+			used       = &largest->e;
+		}
+	}
+
+	return remaining == 0 ? n : 0;
+}
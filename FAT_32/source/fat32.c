@@ -1,33 +1,49 @@
 #include "fat32.h"
+#include "fattable.h"
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
-#include <error.h>
-#include <err.h>
+
+/*
+ * Todos os endereços são calculados em 64 bits: num volume FAT32 de até 2 TiB,
+ * tanto as FATs quanto os clusters de dados podem ficar além dos 4 GiB.
+ */
 
 /* calcular endereço da FAT */
-uint32_t bpb_fat_address(struct fat_bpb *bpb) {
-    return bpb->reserved_sect * bpb->bytes_p_sect;
+uint64_t bpb_fat_address(struct fat_bpb *bpb) {
+    return (uint64_t) bpb->reserved_sect * bpb->bytes_p_sect;
 }
 /* calculate FAT root address */
-uint32_t bpb_froot_addr(struct fat_bpb *bpb) {
-    return bpb_data_address(bpb) + (bpb->root_cluster - 2) * bpb->sector_p_clust * bpb->bytes_p_sect;
+uint64_t bpb_froot_addr(struct fat_bpb *bpb) {
+    return cluster_to_address(bpb->root_cluster, bpb);
 }
-uint32_t bpb_faddress(struct fat_bpb *bpb)
+uint64_t bpb_faddress(struct fat_bpb *bpb)
 {
-	return bpb->reserved_sect * bpb->bytes_p_sect;
+	return (uint64_t) bpb->reserved_sect * bpb->bytes_p_sect;
 }
-/* calcular endereço do diretório raiz */
-uint32_t cluster_to_address(uint32_t cluster, struct fat_bpb *bpb) {
-    uint32_t first_data_sector = bpb->reserved_sect + (bpb->n_fat * bpb->sect_per_fat);
-    uint32_t cluster_offset = (cluster - 2) * bpb->sector_p_clust;
+/* calcular endereço físico de um cluster */
+uint64_t cluster_to_address(uint32_t cluster, struct fat_bpb *bpb) {
+    uint64_t first_data_sector = bpb->reserved_sect + ((uint64_t) bpb->n_fat * bpb->sect_per_fat);
+    uint64_t cluster_offset = (uint64_t) (cluster - 2) * bpb->sector_p_clust;
     return (first_data_sector + cluster_offset) * bpb->bytes_p_sect;
 }
-uint32_t bpb_root_dir_address(struct fat_bpb *bpb) {
-    return bpb_data_address(bpb) + (bpb->root_cluster - 2) * bpb->sector_p_clust * bpb->bytes_p_sect;
+/* calcular endereço do diretório raiz */
+uint64_t bpb_root_dir_address(struct fat_bpb *bpb) {
+    return cluster_to_address(bpb->root_cluster, bpb);
 }
-uint32_t bpb_fdata_addr(struct fat_bpb *bpb) {
+uint64_t bpb_fdata_addr(struct fat_bpb *bpb) {
     // Considera o endereço dos dados (baseado no setor de dados)
-    return bpb_fat_address(bpb) + (bpb->root_cluster - 2) * bpb->sector_p_clust * bpb->bytes_p_sect;
+    return bpb_data_address(bpb);
+}
+/* endereço da entrada de `cluster` na FAT de índice `copy` */
+uint64_t fat_entry_address(uint32_t cluster, uint8_t copy, struct fat_bpb *bpb) {
+    uint64_t fat_size = (uint64_t) bpb->sect_per_fat * bpb->bytes_p_sect;
+    return bpb_fat_address(bpb) + copy * fat_size + (uint64_t) cluster * 4;
+}
+/* primeiro cluster de um arquivo: a parte alta fica em ea_index no FAT32 */
+uint32_t fat_dir_cluster(const struct fat_dir *dir) {
+    return ((uint32_t) dir->ea_index << 16) | dir->starting_cluster_low;
 }
 uint32_t bpb_fdata_sector_count(struct fat_bpb *bpb) {
     // Aqui você pode calcular a quantidade de setores baseando-se nos campos do BPB
@@ -44,8 +60,8 @@ uint32_t bpb_fdata_sector_count_s(struct fat_bpb *bpb) {
     return bpb->large_n_sects - bpb->reserved_sect - (bpb->n_fat * bpb->sect_per_fat);
 }
 /* calcular endereço da região de dados */
-uint32_t bpb_data_address(struct fat_bpb *bpb) {
-    return bpb_fat_address(bpb) + (bpb->n_fat * bpb->sect_per_fat * bpb->bytes_p_sect);
+uint64_t bpb_data_address(struct fat_bpb *bpb) {
+    return bpb_fat_address(bpb) + ((uint64_t) bpb->n_fat * bpb->sect_per_fat * bpb->bytes_p_sect);
 }
 
 /* calcular quantidade de setores de dados */
@@ -67,29 +83,48 @@ uint32_t bpb_data_cluster_count(struct fat_bpb *bpb) {
 //     return data_address;
 // }
 
+static bool power_of_two(uint32_t x)
+{
+	return x != 0 && (x & (x - 1)) == 0;
+}
+
+/* O mínimo para que os cálculos de endereço façam sentido */
+static bool bpb_valid(struct fat_bpb *bpb, uint64_t image_size)
+{
+	return power_of_two(bpb->bytes_p_sect) && bpb->bytes_p_sect >= 512 && bpb->bytes_p_sect <= 4096
+	    && power_of_two(bpb->sector_p_clust)
+	    && bpb->n_fat != 0 && bpb->sect_per_fat != 0 && bpb->root_cluster >= 2
+	    && bpb_data_address(bpb) < image_size;
+}
+
 /*
- * lê dados de um offset específico no arquivo
- * retorna RB_ERROR em caso de erro ou RB_OK em caso de sucesso
+ * lê o BPB do FAT32 e carrega a FAT em memória
+ * retorna 0, ou -1 com errno (EINVAL se o BPB não descrever um FAT32 que caiba na imagem)
  */
-int read_bytes(FILE *fp, unsigned int offset, void *buff, unsigned int len)
-{
+int rfat(struct fat_image *img, struct fat_bpb *bpb) {
+    if (image_pread(img, 0x0, bpb, sizeof(struct fat_bpb)) != 0)
+        return -1;
+
+    if (!bpb_valid(bpb, img->size)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* A FAT é lida uma vez só; daqui em diante as entradas vêm da memória */
+    struct fat_table *fat = fat_table_load(img, bpb);
+    if (fat == NULL)
+        return -1;
+
+    fat_table_free(img->fat);
+    img->fat = fat;
+    return 0;
+}
+
+uint32_t next_cluster(struct fat_image *img, struct fat_bpb *bpb, uint32_t cluster) {
+    (void) bpb;
 
-	if (fseek(fp, offset, SEEK_SET) != 0)
-	{
-		error_at_line(0, errno, __FILE__, __LINE__, "warning: error when seeking to %u", offset);
-		return RB_ERROR;
-	}
-	if (fread(buff, 1, len, fp) != len)
-	{
-		error_at_line(0, errno, __FILE__, __LINE__, "warning: error reading file");
-		return RB_ERROR;
-	}
-
-	return RB_OK;
-}
-/* lê o BPB do FAT32 */
-void rfat(FILE *fp, struct fat_bpb *bpb) {
-    read_bytes(fp, 0x0, bpb, sizeof(struct fat_bpb));
+    // A FAT inteira está em memória: seguir a cadeia não faz E/S
+    return fat_get(img->fat, cluster); // Já com a máscara de 28 bits
 }
 
 /* outras funções auxiliares podem ser implementadas aqui */
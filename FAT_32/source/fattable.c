@@ -0,0 +1,1035 @@
+#include "fattable.h"
+#include "fat32.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+/* Trechos sujos separados por até tantos setores limpos vão numa escrita só. */
+#define FAT_FLUSH_GAP 8
+
+#define EXT_FLAGS_NOMIRROR (1 << 7) /* só a FAT ativa (bits 0-3) está em uso */
+
+/* Threads começam a procurar clusters livres em regiões diferentes do volume. */
+#define FAT_CURSOR_SPREAD 16
+
+/* Setor FSInfo */
+#define FSINFO_LEAD_SIG   0x41615252
+#define FSINFO_STRUCT_SIG 0x61417272
+#define FSINFO_LEAD        0   /* offset da assinatura inicial */
+#define FSINFO_STRUCT    484   /* offset da segunda assinatura */
+#define FSINFO_FREE      488   /* clusters livres (0xFFFFFFFF = desconhecido) */
+#define FSINFO_NEXT      492   /* dica do próximo cluster livre */
+
+/* A expandida é a cópia da FAT em disco, lida e gravada byte a byte. */
+_Static_assert(sizeof(_Atomic uint32_t) == sizeof(uint32_t), "entradas atômicas de 4 bytes");
+
+/* Trechos */
+
+static uint32_t run_len(const struct fat_run *r)
+{
+	return r->length & ~FAT_RUN_UNIFORM;
+}
+
+static uint32_t run_end(const struct fat_run *r)
+{
+	return r->start + run_len(r);
+}
+
+/* Um trecho de uma entrada serve tanto como encadeado quanto como uniforme. */
+static bool run_linked(const struct fat_run *r)
+{
+	return !(r->length & FAT_RUN_UNIFORM) || run_len(r) == 1;
+}
+
+static bool run_uniform(const struct fat_run *r)
+{
+	return (r->length & FAT_RUN_UNIFORM) || run_len(r) == 1;
+}
+
+static uint32_t run_value(const struct fat_run *r, uint32_t cluster)
+{
+	if ((r->length & FAT_RUN_UNIFORM) || cluster == run_end(r) - 1)
+		return r->next;
+
+	return cluster + 1;
+}
+
+/* Índice do trecho que contém `cluster` entre os `n` primeiros de `runs` (busca binária). */
+static size_t run_search(const struct fat_run *runs, size_t n, uint32_t cluster)
+{
+	size_t lo = 0, hi = n;
+
+	while (hi - lo > 1)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (runs[mid].start <= cluster)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static size_t run_find(struct fat_table *t, uint32_t cluster)
+{
+	return run_search(t->runs, t->nruns, cluster);
+}
+
+/*
+ * Abre `n` posições a partir de `at`. O vetor cresce para um novo, e o
+ * antigo fica aposentado até fat_table_free(): um leitor sem trava pode
+ * ainda estar nele. O vetor novo é publicado antes do novo `nruns`.
+ */
+static int runs_insert(struct fat_table *t, size_t at, size_t n)
+{
+	if (t->nruns + n > t->runs_cap)
+	{
+		size_t cap = t->runs_cap ? t->runs_cap * 2 : 1024;
+		while (cap < t->nruns + n)
+			cap *= 2;
+
+		struct fat_run **retired = realloc(t->retired, (t->nretired + 1) * sizeof(struct fat_run *));
+		struct fat_run  *runs    = malloc(cap * sizeof(struct fat_run));
+		if (retired != NULL)
+			t->retired = retired;
+		if (retired == NULL || runs == NULL)
+		{
+			free(runs);
+			errno = ENOMEM;
+			return -1;
+		}
+
+		struct fat_run *old = t->runs;
+		if (old != NULL)
+		{
+			memcpy(runs, old, t->nruns * sizeof(struct fat_run));
+			t->retired[t->nretired++] = old;
+			t->retired_size += t->runs_cap * sizeof(struct fat_run);
+		}
+
+		atomic_store_explicit(&t->runs, runs, memory_order_release);
+		t->runs_cap = cap;
+	}
+
+	memmove(&t->runs[at + n], &t->runs[at], (t->nruns - at) * sizeof(struct fat_run));
+	t->nruns += n;
+	return 0;
+}
+
+/* Junta os trechos `i` e `i + 1` se o resultado ainda for um trecho só. */
+static bool runs_merge(struct fat_table *t, size_t i)
+{
+	if (i + 1 >= t->nruns)
+		return false;
+
+	struct fat_run *a = &t->runs[i], *b = &t->runs[i + 1];
+	uint32_t length = run_len(a) + run_len(b);
+
+	if (run_linked(a) && run_linked(b) && a->next == b->start)
+		a->length = length;
+	else if (run_uniform(a) && run_uniform(b) && a->next == b->next)
+		a->length = length | FAT_RUN_UNIFORM;
+	else
+		return false;
+
+	a->next = b->next;
+	memmove(&t->runs[i + 1], &t->runs[i + 2], (t->nruns - i - 2) * sizeof(struct fat_run));
+	t->nruns--;
+	return true;
+}
+
+/* Acrescenta a entrada seguinte (cluster == fim do último trecho) na carga. */
+static int runs_append(struct fat_table *t, uint32_t cluster, uint32_t value)
+{
+	if (runs_insert(t, t->nruns, 1) != 0)
+		return -1;
+
+	t->runs[t->nruns - 1] = (struct fat_run) { .start = cluster, .length = 1, .next = value };
+	if (t->nruns > 1)
+		(void) runs_merge(t, t->nruns - 2);
+
+	return 0;
+}
+
+static int runs_set(struct fat_table *t, uint32_t cluster, uint32_t value)
+{
+	size_t i = run_find(t, cluster);
+	struct fat_run r = t->runs[i];
+
+	if (run_value(&r, cluster) == value)
+		return 0;
+
+	/* Divide em até três: [start, cluster), {cluster}, (cluster, fim). */
+	bool left  = cluster > r.start;
+	bool right = cluster < run_end(&r) - 1;
+
+	if (runs_insert(t, i + 1, left + right) != 0)
+		return -1;
+
+	uint32_t uniform = r.length & FAT_RUN_UNIFORM;
+	size_t   at = i;
+
+	if (left)
+	{
+		t->runs[at++] = (struct fat_run) {
+			.start  = r.start,
+			.length = (cluster - r.start) | uniform,
+			.next   = uniform ? r.next : cluster,
+		};
+	}
+
+	size_t mid = at;
+	t->runs[at++] = (struct fat_run) { .start = cluster, .length = 1, .next = value };
+
+	if (right)
+	{
+		t->runs[at] = (struct fat_run) {
+			.start  = cluster + 1,
+			.length = (run_end(&r) - cluster - 1) | uniform,
+			.next   = r.next,
+		};
+	}
+
+	/*
+	 * E junta de novo com os vizinhos, se possível. Um trecho que acabou de
+	 * se juntar pode mudar de tipo (um de uma entrada vira uniforme) e passar
+	 * a se juntar também com o seguinte, então repete enquanto der.
+	 */
+	while (runs_merge(t, mid))
+		;
+	if (mid > 0)
+		while (runs_merge(t, mid - 1))
+			;
+
+	return 0;
+}
+
+/* Bitmap de clusters livres */
+
+/* Só na carga, antes de a tabela ser compartilhada. */
+static void free_map_set(struct fat_table *t, uint32_t from, uint32_t to)
+{
+	for (uint32_t c = from < 2 ? 2 : from; c < to && c < t->limit; c++)
+	{
+		atomic_fetch_or_explicit(&t->free_map[c / 64], (uint64_t) 1 << (c % 64), memory_order_relaxed);
+		atomic_fetch_add_explicit(&t->free_count, 1, memory_order_relaxed);
+	}
+}
+
+static uint64_t free_word(struct fat_table *t, uint32_t w)
+{
+	return atomic_load_explicit(&t->free_map[w], memory_order_acquire);
+}
+
+/* Primeiro cluster em [from, limit) cujo bit vale `want`, ou limit. */
+static uint32_t free_map_scan(struct fat_table *t, uint32_t from, bool want)
+{
+	if (from >= t->limit)
+		return t->limit;
+
+	uint32_t w    = from / 64;
+	uint64_t word = (want ? free_word(t, w) : ~free_word(t, w)) & (~(uint64_t) 0 << (from % 64));
+
+	while (word == 0)
+	{
+		if (++w >= (t->limit + 63) / 64)
+			return t->limit;
+		word = want ? free_word(t, w) : ~free_word(t, w);
+	}
+
+	uint32_t c = w * 64 + __builtin_ctzll(word);
+	return c < t->limit ? c : t->limit;
+}
+
+static void free_map_build(struct fat_table *t)
+{
+	atomic_store(&t->free_count, 0);
+
+	for (uint32_t c = 2; c < t->limit; c++)
+		if ((atomic_load_explicit(&t->entries[c], memory_order_relaxed) & 0x0FFFFFFF) == 0)
+			free_map_set(t, c, c + 1);
+}
+
+/* Lista de trechos livres da carga, em ordem; [from, to) vizinho do último é juntado a ele. */
+struct extent_list
+{
+	struct extent *items;
+	size_t n, cap;
+};
+
+static int extent_list_add(struct extent_list *l, uint32_t from, uint32_t to)
+{
+	if (l->n > 0 && l->items[l->n - 1].start + l->items[l->n - 1].length == from)
+	{
+		l->items[l->n - 1].length += to - from;
+		return 0;
+	}
+
+	if (l->n == l->cap)
+	{
+		size_t cap = l->cap ? l->cap * 2 : 1024;
+		struct extent *grown = realloc(l->items, cap * sizeof(struct extent));
+		if (grown == NULL)
+			return -1;
+		l->items = grown;
+		l->cap   = cap;
+	}
+
+	l->items[l->n++] = (struct extent) { from, to - from };
+	return 0;
+}
+
+/*
+ * Trechos livres. Na representação expandida saem do bitmap; na compacta, que
+ * não tem bitmap, direto dos trechos da FAT: um trecho uniforme com `next` 0
+ * é todo livre, um encadeado só tem a última entrada valendo 0. A contagem
+ * de livres da compacta também sai daqui.
+ */
+static int free_extents_build(struct fat_table *t)
+{
+	struct extent_list l = { 0 };
+	int ret = 0;
+
+	if (t->entries != NULL)
+	{
+		for (uint32_t c = free_map_scan(t, 2, true); c < t->limit && ret == 0; )
+		{
+			uint32_t end = free_map_scan(t, c, false);
+			ret = extent_list_add(&l, c, end);
+			c = free_map_scan(t, end, true);
+		}
+	}
+	else
+	{
+		uint64_t count = 0;
+
+		for (size_t i = 0; i < t->nruns && t->runs[i].start < t->limit && ret == 0; i++)
+		{
+			struct fat_run *r = &t->runs[i];
+			uint32_t from = run_uniform(r) ? r->start : run_end(r) - 1;
+			uint32_t to   = run_end(r) < t->limit ? run_end(r) : t->limit;
+
+			if (from < 2)
+				from = 2;
+			if (r->next != 0 || from >= to)
+				continue;
+
+			ret = extent_list_add(&l, from, to);
+			count += to - from;
+		}
+
+		atomic_store(&t->free_count, (uint32_t) count);
+	}
+
+	if (ret == 0)
+		ret = extent_set_build(&t->free_extents, l.items, l.n);
+
+	free(l.items);
+	return ret;
+}
+
+/* Lê o FSInfo; a contagem de livres vem do bitmap, a dica vem do disco. */
+static void fsinfo_load(struct fat_image *img, struct fat_table *t, struct fat_bpb *bpb)
+{
+	uint32_t sector[128];
+
+	atomic_store(&t->next_free, 2);
+	if (bpb->fs_info == 0 || bpb->fs_info == 0xFFFF || bpb->bytes_p_sect < sizeof(sector))
+		return;
+
+	uint64_t address = (uint64_t) bpb->fs_info * bpb->bytes_p_sect;
+	if (image_pread(img, address, sector, sizeof(sector)) != 0
+	 || sector[FSINFO_LEAD / 4] != FSINFO_LEAD_SIG || sector[FSINFO_STRUCT / 4] != FSINFO_STRUCT_SIG)
+		return;
+
+	t->fsinfo = address;
+	if (sector[FSINFO_NEXT / 4] >= 2 && sector[FSINFO_NEXT / 4] < t->limit)
+		atomic_store(&t->next_free, sector[FSINFO_NEXT / 4]);
+
+	/* Contagem desatualizada (ou desconhecida) é corrigida na próxima descarga. */
+	atomic_store(&t->fsinfo_dirty, sector[FSINFO_FREE / 4] != atomic_load(&t->free_count));
+}
+
+/* Tabela */
+
+struct fat_table *fat_table_load(struct fat_image *img, struct fat_bpb *bpb)
+{
+	static _Atomic uint64_t tables;
+
+	struct fat_table *t = calloc(1, sizeof(struct fat_table));
+	if (t == NULL)
+		return NULL;
+
+	pthread_mutex_init(&t->lock, NULL);
+
+	t->id = atomic_fetch_add(&tables, 1) + 1;
+
+	t->sector_size = bpb->bytes_p_sect;
+	t->sectors     = bpb->sect_per_fat;
+	t->copy_size   = (uint64_t) bpb->sect_per_fat * bpb->bytes_p_sect;
+	t->address     = bpb_fat_address(bpb);
+	t->count       = t->copy_size / sizeof(uint32_t);
+	t->copies      = bpb->n_fat;
+	t->limit       = bpb_fdata_cluster_count(bpb) + 2;
+
+	if (t->limit > t->count)
+		t->limit = t->count;
+
+	if (bpb->ext_flags & EXT_FLAGS_NOMIRROR)
+	{
+		t->first_copy = bpb->ext_flags & 0x0F;
+		t->copies     = 1;
+	}
+
+	bool compact = (img->flags & IMAGE_COMPACT_FAT) || t->copy_size > FAT_COMPACT_THRESHOLD;
+
+	/* Na representação compacta a FAT passa por um buffer só do tamanho de um pedaço. */
+	uint32_t *chunk = NULL;
+	if (compact)
+		chunk = malloc(IMAGE_BUFSZ);
+	else
+		t->entries = malloc(t->copy_size);
+
+	/* Só a expandida tem bitmap; na compacta o espaço livre fica só nos trechos. */
+	t->dirty = calloc((t->sectors + 63) / 64, sizeof(uint64_t));
+	if (!compact)
+		t->free_map = calloc((t->limit + 63) / 64 + 1, sizeof(_Atomic uint64_t));
+	if ((compact ? chunk == NULL : t->entries == NULL) || t->dirty == NULL || (!compact && t->free_map == NULL)
+	 || t->sector_size == 0)
+	{
+		free(chunk);
+		fat_table_free(t);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	uint64_t base = t->address + t->first_copy * t->copy_size;
+	for (uint64_t done = 0; done < t->copy_size; )
+	{
+		uint32_t n = t->copy_size - done < IMAGE_BUFSZ ? t->copy_size - done : IMAGE_BUFSZ;
+		void *buf = compact ? (void *) chunk : (uint8_t *) t->entries + done;
+
+		if (image_pread(img, base + done, buf, n) != 0)
+			goto fail;
+
+		if (compact)
+		{
+			uint32_t first = done / sizeof(uint32_t);
+			for (uint32_t i = 0; i < n / sizeof(uint32_t); i++)
+				if (runs_append(t, first + i, chunk[i] & 0x0FFFFFFF) != 0)
+					goto fail;
+		}
+
+		done += n;
+	}
+
+	free(chunk);
+
+	if (!compact)
+		free_map_build(t);
+	if (free_extents_build(t) != 0)
+	{
+		fat_table_free(t);
+		errno = ENOMEM;
+		return NULL;
+	}
+	fsinfo_load(img, t, bpb);
+	return t;
+
+fail:
+	free(chunk);
+	fat_table_free(t);
+	return NULL;
+}
+
+void fat_table_free(struct fat_table *t)
+{
+	if (t == NULL)
+		return;
+
+	free(t->entries);
+	free(t->runs);
+	for (size_t i = 0; i < t->nretired; i++)
+		free(t->retired[i]);
+	free(t->retired);
+	free(t->dirty);
+	free((void *) t->free_map);
+	extent_set_free(&t->free_extents);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+size_t fat_table_memory(struct fat_table *t)
+{
+	size_t bytes = sizeof(struct fat_table) + (t->sectors + 63) / 64 * sizeof(uint64_t)
+	             + t->free_extents.count * sizeof(struct extent_node);
+
+	if (t->entries != NULL)
+		return bytes + t->copy_size + ((t->limit + 63) / 64 + 1) * sizeof(uint64_t);
+
+	return bytes + t->runs_cap * sizeof(struct fat_run) + t->retired_size;
+}
+
+static int is_dirty(struct fat_table *t, uint32_t sector)
+{
+	return (t->dirty[sector / 64] >> (sector % 64)) & 1;
+}
+
+/*
+ * Monta em buf os setores [s, end) da FAT a partir dos trechos. Os 4 bits
+ * reservados de cada entrada vêm do que está em disco na cópia ativa.
+ */
+static int runs_render(struct fat_image *img, struct fat_table *t, uint32_t s, uint32_t end, uint32_t *buf)
+{
+	uint64_t offset = (uint64_t) s * t->sector_size;
+	size_t   len    = (size_t) (end - s) * t->sector_size;
+
+	if (image_pread(img, t->address + t->first_copy * t->copy_size + offset, buf, len) != 0)
+		return -1;
+
+	uint32_t first = offset / sizeof(uint32_t);
+	uint32_t n     = len / sizeof(uint32_t);
+	size_t   r     = run_find(t, first);
+
+	for (uint32_t i = 0; i < n; i++)
+	{
+		uint32_t cluster = first + i;
+		while (cluster >= run_end(&t->runs[r]))
+			r++;
+
+		buf[i] = (buf[i] & 0xF0000000) | run_value(&t->runs[r], cluster);
+	}
+
+	return 0;
+}
+
+static int flush_locked(struct fat_image *img, struct fat_table *t)
+{
+	if (t->ndirty == 0 && !atomic_load(&t->fsinfo_dirty))
+		return 0;
+
+	uint32_t *stage = NULL;
+	int ret = 0;
+
+	for (uint32_t s = 0; s < t->sectors && ret == 0; )
+	{
+		if (!is_dirty(t, s))
+		{
+			s++;
+			continue;
+		}
+
+		/* Trecho [s, end): setores sujos, com lacunas limpas curtas no meio. */
+		uint32_t end = s + 1, gap = 0;
+		for (uint32_t i = end; i < t->sectors && gap <= FAT_FLUSH_GAP; i++)
+		{
+			if (is_dirty(t, i))
+			{
+				end = i + 1;
+				gap = 0;
+			}
+			else
+				gap++;
+		}
+
+		uint64_t offset = (uint64_t) s * t->sector_size;
+		size_t   len    = (size_t) (end - s) * t->sector_size;
+		const void *data;
+
+		if (t->entries != NULL)
+			data = (uint8_t *) t->entries + offset;
+		else
+		{
+			uint32_t *grown = realloc(stage, len);
+			if (grown == NULL)
+			{
+				errno = ENOMEM;
+				ret = -1;
+				break;
+			}
+			stage = grown;
+
+			if (runs_render(img, t, s, end, stage) != 0)
+			{
+				ret = -1;
+				break;
+			}
+			data = stage;
+		}
+
+		for (uint8_t copy = 0; copy < t->copies && ret == 0; copy++)
+		{
+			uint64_t address = t->address + (t->first_copy + copy) * t->copy_size + offset;
+			ret = image_pwrite(img, address, data, len);
+		}
+
+		s = end;
+	}
+
+	free(stage);
+	if (ret != 0)
+		return -1;
+
+	memset(t->dirty, 0, (t->sectors + 63) / 64 * sizeof(uint64_t));
+	t->ndirty = 0;
+
+	if (t->fsinfo != 0 && atomic_exchange(&t->fsinfo_dirty, false))
+	{
+		uint32_t fields[2] = { atomic_load(&t->free_count), atomic_load(&t->next_free) };
+
+		if (image_pwrite(img, t->fsinfo + FSINFO_FREE, fields, sizeof(fields)) != 0)
+		{
+			atomic_store(&t->fsinfo_dirty, true);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int fat_table_flush(struct fat_image *img, struct fat_table *t)
+{
+	if (t == NULL)
+		return 0;
+
+	pthread_mutex_lock(&t->lock);
+	int ret = flush_locked(img, t);
+	pthread_mutex_unlock(&t->lock);
+
+	return ret;
+}
+
+static uint32_t entry_get(struct fat_table *t, uint32_t cluster)
+{
+	if (t->entries != NULL)
+		return atomic_load_explicit(&t->entries[cluster], memory_order_relaxed) & 0x0FFFFFFF;
+
+	return run_value(&t->runs[run_find(t, cluster)], cluster);
+}
+
+/*
+ * Leitura sem trava da compacta (seqlock): `seq` é ímpar enquanto fat_set()
+ * mexe nos trechos. O leitor anota `seq`, lê, e refaz se ela mudou. Lê
+ * `nruns` antes do vetor, então o vetor visto tem pelo menos `nruns`
+ * posições; e vetores antigos só são liberados com a tabela.
+ */
+static uint64_t read_begin(struct fat_table *t, const struct fat_run **runs, size_t *n)
+{
+	uint64_t seq;
+
+	while ((seq = atomic_load_explicit(&t->seq, memory_order_acquire)) & 1)
+		;
+
+	*n    = atomic_load_explicit(&t->nruns, memory_order_acquire);
+	*runs = atomic_load_explicit(&t->runs, memory_order_acquire);
+	return seq;
+}
+
+static bool read_retry(struct fat_table *t, uint64_t seq)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&t->seq, memory_order_relaxed) != seq;
+}
+
+uint32_t fat_get(struct fat_table *t, uint32_t cluster)
+{
+	if (cluster >= t->count)
+		return FAT32_EOF_HI;
+
+	if (t->entries != NULL)
+		return entry_get(t, cluster);
+
+	const struct fat_run *runs;
+	uint32_t value;
+	size_t   n;
+	uint64_t seq;
+
+	do
+	{
+		seq   = read_begin(t, &runs, &n);
+		value = run_value(&runs[run_search(runs, n, cluster)], cluster);
+	} while (read_retry(t, seq));
+
+	return value;
+}
+
+static int set_locked(struct fat_table *t, uint32_t cluster, uint32_t value)
+{
+	uint32_t old = entry_get(t, cluster);
+	uint64_t bit = (uint64_t) 1 << (cluster % 64);
+
+	if (old == value)
+		return 0;
+
+	atomic_fetch_add(&t->generation, 1);
+
+	/*
+	 * Alocação ou liberação: mantém os trechos, o bitmap e o FSInfo em dia. Um
+	 * cluster reservado com fat_claim() já está fora do bitmap (e da contagem);
+	 * na compacta, fora dos trechos.
+	 */
+	if (cluster >= 2 && cluster < t->limit && (old == 0) != (value == 0))
+	{
+		int ret = value == 0 ? extent_set_insert(&t->free_extents, cluster, 1)
+		                     : extent_set_erase(&t->free_extents, cluster, 1);
+		if (ret != 0 && (value == 0 || errno == ENOMEM))
+			return -1;
+
+		if (t->free_map == NULL)
+		{
+			/* Na compacta não há fat_release() depois: devolver aos trechos já libera. */
+			if (value == 0)
+				atomic_fetch_add(&t->free_count, 1);
+			else if (ret == 0)
+				atomic_fetch_sub(&t->free_count, 1);
+		}
+		else if (value != 0 && (atomic_fetch_and(&t->free_map[cluster / 64], ~bit) & bit))
+			atomic_fetch_sub(&t->free_count, 1);
+
+		if (value != 0)
+			atomic_store(&t->next_free, cluster + 1 < t->limit ? cluster + 1 : 2);
+		atomic_store(&t->fsinfo_dirty, true);
+	}
+
+	if (t->entries != NULL)
+	{
+		/* Só quem tem a trava grava; leitores sem trava veem o valor antigo ou o novo. */
+		uint32_t high = atomic_load_explicit(&t->entries[cluster], memory_order_relaxed) & 0xF0000000;
+		atomic_store_explicit(&t->entries[cluster], high | value, memory_order_relaxed);
+	}
+	else
+	{
+		atomic_fetch_add_explicit(&t->seq, 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		int ret = runs_set(t, cluster, value);
+		atomic_fetch_add_explicit(&t->seq, 1, memory_order_release);
+
+		if (ret != 0)
+			return -1;
+	}
+
+	uint32_t sector = (uint64_t) cluster * sizeof(uint32_t) / t->sector_size;
+	if (!is_dirty(t, sector))
+	{
+		t->dirty[sector / 64] |= (uint64_t) 1 << (sector % 64);
+		t->ndirty++;
+	}
+
+	/* Só agora, com a entrada já zerada, o cluster volta a poder ser reservado. */
+	if (cluster >= 2 && cluster < t->limit && value == 0 && old != 0 && t->free_map != NULL)
+		fat_release(t, cluster);
+
+	return 0;
+}
+
+uint32_t fat_follow(struct fat_table *t, uint32_t cluster, uint32_t *next)
+{
+	uint32_t c = cluster, v;
+
+	if (cluster >= t->count)
+	{
+		*next = FAT32_EOF_HI;
+		return 0;
+	}
+
+	if (t->entries != NULL)
+	{
+		while ((v = entry_get(t, c)) == c + 1 && v < t->count)
+			c = v;
+
+		*next = v;
+		return c - cluster + 1;
+	}
+
+	/* Compacta: um trecho encadeado inteiro é pulado de uma vez, sem trava. */
+	const struct fat_run *runs;
+	size_t   n;
+	uint64_t seq;
+
+	do
+	{
+		seq = read_begin(t, &runs, &n);
+		c   = cluster;
+
+		/* Num vetor em alteração os valores podem vir quebrados; `i` fica limitado a n. */
+		for (size_t i = run_search(runs, n, c); i < n; )
+		{
+			const struct fat_run *r = &runs[i];
+			if (run_linked(r))
+				c = run_end(r) - 1;
+
+			v = run_value(r, c);
+			if (v != c + 1 || v >= t->count)
+				break;
+
+			c = v;
+			if (c >= run_end(r))
+				i++;
+		}
+	} while (read_retry(t, seq));
+
+	*next = v;
+	return c - cluster + 1;
+}
+
+int fat_set(struct fat_table *t, uint32_t cluster, uint32_t value)
+{
+	if (cluster >= t->count)
+		return 0;
+
+	pthread_mutex_lock(&t->lock);
+	int ret = set_locked(t, cluster, value & 0x0FFFFFFF);
+	pthread_mutex_unlock(&t->lock);
+
+	return ret;
+}
+
+/* Reserva: bitmap atômico, ou os trechos sob a trava na compacta */
+
+/* Tira `cluster` dos trechos livres, se estiver lá. */
+static bool reserve_locked(struct fat_table *t, uint32_t cluster)
+{
+	if (extent_set_erase(&t->free_extents, cluster, 1) != 0)
+		return false;
+
+	atomic_fetch_sub(&t->free_count, 1);
+	atomic_store(&t->fsinfo_dirty, true);
+	return true;
+}
+
+bool fat_reserve(struct fat_table *t, uint32_t cluster)
+{
+	if (cluster < 2 || cluster >= t->limit)
+		return false;
+
+	if (t->free_map == NULL)
+	{
+		pthread_mutex_lock(&t->lock);
+		bool ok = reserve_locked(t, cluster);
+		pthread_mutex_unlock(&t->lock);
+		return ok;
+	}
+
+	uint64_t bit = (uint64_t) 1 << (cluster % 64);
+	if (!(atomic_fetch_and(&t->free_map[cluster / 64], ~bit) & bit))
+		return false; // Outra thread chegou antes
+
+	atomic_fetch_sub(&t->free_count, 1);
+	return true;
+}
+
+/*
+ * Cursor da thread atual na tabela `t`. Os cursores ficam numa pequena cache
+ * por thread, indexada pelo id da tabela; uma tabela nova toma o lugar da
+ * usada há mais tempo e começa de novo.
+ */
+static uint32_t *claim_cursor(struct fat_table *t)
+{
+	static _Thread_local struct
+	{
+		uint64_t table; // id (0 = livre)
+		uint32_t cursor;
+		uint64_t last;
+	} cursors[FAT_CURSOR_TABLES];
+	static _Thread_local uint64_t tick;
+
+	size_t slot = 0;
+	for (size_t i = 0; i < FAT_CURSOR_TABLES; i++)
+	{
+		if (cursors[i].table == t->id)
+		{
+			cursors[i].last = ++tick;
+			return &cursors[i].cursor;
+		}
+		if (cursors[i].last < cursors[slot].last)
+			slot = i;
+	}
+
+	cursors[slot].table  = t->id;
+	cursors[slot].cursor = 0;
+	cursors[slot].last   = ++tick;
+	return &cursors[slot].cursor;
+}
+
+uint32_t fat_claim(struct fat_table *t)
+{
+	uint32_t *cursor = claim_cursor(t);
+
+	/* Cada thread começa numa região diferente, a partir da dica do FSInfo. */
+	if (*cursor < 2 || *cursor >= t->limit)
+	{
+		uint32_t span = t->limit > 2 ? t->limit - 2 : 1;
+		uint32_t k    = atomic_fetch_add(&t->claimers, 1) % FAT_CURSOR_SPREAD;
+		uint32_t hint = atomic_load(&t->next_free);
+
+		*cursor = 2 + (uint32_t) (((uint64_t) (hint - 2) + (uint64_t) span * k / FAT_CURSOR_SPREAD) % span);
+	}
+
+	/* Compacta: o próximo trecho livre a partir do cursor, dando a volta. */
+	if (t->free_map == NULL)
+	{
+		pthread_mutex_lock(&t->lock);
+
+		uint32_t c = extent_set_next(&t->free_extents, *cursor);
+		if (c == 0)
+			c = extent_set_next(&t->free_extents, 2);
+		if (c != 0 && !reserve_locked(t, c))
+			c = 0; // Sem memória para dividir o trecho
+
+		pthread_mutex_unlock(&t->lock);
+
+		if (c != 0)
+		{
+			atomic_store(&t->next_free, c + 1 < t->limit ? c + 1 : 2);
+			*cursor = c + 1;
+		}
+		return c;
+	}
+
+	/* Duas voltas no máximo: do cursor ao fim, e do início ao cursor. */
+	for (int lap = 0; lap < 2 && atomic_load(&t->free_count) > 0; lap++)
+	{
+		for (uint32_t w = *cursor / 64; w < (t->limit + 63) / 64; w++)
+		{
+			uint64_t word = free_word(t, w);
+
+			if (w == *cursor / 64)
+				word &= ~(uint64_t) 0 << (*cursor % 64);
+
+			while (word != 0)
+			{
+				uint32_t bit = __builtin_ctzll(word);
+				uint32_t c   = w * 64 + bit;
+				if (c >= t->limit)
+					break;
+
+				uint64_t expected = free_word(t, w);
+				while (expected & ((uint64_t) 1 << bit))
+				{
+					if (atomic_compare_exchange_weak(&t->free_map[w], &expected, expected & ~((uint64_t) 1 << bit)))
+					{
+						atomic_fetch_sub(&t->free_count, 1);
+						atomic_store(&t->next_free, c + 1 < t->limit ? c + 1 : 2);
+						atomic_store(&t->fsinfo_dirty, true);
+						*cursor = c + 1;
+						return c;
+					}
+				}
+
+				/* Perdeu a corrida por esse bit: tenta os outros livres da palavra. */
+				word = expected & ~(((uint64_t) 2 << bit) - 1);
+			}
+		}
+
+		*cursor = 2;
+	}
+
+	return 0;
+}
+
+void fat_release(struct fat_table *t, uint32_t cluster)
+{
+	if (cluster < 2 || cluster >= t->limit)
+		return;
+
+	/* Compacta: só volta aos trechos se ainda estiver com 0 e fora deles. */
+	if (t->free_map == NULL)
+	{
+		pthread_mutex_lock(&t->lock);
+		if (entry_get(t, cluster) == 0 && extent_set_next(&t->free_extents, cluster) != cluster
+		 && extent_set_insert(&t->free_extents, cluster, 1) == 0)
+		{
+			atomic_fetch_add(&t->free_count, 1);
+			atomic_store(&t->fsinfo_dirty, true);
+		}
+		pthread_mutex_unlock(&t->lock);
+		return;
+	}
+
+	uint64_t bit = (uint64_t) 1 << (cluster % 64);
+	if (!(atomic_fetch_or(&t->free_map[cluster / 64], bit) & bit))
+		atomic_fetch_add(&t->free_count, 1);
+	atomic_store(&t->fsinfo_dirty, true);
+}
+
+uint32_t fat_next_free(struct fat_table *t, uint32_t from)
+{
+	if (t->free_map == NULL)
+	{
+		pthread_mutex_lock(&t->lock);
+		uint32_t c = extent_set_next(&t->free_extents, from < 2 ? 2 : from);
+		pthread_mutex_unlock(&t->lock);
+		return c;
+	}
+
+	uint32_t c = free_map_scan(t, from < 2 ? 2 : from, true);
+	return c < t->limit ? c : 0;
+}
+
+uint32_t fat_alloc(struct fat_table *t)
+{
+	if (atomic_load(&t->free_count) == 0)
+		return 0;
+
+	uint32_t c = fat_next_free(t, atomic_load(&t->next_free));
+	return c != 0 ? c : fat_next_free(t, 2);
+}
+
+uint32_t fat_find_free_run(struct fat_table *t, uint32_t count)
+{
+	if (count == 0)
+		return 0;
+
+	/* Compacta: o menor trecho livre em que cabem (best-fit). */
+	if (t->free_map == NULL)
+	{
+		struct extent e;
+
+		pthread_mutex_lock(&t->lock);
+		size_t n = extent_set_plan(&t->free_extents, count, &e, 1);
+		pthread_mutex_unlock(&t->lock);
+
+		return n == 1 ? e.start : 0;
+	}
+
+	/* Salta de trecho livre em trecho livre, uma palavra do bitmap por vez. */
+	for (uint32_t c = free_map_scan(t, 2, true); c < t->limit; )
+	{
+		uint32_t end = free_map_scan(t, c, false);
+		if (end - c >= count)
+			return c;
+		c = free_map_scan(t, end, true);
+	}
+
+	return 0;
+}
+
+struct extent *fat_plan_extents(struct fat_table *t, uint32_t count, size_t *n)
+{
+	if (count == 0 || count > atomic_load(&t->free_count))
+	{
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&t->lock);
+
+	/* Nunca há mais pedaços que trechos livres, nem que clusters pedidos. */
+	size_t max = count < t->free_extents.count ? count : t->free_extents.count;
+	struct extent *plan = malloc(sizeof(struct extent) * (max ? max : 1));
+
+	*n = plan != NULL ? extent_set_plan(&t->free_extents, count, plan, max) : 0;
+
+	pthread_mutex_unlock(&t->lock);
+
+	if (*n == 0)
+	{
+		errno = plan == NULL ? ENOMEM : ENOSPC;
+		free(plan);
+		return NULL;
+	}
+
+	return plan;
+}
@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include "fleet.h"
+#include "obese32.h"
+#include "fat32.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <glob.h>
+#include <sys/resource.h>
+
+#define FLEET_CHUNK (1024 * 1024) /* Bytes lidos de uma vez no cat */
+#define FLEET_LINE  (64 * 1024)   /* Uma linha sem '\n' maior que isso sai em pedaços */
+
+struct fleet
+{
+	enum fleet_op op;
+	const char   *name;
+	char        **images;
+	int           n;
+	int           flags;
+
+	atomic_int    next;   // Próxima imagem a ser atendida
+	atomic_int    failed; // Imagens com erro ou problemas
+	pthread_mutex_t out;  // Saída: uma thread escreve por vez
+};
+
+/* Saída de uma imagem, acumulada até formar linhas inteiras */
+struct job
+{
+	struct fleet *f;
+	const char   *image;
+	char   *text;
+	size_t  len, cap;
+};
+
+/* Lista de imagens */
+
+static void list_push(char ***list, int *n, size_t *cap, const char *path)
+{
+	if ((size_t) *n == *cap)
+	{
+		*cap  = *cap ? *cap * 2 : 64;
+		*list = realloc(*list, *cap * sizeof(char *));
+		if (*list == NULL)
+			error_at_line(EXIT_FAILURE, ENOMEM, __FILE__, __LINE__, "Erro ao alocar a lista de imagens");
+	}
+
+	if (((*list)[(*n)++] = strdup(path)) == NULL)
+		error_at_line(EXIT_FAILURE, ENOMEM, __FILE__, __LINE__, "Erro ao alocar a lista de imagens");
+}
+
+int fleet_expand(char **args, int n, char ***out)
+{
+	char **list = NULL;
+	int count = 0;
+	size_t cap = 0;
+
+	for (int i = 0; i < n; i++)
+	{
+		if (args[i][0] == '@')
+		{
+			bool from_stdin = strcmp(args[i], "@-") == 0;
+			FILE *in = from_stdin ? stdin : fopen(args[i] + 1, "r");
+			if (in == NULL)
+				error(EXIT_FAILURE, errno, "Não foi possível abrir %s", args[i] + 1);
+
+			char *line = NULL;
+			size_t len = 0;
+			ssize_t got;
+			while ((got = getline(&line, &len, in)) != -1)
+			{
+				while (got > 0 && (line[got - 1] == '\n' || line[got - 1] == '\r'))
+					line[--got] = '\0';
+				if (got > 0)
+					list_push(&list, &count, &cap, line);
+			}
+
+			free(line);
+			if (!from_stdin)
+				fclose(in);
+		}
+		else if (strpbrk(args[i], "*?[") != NULL)
+		{
+			glob_t g;
+			int ret = glob(args[i], 0, NULL, &g);
+			if (ret == GLOB_NOMATCH)
+				error(0, 0, "Nenhuma imagem em %s", args[i]);
+			else if (ret != 0)
+				error(EXIT_FAILURE, ret == GLOB_NOSPACE ? ENOMEM : EIO, "Erro ao expandir %s", args[i]);
+			else
+				for (size_t k = 0; k < g.gl_pathc; k++)
+					list_push(&list, &count, &cap, g.gl_pathv[k]);
+			globfree(&g);
+		}
+		else
+			list_push(&list, &count, &cap, args[i]);
+	}
+
+	*out = list;
+	return count;
+}
+
+/* Saída */
+
+static void job_printf(struct job *j, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void job_append(struct job *j, const void *data, size_t len)
+{
+	if (j->len + len > j->cap)
+	{
+		size_t cap = j->cap ? j->cap : 4096;
+		while (cap < j->len + len)
+			cap *= 2;
+		if ((j->text = realloc(j->text, cap)) == NULL)
+			error_at_line(EXIT_FAILURE, ENOMEM, __FILE__, __LINE__, "Erro ao alocar a saída");
+		j->cap = cap;
+	}
+
+	memcpy(j->text + j->len, data, len);
+	j->len += len;
+}
+
+static void job_printf(struct job *j, const char *fmt, ...)
+{
+	char line[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	int n = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+
+	job_append(j, line, n < (int) sizeof(line) ? (size_t) n : sizeof(line) - 1);
+}
+
+/*
+ * Escreve as linhas completas acumuladas, cada uma com o caminho da imagem na
+ * frente. Com `last`, escreve também a linha que ficou sem '\n'; sem ele, uma
+ * linha que passa de FLEET_LINE sai em pedaços, para o acúmulo não crescer
+ * sem limite. As linhas vão com fwrite(), já que um arquivo pode ter NUL.
+ */
+static void job_emit(struct job *j, bool last)
+{
+	size_t done = 0;
+
+	pthread_mutex_lock(&j->f->out);
+	while (done < j->len)
+	{
+		char *end = memchr(j->text + done, '\n', j->len - done);
+		if (end == NULL && !last && j->len - done < FLEET_LINE)
+			break;
+
+		size_t len = end != NULL ? (size_t) (end - (j->text + done)) : j->len - done;
+		if (end == NULL && !last)
+			len = FLEET_LINE;
+
+		printf("%s: ", j->image);
+		fwrite(j->text + done, 1, len, stdout);
+		putchar('\n');
+		done += len + (end != NULL);
+	}
+	fflush(stdout);
+	pthread_mutex_unlock(&j->f->out);
+
+	memmove(j->text, j->text + done, j->len - done);
+	j->len -= done;
+}
+
+/* Operações: retornam 0 ou -errno */
+
+static int fleet_ls(struct job *j, struct obese32 *vol)
+{
+	struct obese32_stat st;
+	uint64_t cookie = 0;
+	int ret;
+
+	while ((ret = obese32_readdir(vol, &cookie, &st)) == 1)
+		job_printf(j, "%-12s %s %10u\n", st.name, st.attr & DIR_ATTR_DIRECTORY ? "DIR " : "FILE", st.size);
+
+	return ret;
+}
+
+static int fleet_cat(struct job *j, struct obese32 *vol, uint8_t *buffer)
+{
+	uint64_t offset = 0;
+	ssize_t got;
+
+	while ((got = obese32_pread(vol, j->f->name, buffer, FLEET_CHUNK, offset)) > 0)
+	{
+		job_append(j, buffer, got);
+		job_emit(j, false);
+		offset += got;
+	}
+
+	return got;
+}
+
+static int fleet_check(struct job *j, struct obese32 *vol, bool *ok)
+{
+	struct obese32_check r;
+	int ret = obese32_check(vol, &r);
+	if (ret != 0)
+		return ret;
+
+	*ok = r.bad_chains == 0 && r.cross_links == 0 && r.lost == 0 && r.fat_mismatch == 0;
+	job_printf(j, "%s arquivos=%u clusters=%u cadeias_ruins=%u cruzados=%u perdidos=%u fat_divergente=%u\n",
+	           *ok ? "OK" : "PROBLEMAS", r.files, r.used, r.bad_chains, r.cross_links, r.lost, r.fat_mismatch);
+	return 0;
+}
+
+/* Threads */
+
+static void *fleet_worker(void *arg)
+{
+	struct fleet *f = arg;
+	uint8_t *buffer = NULL;
+	int i;
+
+	if (f->op == FLEET_CAT && (buffer = malloc(FLEET_CHUNK)) == NULL)
+		error_at_line(EXIT_FAILURE, ENOMEM, __FILE__, __LINE__, "Erro ao alocar buffer");
+
+	while ((i = atomic_fetch_add(&f->next, 1)) < f->n)
+	{
+		struct job j = { .f = f, .image = f->images[i] };
+		struct obese32 *vol;
+		bool ok = true;
+
+		/* A frota só lê: nenhuma imagem é alterada, nem o FSInfo desatualizado. */
+		int ret = obese32_open(j.image, f->flags | OBESE32_RDONLY, &vol);
+		if (ret == 0)
+		{
+			if (f->op == FLEET_LS)
+				ret = fleet_ls(&j, vol);
+			else if (f->op == FLEET_CAT)
+				ret = fleet_cat(&j, vol, buffer);
+			else
+				ret = fleet_check(&j, vol, &ok);
+
+			(void) obese32_close(vol);
+		}
+
+		if (ret != 0)
+		{
+			if (j.len != 0 && j.text[j.len - 1] != '\n')
+				job_append(&j, "\n", 1);
+			job_printf(&j, "erro: %s\n", strerror(-ret));
+		}
+		if (ret != 0 || !ok)
+			atomic_fetch_add(&f->failed, 1);
+
+		job_emit(&j, true);
+		free(j.text);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/* Threads que cabem no limite de descritores abertos do processo */
+static unsigned fd_bound(unsigned workers)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY)
+		return workers;
+
+	rlim_t fit = rl.rlim_cur > FLEET_FDS_RESERVED ? (rl.rlim_cur - FLEET_FDS_RESERVED) / FLEET_FDS_PER_IMAGE : 1;
+	return fit < workers ? (fit > 0 ? fit : 1) : workers;
+}
+
+int fleet_run(enum fleet_op op, const char *name, char **images, int n, int flags, unsigned workers)
+{
+	struct fleet f = { .op = op, .name = name, .images = images, .n = n, .flags = flags };
+	pthread_mutex_init(&f.out, NULL);
+
+	workers = fd_bound(workers);
+	if (workers > (unsigned) n)
+		workers = n;
+
+	pthread_t *threads = calloc(workers, sizeof(pthread_t));
+	if (threads == NULL)
+		error_at_line(EXIT_FAILURE, ENOMEM, __FILE__, __LINE__, "Erro ao alocar as threads");
+
+	unsigned started = 0;
+	while (started < workers && pthread_create(&threads[started], NULL, fleet_worker, &f) == 0)
+		started++;
+
+	/* Sem nenhuma thread extra, a thread principal faz o trabalho sozinha. */
+	if (started == 0)
+		fleet_worker(&f);
+
+	for (unsigned i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	pthread_mutex_destroy(&f.out);
+
+	return atomic_load(&f.failed) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include "image.h"
+#include "uring.h"
+#include "cache.h"
+#include "fattable.h"
+#include "chain.h"
+#include "directory.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/stat.h>
+
+/* pread()/pwrite() completos, repetindo em leituras/escritas parciais */
+static int full_pread(int fd, uint64_t offset, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len > 0)
+	{
+		ssize_t n = pread(fd, p, len, offset);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0)
+		{
+			if (n == 0) errno = EIO;
+			return -1;
+		}
+		p += n; offset += n; len -= n;
+	}
+
+	return 0;
+}
+
+static int full_pwrite(int fd, uint64_t offset, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len > 0)
+	{
+		ssize_t n = pwrite(fd, p, len, offset);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0)
+		{
+			if (n == 0) errno = EIO;
+			return -1;
+		}
+		p += n; offset += n; len -= n;
+	}
+
+	return 0;
+}
+
+/* Ponteiro, offset e tamanho respeitam o alinhamento exigido pelo O_DIRECT? */
+bool image_is_aligned(struct fat_image *img, uint64_t offset, size_t len)
+{
+	return offset % img->align == 0 && len % img->align == 0;
+}
+
+static bool buffer_aligned(struct fat_image *img, const void *buf)
+{
+	return (uintptr_t) buf % img->align == 0;
+}
+
+void *image_alloc(struct fat_image *img, size_t len)
+{
+	void *buf = NULL;
+	size_t rounded = (len + img->align - 1) / img->align * img->align;
+
+	if (posix_memalign(&buf, img->align < sizeof(void *) ? sizeof(void *) : img->align, rounded) != 0)
+		return NULL;
+
+	return buf;
+}
+
+/*
+ * Leitura/escrita no disco. No modo --direct, pedidos desalinhados (cabeça e
+ * cauda de um trecho, entradas da FAT, dentries...) passam por um buffer
+ * alinhado; escritas parciais de bloco viram leitura-modificação-escrita.
+ */
+static int dev_pread(struct fat_image *img, uint64_t offset, void *buf, size_t len)
+{
+	if (!(img->flags & IMAGE_DIRECT) || (image_is_aligned(img, offset, len) && buffer_aligned(img, buf)))
+		return full_pread(img->fd, offset, buf, len);
+
+	uint64_t start = offset - offset % img->align;
+	size_t   span  = (offset + len - start + img->align - 1) / img->align * img->align;
+
+	uint8_t *bounce = image_alloc(img, span);
+	if (bounce == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	int ret = full_pread(img->fd, start, bounce, span);
+	if (ret == 0)
+		memcpy(buf, bounce + (offset - start), len);
+
+	free(bounce);
+	return ret;
+}
+
+static int dev_pwrite(struct fat_image *img, uint64_t offset, const void *buf, size_t len)
+{
+	if (!(img->flags & IMAGE_DIRECT) || (image_is_aligned(img, offset, len) && buffer_aligned(img, buf)))
+		return full_pwrite(img->fd, offset, buf, len);
+
+	uint64_t start = offset - offset % img->align;
+	size_t   span  = (offset + len - start + img->align - 1) / img->align * img->align;
+
+	uint8_t *bounce = image_alloc(img, span);
+	if (bounce == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* Preserva o que já está em disco nos blocos de borda. */
+	int ret = 0;
+	if (offset != start)
+		ret = full_pread(img->fd, start, bounce, img->align);
+	if (ret == 0 && (offset + len) % img->align != 0)
+		ret = full_pread(img->fd, start + span - img->align, bounce + span - img->align, img->align);
+
+	if (ret == 0)
+	{
+		memcpy(bounce + (offset - start), buf, len);
+		ret = full_pwrite(img->fd, start, bounce, span);
+	}
+
+	free(bounce);
+	return ret;
+}
+
+/* E/S do dispositivo para a cache de blocos */
+static int cache_dev_read(void *ctx, uint64_t offset, void *buf, size_t len)
+{
+	return dev_pread(ctx, offset, buf, len);
+}
+
+static int cache_dev_write(void *ctx, uint64_t offset, void *buf, size_t len)
+{
+	return dev_pwrite(ctx, offset, buf, len);
+}
+
+struct fat_image *image_open(const char *path, int flags)
+{
+	struct fat_image *img = calloc(1, sizeof(struct fat_image));
+	if (img == NULL)
+		return NULL;
+
+	pthread_mutex_init(&img->lock, NULL);
+
+	img->flags = flags;
+	img->align = 1;
+	img->fd    = open(path, (flags & IMAGE_RDONLY ? O_RDONLY : O_RDWR) | O_CLOEXEC | (flags & IMAGE_DIRECT ? O_DIRECT : 0));
+	if (img->fd < 0)
+	{
+		pthread_mutex_destroy(&img->lock);
+		free(img);
+		return NULL;
+	}
+
+	if (flags & IMAGE_DIRECT)
+	{
+		struct statx stx;
+
+		/* Alinhamento exigido pelo sistema de arquivos; 4 KiB serve em qualquer caso. */
+		img->align = 4096;
+		if (statx(img->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0
+		 && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align != 0)
+		{
+			img->align = stx.stx_dio_offset_align > stx.stx_dio_mem_align
+			           ? stx.stx_dio_offset_align : stx.stx_dio_mem_align;
+		}
+	}
+	else if (flags & IMAGE_MMAP)
+	{
+		struct stat st;
+
+		/* Mapeia a imagem inteira; se falhar, segue com pread()/pwrite() (img->map fica NULL). */
+		if (fstat(img->fd, &st) == 0 && st.st_size > 0)
+		{
+			int prot = flags & IMAGE_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+			void *base = mmap(NULL, st.st_size, prot, MAP_SHARED, img->fd, 0);
+			if (base != MAP_FAILED)
+			{
+				img->map      = base;
+				img->map_size = st.st_size;
+			}
+		}
+	}
+
+	struct stat st;
+	img->host_block = 4096;
+	if (fstat(img->fd, &st) == 0)
+	{
+		img->size = st.st_size;
+		if (st.st_blksize > 0)
+			img->host_block = st.st_blksize;
+	}
+
+	if (img->map == NULL && image_set_cache(img, CACHE_DEFAULT_BUDGET) != 0)
+	{
+		image_close(img);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	img->chains = chain_cache_create();
+	img->names  = dir_index_cache_create();
+	if (img->chains == NULL || img->names == NULL)
+	{
+		image_close(img);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return img;
+}
+
+int image_close(struct fat_image *img)
+{
+	if (img == NULL)
+		return 0;
+
+	int ret = 0, err = 0;
+
+	if (!(img->flags & IMAGE_RDONLY) && fat_table_flush(img, img->fat) != 0)
+	{
+		ret = -1;
+		err = errno;
+	}
+	fat_table_free(img->fat);
+	chain_cache_free(img->chains);
+	dir_index_cache_free(img->names);
+
+	if (img->map != NULL)
+	{
+		if (msync(img->map, img->map_size, MS_SYNC) != 0 && ret == 0)
+		{
+			ret = -1;
+			err = errno;
+		}
+		(void) munmap(img->map, img->map_size);
+	}
+	else if (img->cache != NULL && cache_flush(img->cache) != 0 && ret == 0)
+	{
+		ret = -1;
+		err = errno;
+	}
+
+	pthread_mutex_destroy(&img->lock);
+
+	uring_close(img->ring);
+	cache_destroy(img->cache);
+	(void) close(img->fd);
+	free(img);
+
+	errno = err;
+	return ret;
+}
+
+int image_set_cache(struct fat_image *img, size_t budget)
+{
+	/* Com a imagem mapeada o page cache já faz esse papel. */
+	if (img->map != NULL)
+		return 0;
+
+	struct block_cache *cache = cache_create(budget, img->align, img->size,
+	                                         cache_dev_read, cache_dev_write, img);
+	if (cache == NULL)
+		return -1;
+
+	pthread_mutex_lock(&img->lock);
+
+	int ret = img->cache != NULL ? cache_flush(img->cache) : 0;
+	if (ret == 0)
+	{
+		cache_destroy(img->cache);
+		img->cache = cache;
+	}
+	else
+		cache_destroy(cache);
+
+	pthread_mutex_unlock(&img->lock);
+	return ret;
+}
+
+int image_enable_uring(struct fat_image *img, unsigned depth)
+{
+	/* Com a imagem mapeada os dados já estão em memória; não há o que enfileirar. */
+	if (img->map != NULL || depth == 0)
+		return 0;
+
+	img->ring = uring_open(depth);
+	if (img->ring == NULL)
+		return -1;
+
+	img->ring_depth = depth;
+	return 0;
+}
+
+int image_sync_buffers(struct fat_image *img)
+{
+	if (img->map != NULL)
+		return 0;
+
+	pthread_mutex_lock(&img->lock);
+	int ret = cache_flush(img->cache);
+	pthread_mutex_unlock(&img->lock);
+
+	return ret;
+}
+
+void image_invalidate(struct fat_image *img, uint64_t offset, size_t len)
+{
+	if (img->map != NULL)
+		return;
+
+	pthread_mutex_lock(&img->lock);
+	cache_invalidate(img->cache, offset, len);
+	pthread_mutex_unlock(&img->lock);
+}
+
+const void *image_at(struct fat_image *img, uint64_t offset, size_t len)
+{
+	if (img->map == NULL || offset + len > img->map_size)
+		return NULL;
+
+	return img->map + offset;
+}
+
+int image_pread(struct fat_image *img, uint64_t offset, void *buf, size_t len)
+{
+	if (img->map != NULL)
+	{
+		const void *src = image_at(img, offset, len);
+		if (src == NULL)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		memcpy(buf, src, len);
+		return 0;
+	}
+
+	if (len <= IMAGE_BYPASS)
+	{
+		pthread_mutex_lock(&img->lock);
+		int ret = cache_read(img->cache, offset, buf, len);
+		pthread_mutex_unlock(&img->lock);
+		return ret;
+	}
+
+	/*
+	 * Leituras grandes vão direto ao disco, sem poluir a cache e sem a trava;
+	 * depois, o que estiver sujo na cache (mais novo que o disco) é copiado por
+	 * cima. Se algum bloco sujo foi descarregado no meio, ele pode ter chegado
+	 * ao disco depois da leitura e já não estar sujo: aí a leitura é refeita
+	 * com a trava.
+	 */
+	pthread_mutex_lock(&img->lock);
+	uint64_t writebacks = img->cache->writebacks;
+	pthread_mutex_unlock(&img->lock);
+
+	int ret = dev_pread(img, offset, buf, len);
+
+	pthread_mutex_lock(&img->lock);
+	if (ret == 0 && img->cache->writebacks != writebacks)
+		ret = dev_pread(img, offset, buf, len);
+	if (ret == 0)
+		cache_overlay(img->cache, offset, buf, len);
+	pthread_mutex_unlock(&img->lock);
+
+	return ret;
+}
+
+int image_pwrite(struct fat_image *img, uint64_t offset, const void *buf, size_t len)
+{
+	if (img->flags & IMAGE_RDONLY)
+	{
+		errno = EROFS;
+		return -1;
+	}
+
+	if (img->map != NULL)
+	{
+		if (offset + len > img->map_size)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		memcpy(img->map + offset, buf, len);
+		return 0;
+	}
+
+	if (len <= IMAGE_BYPASS)
+	{
+		pthread_mutex_lock(&img->lock);
+		int ret = cache_write(img->cache, offset, buf, len);
+		pthread_mutex_unlock(&img->lock);
+		return ret;
+	}
+
+	/*
+	 * Escritas grandes também vão ao disco sem a trava. As cópias em cache são
+	 * atualizadas antes, para que um bloco sujo descarregado durante a escrita
+	 * não grave por cima dela dados antigos, e depois, para pegar os blocos
+	 * lidos do disco enquanto ela acontecia.
+	 */
+	pthread_mutex_lock(&img->lock);
+	cache_update(img->cache, offset, buf, len);
+	pthread_mutex_unlock(&img->lock);
+
+	int ret = dev_pwrite(img, offset, buf, len);
+
+	/* Em erro o trecho fica indefinido, como no disco. */
+	if (ret == 0)
+	{
+		pthread_mutex_lock(&img->lock);
+		cache_update(img->cache, offset, buf, len);
+		pthread_mutex_unlock(&img->lock);
+	}
+
+	return ret;
+}
+
+int image_flush(struct fat_image *img)
+{
+	if (img->flags & IMAGE_RDONLY)
+		return 0;
+
+	if (fat_table_flush(img, img->fat) != 0)
+		return -1;
+
+	if (img->map != NULL)
+		return msync(img->map, img->map_size, MS_SYNC);
+
+	pthread_mutex_lock(&img->lock);
+	int ret = cache_flush(img->cache);
+	pthread_mutex_unlock(&img->lock);
+
+	return ret;
+}
@@ -1,11 +1,22 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <locale.h>
+#include <errno.h>
+#include <error.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
 
 #include "fat32.h"
 #include "commands.h"
 #include "output.h"
+#include "uring.h"
+#include "cache.h"
+#include "fattable.h"
+#include "daemon.h"
+#include "fleet.h"
 
 /* Show usage help */
 void usage(char *executable)
@@ -13,17 +24,256 @@ void usage(char *executable)
     fprintf(stdout, "Usage:\n");
     fprintf(stdout, "\t%s -h | --help for help\n", executable);
     fprintf(stdout, "\t%s ls <fat32-img> - List files from the FAT32 image\n", executable);
-    fprintf(stdout, "\t%s cp <path> <dest> <fat32-img> - Copy files from the image path to local dest.\n", executable);
+    fprintf(stdout, "\t%s cp <path> <dest> <fat32-img> - Copy files from the image path to another image path\n", executable);
     fprintf(stdout, "\t%s mv <path> <dest> <fat32-img> - Move files from the path to the FAT32 path\n", executable);
     fprintf(stdout, "\t%s rm <path> <file> <fat32-img> - Remove files from the path to the FAT32 path\n", executable);
+    fprintf(stdout, "\t%s cat <path> <fat32-img> - Print a file from the FAT32 image\n", executable);
+    fprintf(stdout, "\t%s cat --offset N --length M <path> <fat32-img> - Print M bytes of a file starting at byte N\n", executable);
+    fprintf(stdout, "\t%s export <path> <host-dest> <fat32-img> - Copy a file from the image to the host\n", executable);
+    fprintf(stdout, "\t%s import <host-file> <dest> <fat32-img> - Copy a host file into the image\n", executable);
+    fprintf(stdout, "\t%s batch [script] <fat32-img> - Run one command per line from script (or stdin) on the same open image\n", executable);
+    fprintf(stdout, "\t%s daemon <socket> <fat32-img>... - Keep the images open and serve requests on a Unix socket\n", executable);
+    fprintf(stdout, "\t%s fleet ls|check <images>... - List or check many images in parallel\n", executable);
+    fprintf(stdout, "\t%s fleet cat <path> <images>... - Print the same file from many images in parallel\n", executable);
+    fprintf(stdout, "\t\timages are paths, globs (\"dir/*.img\") or @list files with one path per line (@- reads stdin)\n");
+    fprintf(stdout, "\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "\t--mmap - Map the whole image in memory instead of using pread/pwrite\n");
+    fprintf(stdout, "\t--direct - Open the image with O_DIRECT, bypassing the host page cache (overrides --mmap)\n");
+    fprintf(stdout, "\t--uring[=N] - Keep N cluster transfers in flight with io_uring in cat/cp (default %d)\n", URING_DEFAULT_DEPTH);
+    fprintf(stdout, "\t--compact-fat - Keep the FAT in memory as cluster runs (automatic above %d MiB)\n", FAT_COMPACT_THRESHOLD / (1024 * 1024));
+    fprintf(stdout, "\t--cache=MiB - Memory budget of the block cache (default %d)\n", CACHE_DEFAULT_BUDGET / (1024 * 1024));
+    fprintf(stdout, "\t--workers=N - Threads in daemon and fleet modes (default: one per CPU)\n");
     fprintf(stdout, "\n");
     fprintf(stdout, "\tfat32-img needs to be a valid Fat32.\n\n");
 }
 
+/* Lê um número de bytes; retorna false se `text` não for um. */
+static bool parse_bytes(const char *text, uint64_t *value)
+{
+    char *end;
+
+    if (text == NULL || *text < '0' || *text > '9')
+        return false;
+
+    *value = strtoull(text, &end, 10);
+    return *end == '\0';
+}
+
+/* Opções globais da linha de comando */
+struct options
+{
+    int flags;        // IMAGE_*
+    unsigned depth;   // --uring
+    size_t cache;     // --cache, em bytes
+    uint64_t offset;  // --offset
+    uint64_t length;  // --length
+    unsigned workers; // --workers
+};
+
+#define OPTIONS_DEFAULT { .length = UINT64_MAX }
+
+/*
+ * Remove as opções globais (--mmap, ...) de argv, deixando apenas o comando e
+ * seus argumentos. Retorna o novo argc, ou -1 se uma opção tiver valor inválido.
+ */
+static int parse_options(int argc, char **argv, struct options *opt)
+{
+    int out = 1;
+
+    for (int i = 1; i < argc; i++) {
+        /* --offset N / --length M, com o valor no argumento seguinte ou depois do '=' */
+        bool is_offset = strcmp(argv[i], "--offset") == 0 || strncmp(argv[i], "--offset=", 9) == 0;
+        bool is_length = strcmp(argv[i], "--length") == 0 || strncmp(argv[i], "--length=", 9) == 0;
+
+        if (is_offset || is_length) {
+            const char *value = argv[i][8] == '=' ? argv[i] + 9 : (i + 1 < argc ? argv[++i] : NULL);
+            if (!parse_bytes(value, is_offset ? &opt->offset : &opt->length))
+                return -1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--mmap") == 0)
+            opt->flags |= IMAGE_MMAP;
+        else if (strcmp(argv[i], "--direct") == 0)
+            opt->flags |= IMAGE_DIRECT;
+        else if (strcmp(argv[i], "--compact-fat") == 0)
+            opt->flags |= IMAGE_COMPACT_FAT;
+        else if (strcmp(argv[i], "--uring") == 0)
+            opt->depth = URING_DEFAULT_DEPTH;
+        else if (strncmp(argv[i], "--uring=", 8) == 0 && atoi(argv[i] + 8) > 0)
+            opt->depth = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--cache=", 8) == 0 && atoi(argv[i] + 8) > 0)
+            opt->cache = (size_t) atoi(argv[i] + 8) * 1024 * 1024;
+        else if (strncmp(argv[i], "--workers=", 10) == 0 && atoi(argv[i] + 10) > 0)
+            opt->workers = atoi(argv[i] + 10);
+        else
+            argv[out++] = argv[i];
+    }
+
+    argv[out] = NULL;
+    return out;
+}
+
+/*
+ * Executa um comando na imagem já aberta: argv[0] é o nome do comando e o
+ * resto, seus argumentos (sem a imagem). Retorna false se os argumentos não
+ * servirem para o comando.
+ */
+static bool run_command(char *program, struct fat_image *img, struct fat_bpb *bpb, int argc, char **argv,
+                        uint64_t offset, uint64_t length)
+{
+    char *command = argv[0];
+
+    if (strcmp(command, "ls") == 0) {
+        ls(img, bpb);
+    } else if (strcmp(command, "cp") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s cp <path> <dest> <fat32-img>\n", program);
+            return false;
+        }
+        cp(img, argv[1], argv[2], bpb);
+    } else if (strcmp(command, "mv") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s mv <path> <dest> <fat32-img>\n", program);
+            return false;
+        }
+        mv(img, argv[1], argv[2], bpb);
+    } else if (strcmp(command, "rm") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Usage: %s rm <path> <file> <fat32-img>\n", program);
+            return false;
+        }
+        rm(img, argv[1], bpb);
+    } else if (strcmp(command, "cat") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Usage: %s cat <path> <fat32-img>\n", program);
+            return false;
+        }
+        cat_range(img, argv[1], bpb, offset, length);
+    } else if (strcmp(command, "export") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s export <path> <host-dest> <fat32-img>\n", program);
+            return false;
+        }
+        export(img, argv[1], argv[2], bpb);
+    } else if (strcmp(command, "import") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s import <host-file> <dest> <fat32-img>\n", program);
+            return false;
+        }
+        import(img, argv[1], argv[2], bpb);
+    } else {
+        fprintf(stderr, "Unknown command: %s\n", command);
+        return false;
+    }
+
+    return true;
+}
+
+/* Fecha a imagem, avisando se a descarga falhar; retorna o código de saída. */
+static int close_image(struct fat_image *img)
+{
+    if (image_close(img) != 0) {
+        error(0, errno, "warning: error flushing image");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* Modo batch */
+
+#define BATCH_MAX_ARGS 16
+
+static struct fat_image *batch_image; // Aberta durante o batch, para o atexit()
+static const char *batch_script;
+static unsigned long batch_line;
+
+/*
+ * Comandos que falham encerram o processo com error(); o que já foi feito é
+ * descarregado. Por isso cp e import devolvem a cadeia que alocaram antes de
+ * sair: descarregar a FAT com ela sem entrada no diretório perderia os clusters.
+ */
+static void batch_close(void)
+{
+    if (batch_image != NULL)
+        (void) close_image(batch_image);
+    batch_image = NULL;
+}
+
+/* Prefixo das mensagens de error(): a linha do script que falhou */
+static void batch_progname(void)
+{
+    fflush(stdout);
+    fprintf(stderr, "%s:%lu: ", batch_script, batch_line);
+}
+
+/*
+ * Lê comandos do script (ou da stdin) e executa todos na mesma imagem aberta,
+ * um por linha, no formato da linha de comando sem a imagem ("cp a.txt
+ * b.txt"). Linhas vazias e começando com '#' são ignoradas. A FAT, a cache e
+ * os mapas de arquivos passam de um comando para o outro, e a imagem é
+ * descarregada uma vez só, no fim. O batch para no primeiro comando que falhar.
+ */
+static void run_batch(char *program, struct fat_image *img, struct fat_bpb *bpb, const char *script)
+{
+    bool from_stdin = script == NULL || strcmp(script, "-") == 0;
+    FILE *in = from_stdin ? stdin : fopen(script, "r");
+    if (in == NULL)
+        error(EXIT_FAILURE, errno, "Não foi possível abrir %s", script);
+
+    batch_image  = img;
+    batch_script = from_stdin ? "stdin" : script;
+    atexit(batch_close);
+    error_print_progname = batch_progname;
+
+    char *line = NULL;
+    size_t cap = 0;
+
+    while (getline(&line, &cap, in) != -1) {
+        batch_line++;
+
+        /* args[0] faz o papel do nome do programa para o parse_options() */
+        char *args[BATCH_MAX_ARGS + 2] = { program };
+        int n = 1;
+
+        for (char *tok = strtok(line, " \t\r\n"); tok != NULL; tok = strtok(NULL, " \t\r\n")) {
+            if (n > BATCH_MAX_ARGS)
+                error(EXIT_FAILURE, E2BIG, "Argumentos demais");
+            args[n++] = tok;
+        }
+
+        if (n == 1 || args[1][0] == '#')
+            continue;
+
+        struct options opt = OPTIONS_DEFAULT;
+
+        n = parse_options(n, args, &opt);
+        if (n <= 1 || !run_command(program, img, bpb, n - 1, args + 1, opt.offset, opt.length))
+            error(EXIT_FAILURE, 0, "Comando inválido");
+
+        fflush(stdout);
+    }
+
+    if (ferror(in))
+        error(EXIT_FAILURE, errno, "Erro ao ler %s", batch_script);
+
+    free(line);
+    if (!from_stdin)
+        fclose(in);
+
+    error_print_progname = NULL;
+    batch_image = NULL;
+}
+
 int main(int argc, char **argv)
 {
     setlocale(LC_ALL, getenv("LANG"));
 
+    struct options opt = OPTIONS_DEFAULT;
+    argc = parse_options(argc, argv, &opt);
+
     if (argc <= 1) {
         usage(argv[0]);
         exit(EXIT_FAILURE);
@@ -34,58 +284,79 @@ int main(int argc, char **argv)
         exit(EXIT_SUCCESS);
     }
 
-    if (argc < 3 || argc > 4) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned workers = opt.workers ? opt.workers : cpus > 0 ? (unsigned) cpus : 1;
+
+    if (argc >= 4 && strcmp(argv[1], "daemon") == 0)
+        return daemon_run(argv[2], argv + 3, argc - 3, opt.flags, workers);
+
+    if (argc >= 4 && strcmp(argv[1], "fleet") == 0) {
+        enum fleet_op op;
+        int first = 3; // Primeira imagem em argv
+
+        if (strcmp(argv[2], "ls") == 0)
+            op = FLEET_LS;
+        else if (strcmp(argv[2], "check") == 0)
+            op = FLEET_CHECK;
+        else if (strcmp(argv[2], "cat") == 0 && argc >= 5) {
+            op = FLEET_CAT;
+            first = 4;
+        } else {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+
+        char **images;
+        int n = fleet_expand(argv + first, argc - first, &images);
+        if (n == 0)
+            error(EXIT_FAILURE, 0, "Nenhuma imagem para processar");
+
+        int status = fleet_run(op, op == FLEET_CAT ? argv[3] : NULL, images, n, opt.flags, workers);
+
+        for (int i = 0; i < n; i++)
+            free(images[i]);
+        free(images);
+        return status;
+    }
+
+    if (argc < 3 || argc > 5) {
         usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    FILE *fp = fopen(argv[argc - 1], "rb+");
-    if (!fp) {
+    struct fat_image *img = image_open(argv[argc - 1], opt.flags);
+    if (!img) {
         fprintf(stderr, "Could not open file %s\n", argv[argc - 1]);
         exit(EXIT_FAILURE);
     }
 
+    if ((opt.flags & IMAGE_MMAP) && !(opt.flags & IMAGE_DIRECT) && img->map == NULL)
+        fprintf(stderr, "warning: mmap failed, using pread/pwrite\n");
+
+    if (opt.cache != 0 && image_set_cache(img, opt.cache) != 0)
+        fprintf(stderr, "Could not allocate the block cache, keeping the default size\n");
+
+    if (image_enable_uring(img, opt.depth) != 0)
+        fprintf(stderr, "io_uring unavailable, using synchronous I/O\n");
+
     struct fat_bpb bpb;
-    rfat(fp, &bpb);
-    char *command = argv[1];
+    if (rfat(img, &bpb) != 0) {
+        int err = errno;
+        image_close(img);
+        error(EXIT_FAILURE, err, "Não foi possível carregar o FAT32 de %s", argv[argc - 1]);
+    }
 
-    if (strcmp(command, "ls") == 0) {
-        struct fat_dir *dirs = ls(fp, &bpb);
-        show_files(dirs);
-    } else if (strcmp(command, "cp") == 0) {
-        if (argc != 4) {
-            fprintf(stderr, "Usage: %s cp <path> <dest> <fat32-img>\n", argv[0]);
-            fclose(fp);
-            exit(EXIT_FAILURE);
-        }
-        cp(fp, argv[2], argv[3], &bpb);
-    } else if (strcmp(command, "mv") == 0) {
-        if (argc != 4) {
-            fprintf(stderr, "Usage: %s mv <path> <dest> <fat32-img>\n", argv[0]);
-            fclose(fp);
+    if (strcmp(argv[1], "batch") == 0) {
+        if (argc > 4) {
+            fprintf(stderr, "Usage: %s batch [script] <fat32-img>\n", argv[0]);
+            image_close(img);
             exit(EXIT_FAILURE);
         }
-        mv(fp, argv[2], argv[3], &bpb);
-    } else if (strcmp(command, "rm") == 0) {
-        if (argc != 4) {
-            fprintf(stderr, "Usage: %s rm <path> <file> <fat32-img>\n", argv[0]);
-            fclose(fp);
-            exit(EXIT_FAILURE);
-        }
-        rm(fp, argv[2], &bpb);
-    } else if (strcmp(command, "cat") == 0) {
-        if (argc != 3) {
-            fprintf(stderr, "Usage: %s cat <path> <fat32-img>\n", argv[0]);
-            fclose(fp);
-            exit(EXIT_FAILURE);
-        }
-        cat(fp, argv[2], &bpb);
-    } else {
-        fprintf(stderr, "Unknown command: %s\n", command);
-        fclose(fp);
+        run_batch(argv[0], img, &bpb, argc == 4 ? argv[2] : NULL);
+    } else if (!run_command(argv[0], img, &bpb, argc - 2, argv + 1, opt.offset, opt.length)) {
+        image_close(img);
         exit(EXIT_FAILURE);
     }
 
-    fclose(fp);
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    return close_image(img);
+}
@@ -0,0 +1,693 @@
+#define _GNU_SOURCE
+#include "obese32.h"
+#include "fat32.h"
+#include "fattable.h"
+#include "chain.h"
+#include "image.h"
+#include "support.h"
+#include "alloc.h"
+#include "directory.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+_Static_assert(OBESE32_MMAP == IMAGE_MMAP, "flags da biblioteca e da imagem");
+_Static_assert(OBESE32_DIRECT == IMAGE_DIRECT, "flags da biblioteca e da imagem");
+_Static_assert(OBESE32_COMPACT_FAT == IMAGE_COMPACT_FAT, "flags da biblioteca e da imagem");
+_Static_assert(OBESE32_RDONLY == IMAGE_RDONLY, "flags da biblioteca e da imagem");
+
+struct obese32
+{
+	struct fat_image *img;
+	struct fat_bpb    bpb;
+	uint32_t          cluster_width;
+
+	pthread_rwlock_t  lock; // Leituras juntas, alterações uma por vez
+};
+
+/* Uma entrada do diretório raiz, a sua posição no diretório e o seu endereço na imagem */
+struct dentry
+{
+	struct fat_dir dir;
+	size_t         index;
+	uint64_t       address;
+};
+
+/* Nomes */
+
+/*
+ * "nome.ext" para o formato do diretório ("NOME    EXT"); -EINVAL se não couber em 8.3.
+ * Sem ponto ("README"), a extensão fica em branco.
+ */
+static int name_in(const char *name, char out[FAT32STR_SIZE_WNULL])
+{
+	const char *dot = strchr(name, '.');
+	size_t len = strlen(name);
+
+	if (dot == NULL)
+	{
+		if (len == 0 || len > 8)
+			return -EINVAL;
+	}
+	else if (dot == name || dot - name > 8 || len - (dot - name) - 1 > 3
+	      || strchr(dot + 1, '.') != NULL)
+		return -EINVAL;
+
+	/* cstr_to_fat32wnull() espera o ponto: "README" vira "README." */
+	char copy[FAT32STR_SIZE_WNULL + 1];
+	memcpy(copy, name, len + 1);
+	if (dot == NULL)
+		strcpy(copy + len, ".");
+
+	return cstr_to_fat32wnull(copy, out) ? -EINVAL : 0;
+}
+
+/* O contrário: "NOME    EXT" para "NOME.EXT" */
+static void name_out(const unsigned char *name, char out[OBESE32_NAME_MAX])
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < 8 && name[i] != ' '; i++)
+		out[n++] = name[i];
+
+	if (name[8] != ' ')
+	{
+		out[n++] = '.';
+		for (size_t i = 8; i < FAT32STR_SIZE && name[i] != ' '; i++)
+			out[n++] = name[i];
+	}
+
+	out[n] = '\0';
+}
+
+/* Entradas que não são arquivos: nomes longos (LFN) e o rótulo do volume */
+static bool dentry_hidden(const struct fat_dir *dir)
+{
+	return (dir->attr & DIR_ATTR_LFN) == DIR_ATTR_LFN || (dir->attr & DIR_ATTR_VOLUMEID);
+}
+
+static void fill_stat(const struct fat_dir *dir, struct obese32_stat *st)
+{
+	name_out(dir->name, st->name);
+	st->attr    = dir->attr;
+	st->size    = dir->file_size;
+	st->cluster = fat_dir_cluster(dir);
+}
+
+/* Diretório raiz */
+
+/*
+ * Procura `name` no diretório raiz pelo índice de nomes (ver directory.h). Se
+ * achar, a entrada fica em *found. Retorna 1 se achou, 0 se não, ou -errno.
+ */
+static int dir_find(struct obese32 *v, const char name[FAT32STR_SIZE], struct dentry *found)
+{
+	struct dir_location loc;
+	int ret = dir_index_find(v->img, &v->bpb, v->bpb.root_cluster, name, &loc);
+	if (ret < 0)
+		return -errno;
+
+	if (ret == 1)
+	{
+		found->dir     = loc.entry;
+		found->index   = loc.index;
+		found->address = loc.address;
+	}
+
+	return ret;
+}
+
+/* Como dir_find(), a partir do nome do usuário; -ENOENT se não existir. */
+static int lookup(struct obese32 *v, const char *name, struct dentry *found)
+{
+	char rname[FAT32STR_SIZE_WNULL];
+	int ret = name_in(name, rname);
+	if (ret != 0)
+		return ret;
+
+	ret = dir_find(v, rname, found);
+	return ret == 0 ? -ENOENT : ret < 0 ? ret : 0;
+}
+
+static int dentry_store(struct obese32 *v, const struct dentry *d)
+{
+	return image_pwrite(v->img, d->address, &d->dir, sizeof(struct fat_dir)) == 0 ? 0 : -errno;
+}
+
+/* Último cluster de uma cadeia não vazia */
+static uint32_t chain_last(const struct chain *c)
+{
+	const struct chain_extent *e = &c->extents[c->count - 1];
+	return e->first + e->length - 1;
+}
+
+/* Libera a cadeia a partir de `cluster`. */
+static int free_chain(struct obese32 *v, uint32_t cluster)
+{
+	uint32_t limit = v->img->fat->limit, freed = 0;
+
+	while (cluster >= 2 && cluster < limit && freed++ < limit)
+	{
+		uint32_t next = fat_get(v->img->fat, cluster);
+		if (fat_set(v->img->fat, cluster, 0) != 0)
+			return -errno;
+		cluster = next;
+	}
+
+	return 0;
+}
+
+/* Escreve `len` bytes de `buf` (ou zeros, se NULL) a partir do byte `offset` do arquivo. */
+static int data_write(struct obese32 *v, const struct chain *file, uint64_t offset, const uint8_t *buf, uint64_t len)
+{
+	struct chain_cursor cur;
+	chain_begin(&cur, file);
+	chain_seek(&cur, &v->bpb, offset);
+
+	uint8_t *zeros = NULL;
+	int ret = 0;
+
+	while (len != 0 && ret == 0)
+	{
+		uint64_t address, span = chain_span(&cur, &v->bpb, &address);
+		if (span == 0)
+		{
+			ret = -EIO;
+			break;
+		}
+		span = span < len ? span : len;
+
+		const void *data = buf;
+		if (buf == NULL)
+		{
+			if (zeros == NULL && (zeros = calloc(1, v->cluster_width)) == NULL)
+			{
+				ret = -ENOMEM;
+				break;
+			}
+			span = span < v->cluster_width ? span : v->cluster_width;
+			data = zeros;
+		}
+
+		if (image_pwrite(v->img, address, data, span) != 0)
+			ret = -errno;
+
+		if (buf != NULL)
+			buf += span;
+		len -= span;
+		chain_advance(&cur, &v->bpb, span);
+	}
+
+	free(zeros);
+	return ret;
+}
+
+/* Volume */
+
+int obese32_open(const char *path, int flags, struct obese32 **vol)
+{
+	struct obese32 *v = calloc(1, sizeof(struct obese32));
+	if (v == NULL)
+		return -ENOMEM;
+
+	int ret = 0;
+
+	v->img = image_open(path, flags & (OBESE32_MMAP | OBESE32_DIRECT | OBESE32_COMPACT_FAT | OBESE32_RDONLY));
+	if (v->img == NULL)
+	{
+		ret = -errno;
+		free(v);
+		return ret;
+	}
+
+	if (rfat(v->img, &v->bpb) != 0)
+	{
+		ret = -errno;
+		image_close(v->img);
+		free(v);
+		return ret;
+	}
+
+	v->cluster_width = v->bpb.bytes_p_sect * v->bpb.sector_p_clust;
+	pthread_rwlock_init(&v->lock, NULL);
+
+	*vol = v;
+	return 0;
+}
+
+int obese32_flush(struct obese32 *v)
+{
+	pthread_rwlock_wrlock(&v->lock);
+	int ret = image_flush(v->img) == 0 ? 0 : -errno;
+	pthread_rwlock_unlock(&v->lock);
+
+	return ret;
+}
+
+int obese32_close(struct obese32 *v)
+{
+	if (v == NULL)
+		return 0;
+
+	int ret = obese32_flush(v);
+
+	if (image_close(v->img) != 0 && ret == 0)
+		ret = -errno;
+	pthread_rwlock_destroy(&v->lock);
+	free(v);
+
+	return ret;
+}
+
+/* Leitura */
+
+int obese32_readdir(struct obese32 *v, uint64_t *cookie, struct obese32_stat *st)
+{
+	pthread_rwlock_rdlock(&v->lock);
+
+	struct chain root = { 0 };
+	int ret = chain_lookup(v->img, v->bpb.root_cluster, &root) == 0 ? 0 : -errno;
+
+	struct chain_cursor cur;
+	chain_begin(&cur, &root);
+	chain_seek(&cur, &v->bpb, *cookie * sizeof(struct fat_dir));
+
+	uint64_t address;
+	while (ret == 0 && chain_span(&cur, &v->bpb, &address) != 0)
+	{
+		struct fat_dir dir;
+		if (image_pread(v->img, address, &dir, sizeof(struct fat_dir)) != 0)
+		{
+			ret = -errno;
+			break;
+		}
+		if (dir.name[0] == '\0')
+			break;
+
+		(*cookie)++;
+		chain_advance(&cur, &v->bpb, sizeof(struct fat_dir));
+
+		if (dir.name[0] != DIR_FREE_ENTRY && !dentry_hidden(&dir))
+		{
+			fill_stat(&dir, st);
+			ret = 1;
+		}
+	}
+
+	chain_free(&root);
+	pthread_rwlock_unlock(&v->lock);
+	return ret;
+}
+
+int obese32_stat(struct obese32 *v, const char *name, struct obese32_stat *st)
+{
+	struct dentry d;
+
+	pthread_rwlock_rdlock(&v->lock);
+	int ret = lookup(v, name, &d);
+	pthread_rwlock_unlock(&v->lock);
+
+	if (ret == 0)
+		fill_stat(&d.dir, st);
+
+	return ret;
+}
+
+ssize_t obese32_pread(struct obese32 *v, const char *name, void *buf, size_t len, uint64_t offset)
+{
+	struct dentry d;
+	struct chain  file = { 0 };
+
+	pthread_rwlock_rdlock(&v->lock);
+
+	ssize_t ret = lookup(v, name, &d);
+	if (ret == 0 && offset < d.dir.file_size)
+	{
+		/* O intervalo pedido, cortado no fim do arquivo */
+		uint64_t left = d.dir.file_size - offset;
+		len = len < left ? len : left;
+
+		if (chain_lookup(v->img, fat_dir_cluster(&d.dir), &file) != 0)
+			ret = -errno;
+	}
+	else
+		len = 0;
+
+	struct chain_cursor cur;
+	chain_begin(&cur, &file);
+	chain_seek(&cur, &v->bpb, offset);
+
+	uint8_t *p = buf;
+	while (ret >= 0 && (size_t) ret < len)
+	{
+		uint64_t address, span = chain_span(&cur, &v->bpb, &address);
+		if (span == 0)
+		{
+			ret = -EIO; // Cadeia menor que o arquivo
+			break;
+		}
+		span = span < len - ret ? span : len - ret;
+
+		if (image_pread(v->img, address, p + ret, span) != 0)
+		{
+			ret = -errno;
+			break;
+		}
+
+		ret += span;
+		chain_advance(&cur, &v->bpb, span);
+	}
+
+	chain_free(&file);
+	pthread_rwlock_unlock(&v->lock);
+	return ret;
+}
+
+/* Alterações */
+
+/* Volume aberto com OBESE32_RDONLY: as alterações param antes de mexer na FAT em memória. */
+static bool read_only(struct obese32 *v)
+{
+	return v->img->flags & IMAGE_RDONLY;
+}
+
+ssize_t obese32_pwrite(struct obese32 *v, const char *name, const void *buf, size_t len, uint64_t offset)
+{
+	/* O tamanho de um arquivo FAT32 cabe em 32 bits. */
+	if (offset > UINT32_MAX || len > UINT32_MAX - offset)
+		return -EFBIG;
+	if (read_only(v))
+		return -EROFS;
+
+	struct dentry d;
+	struct chain  file = { 0 };
+	uint32_t first = 0, last = 0; // Clusters novos, e o antigo fim da cadeia a que foram emendados
+
+	pthread_rwlock_wrlock(&v->lock);
+
+	int ret = lookup(v, name, &d);
+	if (ret != 0 || len == 0)
+		goto out;
+
+	if (d.dir.attr & DIR_ATTR_DIRECTORY)
+	{
+		ret = -EISDIR;
+		goto out;
+	}
+
+	uint64_t end  = offset + len;
+	uint32_t size = d.dir.file_size;
+
+	if (chain_lookup(v->img, fat_dir_cluster(&d.dir), &file) != 0)
+	{
+		ret = -errno;
+		goto out;
+	}
+
+	/* Faltam clusters: a cadeia nova vem do alocador de trechos e é emendada no fim. */
+	uint32_t need = (end + v->cluster_width - 1) / v->cluster_width;
+	if (need > file.clusters)
+	{
+		first = fat32_alloc_chain(v->img, &v->bpb, need - file.clusters, NULL, NULL);
+		if (first == 0)
+		{
+			ret = -errno;
+			goto out;
+		}
+
+		if (file.count == 0)
+		{
+			d.dir.starting_cluster_low = first & 0xFFFF;
+			d.dir.ea_index             = first >> 16;
+		}
+		else if (fat_set(v->img->fat, chain_last(&file), first) != 0)
+		{
+			ret = -errno;
+			goto out;
+		}
+		else
+			last = chain_last(&file);
+
+		if (chain_lookup(v->img, fat_dir_cluster(&d.dir), &file) != 0)
+		{
+			ret = -errno;
+			goto out;
+		}
+	}
+
+	if (offset > size)
+		ret = data_write(v, &file, size, NULL, offset - size);
+	if (ret == 0)
+		ret = data_write(v, &file, offset, buf, len);
+
+	if (ret == 0)
+	{
+		d.dir.file_size = end > size ? end : size;
+		ret = dentry_store(v, &d);
+	}
+
+out:
+	/*
+	 * Em erro depois de alocar, a entrada continua com o tamanho antigo: a
+	 * cadeia volta a acabar onde acabava, e os clusters novos são liberados.
+	 */
+	if (ret != 0 && first != 0)
+	{
+		if (last != 0)
+			(void) fat_set(v->img->fat, last, FAT32_EOF_HI);
+		(void) free_chain(v, first);
+	}
+
+	chain_free(&file);
+	pthread_rwlock_unlock(&v->lock);
+	return ret == 0 ? (ssize_t) len : ret;
+}
+
+int obese32_create(struct obese32 *v, const char *name)
+{
+	char rname[FAT32STR_SIZE_WNULL];
+	int ret = name_in(name, rname);
+	if (ret != 0)
+		return ret;
+	if (read_only(v))
+		return -EROFS;
+
+	struct dentry d;
+	uint64_t slot = 0;
+	size_t index;
+
+	pthread_rwlock_wrlock(&v->lock);
+
+	ret = dir_find(v, rname, &d);
+	if (ret > 0)
+		ret = -EEXIST;
+
+	/* Com o diretório cheio, ele ganha mais um cluster, zerado, no fim da cadeia. */
+	if (ret == 0 && (slot = dir_free_slot(v->img, &v->bpb, v->bpb.root_cluster, &index)) == 0)
+		ret = -errno;
+
+	if (ret == 0)
+	{
+		memset(&d, 0, sizeof(struct dentry));
+		memcpy(d.dir.name, rname, FAT32STR_SIZE);
+		d.dir.attr = DIR_ATTR_ARCHIVE;
+		d.index    = index;
+		d.address  = slot;
+		ret = dentry_store(v, &d);
+	}
+
+	if (ret == 0)
+		dir_index_update(v->img, v->bpb.root_cluster, NULL, rname, d.index, d.address);
+
+	pthread_rwlock_unlock(&v->lock);
+	return ret;
+}
+
+int obese32_unlink(struct obese32 *v, const char *name)
+{
+	if (read_only(v))
+		return -EROFS;
+
+	struct dentry d;
+
+	pthread_rwlock_wrlock(&v->lock);
+
+	int ret = lookup(v, name, &d);
+	if (ret == 0 && (d.dir.attr & DIR_ATTR_DIRECTORY))
+		ret = -EISDIR;
+
+	if (ret == 0)
+	{
+		/* Primeiro a entrada some, depois os clusters voltam a ser livres. */
+		char rname[FAT32STR_SIZE];
+		memcpy(rname, d.dir.name, FAT32STR_SIZE);
+
+		d.dir.name[0] = DIR_FREE_ENTRY;
+		ret = dentry_store(v, &d);
+		if (ret == 0)
+		{
+			dir_index_update(v->img, v->bpb.root_cluster, rname, NULL, d.index, d.address);
+			ret = free_chain(v, fat_dir_cluster(&d.dir));
+		}
+	}
+
+	pthread_rwlock_unlock(&v->lock);
+	return ret;
+}
+
+int obese32_rename(struct obese32 *v, const char *from, const char *to)
+{
+	char rname[FAT32STR_SIZE_WNULL];
+	int ret = name_in(to, rname);
+	if (ret != 0)
+		return ret;
+	if (read_only(v))
+		return -EROFS;
+
+	struct dentry d, existing;
+
+	pthread_rwlock_wrlock(&v->lock);
+
+	ret = lookup(v, from, &d);
+	if (ret == 0 && memcmp(d.dir.name, rname, FAT32STR_SIZE) != 0)
+	{
+		ret = dir_find(v, rname, &existing);
+		if (ret > 0)
+			ret = -EEXIST;
+	}
+
+	if (ret == 0)
+	{
+		char old[FAT32STR_SIZE];
+		memcpy(old, d.dir.name, FAT32STR_SIZE);
+
+		memcpy(d.dir.name, rname, FAT32STR_SIZE);
+		ret = dentry_store(v, &d);
+		if (ret == 0)
+			dir_index_update(v->img, v->bpb.root_cluster, old, rname, d.index, d.address);
+	}
+
+	pthread_rwlock_unlock(&v->lock);
+	return ret;
+}
+
+/* Verificação */
+
+/* Marca os clusters da cadeia em `seen`, contando os que já estavam marcados. */
+static void check_mark(const struct chain *c, uint8_t *seen, struct obese32_check *report)
+{
+	for (size_t i = 0; i < c->count; i++)
+		for (uint32_t cluster = c->extents[i].first; cluster < c->extents[i].first + c->extents[i].length; cluster++)
+		{
+			if (seen[cluster / 8] & (1 << cluster % 8))
+				report->cross_links++;
+			seen[cluster / 8] |= 1 << cluster % 8;
+		}
+}
+
+/* Setores das cópias espelhadas da FAT que diferem da primeira delas */
+static int check_fat_copies(struct obese32 *v, struct obese32_check *report)
+{
+	struct fat_table *t = v->img->fat;
+	if (t->copies < 2)
+		return 0;
+
+	uint8_t *first = malloc(IMAGE_BUFSZ), *other = malloc(IMAGE_BUFSZ);
+	int ret = first == NULL || other == NULL ? -ENOMEM : 0;
+
+	uint64_t base = t->address + t->first_copy * t->copy_size;
+	for (uint64_t done = 0; done < t->copy_size && ret == 0; done += IMAGE_BUFSZ)
+	{
+		uint32_t n = t->copy_size - done < IMAGE_BUFSZ ? t->copy_size - done : IMAGE_BUFSZ;
+		if (image_pread(v->img, base + done, first, n) != 0)
+			ret = -errno;
+
+		for (uint8_t k = 1; k < t->copies && ret == 0; k++)
+		{
+			if (image_pread(v->img, base + k * t->copy_size + done, other, n) != 0)
+				ret = -errno;
+			else
+				for (uint32_t off = 0; off < n; off += t->sector_size)
+					if (memcmp(first + off, other + off, t->sector_size) != 0)
+						report->fat_mismatch++;
+		}
+	}
+
+	free(other);
+	free(first);
+	return ret;
+}
+
+int obese32_check(struct obese32 *v, struct obese32_check *report)
+{
+	memset(report, 0, sizeof(struct obese32_check));
+
+	pthread_rwlock_rdlock(&v->lock);
+
+	struct fat_table *t = v->img->fat;
+	uint8_t *seen = calloc(t->limit / 8 + 1, 1);
+	struct chain root = { 0 }, file = { 0 };
+	int ret = seen == NULL ? -ENOMEM : 0;
+
+	/* Sem o diretório raiz inteiro não há como saber o dono de cada cluster. */
+	if (ret == 0 && chain_resolve(t, v->bpb.root_cluster, &root) != 0)
+		ret = -errno;
+
+	if (ret == 0)
+		check_mark(&root, seen, report);
+
+	struct chain_cursor cur;
+	chain_begin(&cur, &root);
+
+	uint64_t address;
+	while (ret == 0 && chain_span(&cur, &v->bpb, &address) != 0)
+	{
+		struct fat_dir dir;
+		if (image_pread(v->img, address, &dir, sizeof(struct fat_dir)) != 0)
+		{
+			ret = -errno;
+			break;
+		}
+		if (dir.name[0] == '\0')
+			break;
+		chain_advance(&cur, &v->bpb, sizeof(struct fat_dir));
+
+		if (dir.name[0] == DIR_FREE_ENTRY || dentry_hidden(&dir))
+			continue;
+
+		report->files++;
+		if (chain_resolve(t, fat_dir_cluster(&dir), &file) != 0)
+		{
+			if (errno != ELOOP)
+				ret = -errno;
+			report->bad_chains++;
+			continue;
+		}
+
+		/* O tamanho de um diretório é 0; a cadeia é que diz quanto ele ocupa. */
+		uint32_t need = (dir.file_size + (uint64_t) v->cluster_width - 1) / v->cluster_width;
+		if (!(dir.attr & DIR_ATTR_DIRECTORY) && file.clusters != need)
+			report->bad_chains++;
+
+		check_mark(&file, seen, report);
+	}
+
+	for (uint32_t cluster = 2; ret == 0 && cluster < t->limit; cluster++)
+		if (fat_get(t, cluster) != 0)
+		{
+			report->used++;
+			if (!(seen[cluster / 8] & (1 << cluster % 8)))
+				report->lost++;
+		}
+
+	if (ret == 0)
+		ret = check_fat_copies(v, report);
+
+	chain_free(&file);
+	chain_free(&root);
+	free(seen);
+	pthread_rwlock_unlock(&v->lock);
+	return ret;
+}
@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include "output.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -32,20 +33,17 @@ static struct pretty_int { int num; char* suff; } pretty_print(int value)
 	return res;
 }
 
-void show_files(struct fat_dir *dirs)
+void show_files(struct dir_iter *it)
 {
 
-	struct fat_dir *cur;
+	const struct fat_dir *cur;
 
 	fprintf(stdout, "ATTR  NAME    FMT    SIZE\n-------------------------\n");
 
-    while ((cur = dirs++) != NULL)
+    while ((cur = dir_next(it)) != NULL) // NULL na última entrada
 	{
 
-		if (cur->name[0] == 0) // Última entrada
-            break;
-
-        else if ((cur->name[0] == DIR_FREE_ENTRY) || (cur->attr == DIR_FREE_ENTRY))
+        if ((cur->name[0] == DIR_FREE_ENTRY) || (cur->attr == DIR_FREE_ENTRY))
             continue;
 
 		if (cur->attr == 0x0F) // Entrada de LFN
@@ -84,9 +82,9 @@ void verbose(struct fat_bpb *bios_pb)
     fprintf(stdout, "Sector per track: %d\n", bios_pb->sect_per_track);
     fprintf(stdout, "Number of heads: %d\n", bios_pb->number_of_heads);
 
-    fprintf(stdout, "FAT Address: 0x%x\n", bpb_faddress(bios_pb));
-    fprintf(stdout, "Root Address: 0x%x\n", bpb_froot_addr(bios_pb));
-    fprintf(stdout, "Data Address: 0x%x\n", bpb_fdata_addr(bios_pb));
+    fprintf(stdout, "FAT Address: 0x%" PRIx64 "\n", bpb_faddress(bios_pb));
+    fprintf(stdout, "Root Address: 0x%" PRIx64 "\n", bpb_froot_addr(bios_pb));
+    fprintf(stdout, "Data Address: 0x%" PRIx64 "\n", bpb_fdata_addr(bios_pb));
 
 	return;
 }
@@ -34,8 +34,8 @@ bool cstr_to_fat32wnull(char *filename, char output[FAT32STR_SIZE_WNULL])
 
 	strptr = dot;
 	strptr++;
-	for(i=8; i < 11; strptr++, i++){
-		output[i] = *strptr;
+	for(i=8; i < 11; i++){
+		output[i] = *strptr != '\0' ? *strptr++ : ' ';
 	}
 
 	output[11] = '\0';
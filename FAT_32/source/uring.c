@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct uring
+{
+	int fd;
+	unsigned entries;
+	unsigned to_submit; // Enfileiradas desde o último uring_submit()
+
+	/* Fila de submissão */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+
+	/* Fila de conclusão */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void  *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+};
+
+struct uring *uring_open(unsigned depth)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	struct uring *r = calloc(1, sizeof(struct uring));
+	if (r == NULL)
+		return NULL;
+
+	r->fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (r->fd < 0)
+	{
+		free(r);
+		return NULL;
+	}
+
+	r->entries = p.sq_entries;
+	r->sq_len  = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len  = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	/* Kernels novos mapeiam as duas filas de uma vez só. */
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ptr = r->sq_ptr;
+	else
+	{
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED)
+			goto fail;
+	}
+
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	uint8_t *sq = r->sq_ptr, *cq = r->cq_ptr;
+
+	r->sq_head  = (unsigned *) (sq + p.sq_off.head);
+	r->sq_tail  = (unsigned *) (sq + p.sq_off.tail);
+	r->sq_mask  = (unsigned *) (sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) (sq + p.sq_off.array);
+	r->cq_head  = (unsigned *) (cq + p.cq_off.head);
+	r->cq_tail  = (unsigned *) (cq + p.cq_off.tail);
+	r->cq_mask  = (unsigned *) (cq + p.cq_off.ring_mask);
+	r->cqes     = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	return r;
+
+fail:
+	if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_len);
+	if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+	close(r->fd);
+	free(r);
+	return NULL;
+}
+
+void uring_close(struct uring *r)
+{
+	if (r == NULL)
+		return;
+
+	munmap(r->sqes, r->sqes_len);
+	if (r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_len);
+	munmap(r->sq_ptr, r->sq_len);
+	close(r->fd);
+	free(r);
+}
+
+static int prep(struct uring *r, int opcode, int fd, const void *buf, unsigned len, uint64_t offset, uint64_t user_data)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+	if (tail - head >= r->entries)
+		return -1;
+
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = opcode;
+	sqe->fd        = fd;
+	sqe->addr      = (uint64_t) (uintptr_t) buf;
+	sqe->len       = len;
+	sqe->off       = offset;
+	sqe->user_data = user_data;
+
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+
+	return 0;
+}
+
+int uring_prep_read(struct uring *r, int fd, void *buf, unsigned len, uint64_t offset, uint64_t user_data)
+{
+	return prep(r, IORING_OP_READ, fd, buf, len, offset, user_data);
+}
+
+int uring_prep_write(struct uring *r, int fd, const void *buf, unsigned len, uint64_t offset, uint64_t user_data)
+{
+	return prep(r, IORING_OP_WRITE, fd, buf, len, offset, user_data);
+}
+
+int uring_submit(struct uring *r, unsigned wait_nr)
+{
+	unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+	long ret;
+
+	do ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait_nr, flags, NULL, 0);
+	while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return -1;
+
+	r->to_submit -= ret;
+	return 0;
+}
+
+int uring_reap(struct uring *r, uint64_t *user_data, int32_t *res)
+{
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		return 0;
+
+	struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+	*user_data = cqe->user_data;
+	*res       = cqe->res;
+
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Estado de cada buffer de cluster durante uring_copy_chain() */
+enum slot_state { SLOT_FREE, SLOT_READING, SLOT_READY, SLOT_WRITING };
+
+struct slot
+{
+	enum slot_state state;
+	uint8_t *data;
+	unsigned len;
+	unsigned io_len; // len arredondado para o alinhamento do O_DIRECT
+	uint64_t dst; // Endereço de destino na imagem (modo cp)
+};
+
+#define OP_READ  0
+#define OP_WRITE 1
+
+/* Escreve tudo em fd, repetindo em escritas parciais (pipes) */
+static int write_all(int fd, const uint8_t *p, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) return -1;
+		p += n; len -= n;
+	}
+
+	return 0;
+}
+
+int uring_copy_chain(struct fat_image *img, struct fat_bpb *bpb,
+                     uint32_t src, uint32_t dst, int out_fd, uint64_t size)
+{
+	const unsigned depth = img->ring_depth;
+	const unsigned cluster_width = bpb->bytes_p_sect * bpb->sector_p_clust;
+
+	/* O modo é decidido uma vez: `dst` avança pela cadeia e pode chegar ao fim antes dos dados. */
+	const bool to_image = dst != 0;
+
+	struct uring *r = img->ring;
+	struct slot *slots = calloc(depth, sizeof(struct slot));
+	uint8_t *pool = image_alloc(img, (size_t) depth * cluster_width);
+
+	if (slots == NULL || pool == NULL)
+	{
+		free(slots);
+		free(pool);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (unsigned i = 0; i < depth; i++)
+		slots[i].data = pool + (size_t) i * cluster_width;
+
+	/* Nada pendente nos buffers da camada pode ficar de fora do que o anel vê. */
+	int ret = image_sync_buffers(img);
+
+	uint64_t submitted = 0;       // Bytes cujas leituras já foram enfileiradas
+	uint64_t seq_submit = 0;      // Próximo cluster (na ordem do arquivo) a ler
+	uint64_t seq_output = 0;      // Próximo cluster a ir para out_fd (modo cat)
+	unsigned in_flight = 0;         // Buffers ocupados
+	unsigned ops = 0;               // Operações enfileiradas e ainda não concluídas
+
+	while (ret == 0 && (submitted < size || in_flight > 0))
+	{
+		/* Segue a cadeia à frente dos dados, enquanto houver buffer livre. */
+		while (submitted < size && slots[seq_submit % depth].state == SLOT_FREE)
+		{
+			struct slot *s = &slots[seq_submit % depth];
+			uint64_t remaining = size - submitted;
+
+			/* Cadeia de destino mais curta que os dados */
+			if (to_image && (dst < 2 || dst >= FAT32_EOF_LO))
+			{
+				errno = EIO;
+				ret = -1;
+				break;
+			}
+
+			s->len = remaining < cluster_width ? remaining : cluster_width;
+			s->io_len = (s->len + img->align - 1) / img->align * img->align;
+			s->dst = to_image ? cluster_to_address(dst, bpb) : 0;
+
+			if (uring_prep_read(r, img->fd, s->data, s->io_len, cluster_to_address(src, bpb),
+			                    (seq_submit % depth) << 1 | OP_READ) != 0)
+				break;
+
+			s->state = SLOT_READING;
+			in_flight++;
+			ops++;
+			submitted += s->len;
+			seq_submit++;
+
+			src = next_cluster(img, bpb, src);
+			if (to_image)
+				dst = next_cluster(img, bpb, dst);
+		}
+
+		if (uring_submit(r, ops > 0) != 0)
+		{
+			ret = -1;
+			break;
+		}
+
+		uint64_t user_data;
+		int32_t res;
+
+		while (uring_reap(r, &user_data, &res))
+		{
+			struct slot *s = &slots[user_data >> 1];
+			ops--;
+
+			if (res < 0 || (unsigned) res != s->io_len)
+			{
+				errno = res < 0 ? -res : EIO;
+				ret = -1;
+			}
+
+			if ((user_data & 1) == OP_READ && to_image && ret == 0)
+			{
+				/* Leitura pronta: o mesmo buffer segue para a escrita no destino. */
+				s->state = SLOT_WRITING;
+				if (uring_prep_write(r, img->fd, s->data, s->io_len, s->dst, user_data | OP_WRITE) == 0)
+					ops++;
+				else
+				{
+					errno = EBUSY;
+					ret = -1;
+				}
+			}
+			else if ((user_data & 1) == OP_READ && s->state == SLOT_READING && ret == 0)
+				s->state = SLOT_READY;
+			else
+			{
+				/* Escrita no destino concluída: a cópia em cache, se houver, ficou velha. */
+				if ((user_data & 1) == OP_WRITE)
+					image_invalidate(img, s->dst, s->io_len);
+				s->state = SLOT_FREE;
+				in_flight--;
+			}
+		}
+
+		/* Em modo cat, os clusters saem em ordem assim que ficam prontos. */
+		while (ret == 0 && !to_image && slots[seq_output % depth].state == SLOT_READY)
+		{
+			struct slot *s = &slots[seq_output % depth];
+
+			if (write_all(out_fd, s->data, s->len) != 0)
+				ret = -1;
+
+			s->state = SLOT_FREE;
+			in_flight--;
+			seq_output++;
+		}
+	}
+
+	/* Em erro, espera o que ainda está em voo antes de liberar os buffers. */
+	while (ret != 0 && ops > 0)
+	{
+		uint64_t user_data;
+		int32_t res;
+
+		if (uring_submit(r, 1) != 0)
+			break;
+		while (uring_reap(r, &user_data, &res))
+			ops--;
+	}
+
+	free(slots);
+	free(pool);
+	return ret;
+}
@@ -0,0 +1,210 @@
+/*
+ * Cache de blocos: write-back, descarga agrupada, descarte LRU e coerência
+ * com a E/S que passa por fora dela, sobre um "disco" em memória. No fim, o
+ * mesmo pela camada de imagem, com pedidos maiores que IMAGE_BYPASS.
+ */
+#include "cache.h"
+#include "image.h"
+#include "check.h"
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DISK (64 * CACHE_BLOCK)
+
+struct disk
+{
+	uint8_t data[DISK];
+	int     reads, writes;
+};
+
+static int disk_read(void *ctx, uint64_t offset, void *buf, size_t len)
+{
+	struct disk *d = ctx;
+	CHECK(offset + len <= DISK);
+	memcpy(buf, d->data + offset, len);
+	d->reads++;
+	return 0;
+}
+
+static int disk_write(void *ctx, uint64_t offset, void *buf, size_t len)
+{
+	struct disk *d = ctx;
+	CHECK(offset + len <= DISK);
+	memcpy(d->data + offset, buf, len);
+	d->writes++;
+	return 0;
+}
+
+static void test_cache(void)
+{
+	static struct disk d;
+	for (size_t i = 0; i < DISK; i++)
+		d.data[i] = i * 7;
+
+	/* Quatro blocos de orçamento */
+	struct block_cache *c = cache_create(4 * CACHE_BLOCK, 1, DISK, disk_read, (cache_io_fn) disk_write, &d);
+	CHECK(c != NULL && c->capacity == 4);
+
+	/* Leitura que cruza dois blocos: duas faltas, depois acertos */
+	uint8_t buf[2 * CACHE_BLOCK];
+	CHECK(cache_read(c, CACHE_BLOCK - 10, buf, 20) == 0);
+	CHECK(memcmp(buf, d.data + CACHE_BLOCK - 10, 20) == 0);
+	CHECK(c->misses == 2 && c->hits == 0 && d.reads == 2);
+	CHECK(cache_read(c, CACHE_BLOCK, buf, 5) == 0);
+	CHECK(c->hits == 1 && d.reads == 2);
+
+	/* Write-back: nada chega ao disco antes da descarga */
+	memset(buf, 0xAB, sizeof(buf));
+	CHECK(cache_write(c, 0, buf, CACHE_BLOCK) == 0);
+	CHECK(cache_write(c, CACHE_BLOCK, buf, CACHE_BLOCK) == 0);
+	CHECK(cache_write(c, 2 * CACHE_BLOCK, buf, 100) == 0);
+	CHECK(d.writes == 0 && d.data[0] != 0xAB);
+
+	/* Leitura por fora da cache vê o que está sujo */
+	uint8_t big[3 * CACHE_BLOCK];
+	memcpy(big, d.data, sizeof(big));
+	cache_overlay(c, 0, big, sizeof(big));
+	CHECK(big[0] == 0xAB && big[2 * CACHE_BLOCK + 99] == 0xAB && big[2 * CACHE_BLOCK + 100] == d.data[2 * CACHE_BLOCK + 100]);
+
+	/* Os três blocos sujos são vizinhos: uma escrita só */
+	uint64_t writebacks = c->writebacks;
+	CHECK(cache_flush(c) == 0);
+	CHECK(d.writes == 1 && c->writebacks == writebacks + 1);
+	CHECK(d.data[0] == 0xAB && d.data[2 * CACHE_BLOCK + 99] == 0xAB);
+	CHECK(cache_flush(c) == 0 && d.writes == 1);
+
+	/* Escrita por fora: as cópias em cache acompanham */
+	memset(buf, 0x11, CACHE_BLOCK);
+	memcpy(d.data + CACHE_BLOCK, buf, CACHE_BLOCK);
+	cache_update(c, CACHE_BLOCK, buf, CACHE_BLOCK);
+	CHECK(cache_read(c, CACHE_BLOCK + 7, buf + CACHE_BLOCK, 1) == 0 && buf[CACHE_BLOCK] == 0x11);
+
+	/* LRU: com a cache cheia, o bloco usado há mais tempo sai, escrito antes se sujo */
+	uint8_t b = 0x5A;
+	CHECK(cache_write(c, 3 * CACHE_BLOCK, &b, 1) == 0);  // do mais antigo ao mais novo: 0, 2, 1, 3
+	CHECK(cache_read(c, 0, buf, 1) == 0);                // 2, 1, 3, 0
+	int reads = d.reads;
+	CHECK(cache_read(c, 10 * CACHE_BLOCK, buf, 1) == 0); // sai o 2 (limpo)
+	CHECK(cache_read(c, 11 * CACHE_BLOCK, buf, 1) == 0); // sai o 1 (limpo)
+	CHECK(d.reads == reads + 2 && d.writes == 1);
+	CHECK(cache_read(c, 12 * CACHE_BLOCK, buf, 1) == 0); // sai o 3 (sujo)
+	CHECK(d.writes == 2 && d.data[3 * CACHE_BLOCK] == 0x5A);
+	CHECK(cache_read(c, 0, buf, 1) == 0 && d.reads == reads + 3);
+
+	/* Invalidado, o bloco volta a ser lido do disco */
+	d.data[0] = 0x77;
+	cache_invalidate(c, 0, 1);
+	CHECK(cache_read(c, 0, buf, 1) == 0 && buf[0] == 0x77);
+
+	cache_destroy(c);
+}
+
+static void test_image_bypass(void)
+{
+	char *path = test_path("cache.img");
+	CHECK(path != NULL);
+	CHECK(test_image(path, 2048, 1) == 0);
+
+	struct fat_image *img = image_open(path, 0);
+	CHECK(img != NULL);
+
+	const uint64_t base = 512 * 1024;
+	const size_t   len  = 4 * IMAGE_BYPASS;
+	uint8_t *big = malloc(len), *back = malloc(len);
+	CHECK(big != NULL && back != NULL);
+
+	/* Pequena escrita fica suja na cache; a leitura grande (direto do disco) tem de vê-la. */
+	uint8_t b = 0xC3;
+	CHECK(image_pwrite(img, base + 1000, &b, 1) == 0);
+	CHECK(image_pread(img, base, back, len) == 0);
+	CHECK(back[1000] == 0xC3 && back[999] == 0);
+
+	/* Escrita grande por cima: a leitura pequena (pela cache) vê os dados novos. */
+	for (size_t i = 0; i < len; i++)
+		big[i] = i % 251;
+	CHECK(image_pwrite(img, base, big, len) == 0);
+	CHECK(image_pread(img, base + 1000, &b, 1) == 0 && b == 1000 % 251);
+
+	/* E a descarga do bloco sujo não grava por cima da escrita grande. */
+	CHECK(image_flush(img) == 0);
+	CHECK(image_close(img) == 0);
+
+	img = image_open(path, 0);
+	CHECK(img != NULL);
+	CHECK(image_pread(img, base, back, len) == 0);
+	CHECK(memcmp(back, big, len) == 0);
+	CHECK(image_close(img) == 0);
+
+	free(big);
+	free(back);
+	unlink(path);
+	free(path);
+}
+
+/*
+ * Uma thread incrementa um contador com escritas pequenas (pela cache) e
+ * descargas; outra o lê com leituras grandes (por fora da cache e sem a
+ * trava). O valor lido nunca pode voltar atrás.
+ */
+#define BUMPS 20000
+
+struct race
+{
+	struct fat_image *img;
+	uint64_t          at;
+};
+
+static void *bump(void *arg)
+{
+	struct race *r = arg;
+
+	for (uint32_t v = 1; v <= BUMPS; v++)
+	{
+		CHECK(image_pwrite(r->img, r->at, &v, sizeof(v)) == 0);
+		if (v % 3 == 0)
+			CHECK(image_flush(r->img) == 0);
+	}
+
+	return NULL;
+}
+
+static void test_image_race(void)
+{
+	char *path = test_path("race.img");
+	CHECK(path != NULL);
+	CHECK(test_image(path, 2048, 1) == 0);
+
+	struct race r = { image_open(path, 0), 600 * 1024 + 100 };
+	CHECK(r.img != NULL);
+
+	const size_t len = 2 * IMAGE_BYPASS;
+	uint8_t *buf = malloc(len);
+	CHECK(buf != NULL);
+
+	pthread_t writer;
+	CHECK(pthread_create(&writer, NULL, bump, &r) == 0);
+
+	uint32_t seen = 0, v;
+	while (seen < BUMPS)
+	{
+		CHECK(image_pread(r.img, r.at - 100, buf, len) == 0);
+		memcpy(&v, buf + 100, sizeof(v));
+		CHECK(v >= seen);
+		seen = v;
+	}
+
+	CHECK(pthread_join(writer, NULL) == 0);
+	CHECK(image_close(r.img) == 0);
+	free(buf);
+	unlink(path);
+	free(path);
+}
+
+int main(void)
+{
+	test_cache();
+	test_image_bypass();
+	test_image_race();
+	return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Mapa de cadeias: uma cadeia fragmentada vira os trechos certos, chain_seek()
+ * cai no byte certo de qualquer posição (conferido lendo os dados gravados na
+ * imagem), o mapa em cache é refeito quando a FAT muda e ciclos dão ELOOP.
+ * Roda nas duas representações da FAT.
+ */
+#include "fat32.h"
+#include "fattable.h"
+#include "chain.h"
+#include "check.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Clusters do arquivo, na ordem da cadeia */
+static const uint32_t clusters[] = { 10, 11, 12, 20, 21, 5, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 13 };
+#define NCLUSTERS (sizeof(clusters) / sizeof(clusters[0]))
+
+/* Trechos esperados: (first, length, index) */
+static const struct chain_extent extents[] = {
+	{ 10, 3, 0 }, { 20, 2, 3 }, { 5, 1, 5 }, { 30, 10, 6 }, { 13, 1, 16 },
+};
+#define NEXTENTS (sizeof(extents) / sizeof(extents[0]))
+
+/* Byte `offset` do arquivo */
+static uint8_t pattern(uint64_t offset)
+{
+	return (uint8_t) ((offset * 2654435761u) >> 13);
+}
+
+static void check(int flags)
+{
+	char *path = test_path("chain.img");
+	CHECK(path != NULL);
+	CHECK(test_image(path, 4096, 1) == 0);
+
+	struct fat_bpb bpb;
+	struct fat_image *img = test_open(path, flags, &bpb);
+
+	const uint32_t width = bpb.bytes_p_sect * bpb.sector_p_clust;
+	const uint64_t size  = (uint64_t) NCLUSTERS * width;
+	uint8_t buf[4096];
+
+	/* Cadeia e dados */
+	for (size_t i = 0; i < NCLUSTERS; i++)
+	{
+		CHECK(fat_set(img->fat, clusters[i], i + 1 < NCLUSTERS ? clusters[i + 1] : FAT32_EOF_HI) == 0);
+
+		for (uint32_t j = 0; j < width; j++)
+			buf[j] = pattern((uint64_t) i * width + j);
+		CHECK(image_pwrite(img, cluster_to_address(clusters[i], &bpb), buf, width) == 0);
+	}
+
+	struct chain c;
+	memset(&c, 0, sizeof(c));
+	CHECK(chain_resolve(img->fat, clusters[0], &c) == 0);
+	CHECK(c.start == clusters[0] && c.clusters == NCLUSTERS && c.count == NEXTENTS);
+	for (size_t i = 0; i < NEXTENTS; i++)
+	{
+		CHECK(c.extents[i].first == extents[i].first);
+		CHECK(c.extents[i].length == extents[i].length);
+		CHECK(c.extents[i].index == extents[i].index);
+	}
+
+	/* Qualquer faixa, a partir de qualquer posição, lida pelos trechos */
+	struct chain_cursor cur;
+	chain_begin(&cur, &c);
+
+	for (uint64_t offset = 0; offset < size; offset += 37)
+	{
+		uint64_t want = size - offset < 1500 ? size - offset : 1500, done = 0;
+
+		chain_seek(&cur, &bpb, offset);
+		while (done < want)
+		{
+			uint64_t address, span = chain_span(&cur, &bpb, &address);
+			CHECK(span > 0);
+
+			uint64_t n = span < want - done ? span : want - done;
+			CHECK(image_pread(img, address, buf, n) == 0);
+			for (uint64_t k = 0; k < n; k++)
+				CHECK(buf[k] == pattern(offset + done + k));
+
+			chain_advance(&cur, &bpb, n);
+			done += n;
+		}
+	}
+
+	/* Além do fim, não há trecho. */
+	uint64_t address;
+	chain_seek(&cur, &bpb, size);
+	CHECK(chain_span(&cur, &bpb, &address) == 0);
+	chain_seek(&cur, &bpb, size - 1);
+	CHECK(chain_span(&cur, &bpb, &address) == 1);
+	CHECK(address == cluster_to_address(13, &bpb) + width - 1);
+
+	/* A cache acompanha a FAT: o arquivo cresce um cluster. */
+	const struct chain *cached = chain_get(img, clusters[0]);
+	CHECK(cached != NULL && cached->clusters == NCLUSTERS);
+	CHECK(fat_set(img->fat, 13, 40) == 0);
+	CHECK(fat_set(img->fat, 40, FAT32_EOF_HI) == 0);
+	cached = chain_get(img, clusters[0]);
+	CHECK(cached != NULL && cached->clusters == NCLUSTERS + 1 && cached->count == NEXTENTS + 1);
+	CHECK(cached->extents[NEXTENTS].first == 40 && cached->extents[NEXTENTS].index == NCLUSTERS);
+
+	/* Ciclo */
+	CHECK(fat_set(img->fat, 50, 51) == 0);
+	CHECK(fat_set(img->fat, 51, 50) == 0);
+	errno = 0;
+	CHECK(chain_resolve(img->fat, 50, &c) == -1 && errno == ELOOP);
+
+	chain_free(&c);
+	CHECK(image_close(img) == 0);
+	unlink(path);
+	free(path);
+}
+
+int main(void)
+{
+	check(0);
+	check(IMAGE_COMPACT_FAT);
+	return 0;
+}
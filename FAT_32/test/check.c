@@ -0,0 +1,114 @@
+#define _GNU_SOURCE
+#include "check.h"
+#include "fat32.h"
+#include "fattable.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+int test_image(const char *path, uint32_t sectors, uint8_t per_cluster)
+{
+	uint32_t clusters = sectors / per_cluster;
+	uint32_t per_fat  = (clusters * 4 + TEST_SECTOR - 1) / TEST_SECTOR + 1;
+
+	uint8_t *img = calloc(sectors, TEST_SECTOR);
+	if (img == NULL)
+		return -1;
+
+	/* BPB (os offsets são os de struct fat_bpb) */
+	memcpy(img, "\xEB\x58\x90" "TESTFAT ", 11);
+	put16(img + 11, TEST_SECTOR);
+	img[13] = per_cluster;
+	put16(img + 14, TEST_RESERVED);
+	img[16] = TEST_FATS;
+	img[21] = 0xF8;
+	put32(img + 32, sectors);
+	put32(img + 36, per_fat);
+	put32(img + 44, 2);  // root_cluster
+	put16(img + 48, 1);  // fs_info
+	put16(img + 50, 6);  // backup_boot_sector
+	img[66] = 0x29;
+	memcpy(img + 71, "NO NAME    FAT32   ", 19);
+	put16(img + 510, 0xAA55);
+
+	/* FSInfo: contagem desconhecida, a FAT em memória corrige na descarga */
+	uint8_t *fsinfo = img + TEST_SECTOR;
+	put32(fsinfo, 0x41615252);
+	put32(fsinfo + 484, 0x61417272);
+	put32(fsinfo + 488, 0xFFFFFFFF);
+	put32(fsinfo + 492, 2);
+
+	for (int k = 0; k < TEST_FATS; k++)
+	{
+		uint8_t *fat = img + (size_t) (TEST_RESERVED + k * per_fat) * TEST_SECTOR;
+		put32(fat, 0x0FFFFFF8);
+		put32(fat + 4, 0x0FFFFFFF);
+		put32(fat + 8, 0x0FFFFFFF); // Diretório raiz: um cluster
+	}
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	int ret = fd < 0 ? -1 : 0;
+	size_t len = (size_t) sectors * TEST_SECTOR;
+
+	for (size_t done = 0; ret == 0 && done < len; )
+	{
+		ssize_t n = write(fd, img + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			ret = -1;
+		else
+			done += n;
+	}
+
+	if (fd >= 0 && close(fd) != 0)
+		ret = -1;
+
+	free(img);
+	return ret;
+}
+
+char *test_path(const char *name)
+{
+	const char *dir = getenv("TMPDIR");
+	char *path;
+
+	if (asprintf(&path, "%s/obese32-%ld-%s", dir != NULL ? dir : "/tmp", (long) getpid(), name) < 0)
+		return NULL;
+
+	return path;
+}
+
+struct fat_image *test_open(const char *path, int flags, struct fat_bpb *bpb)
+{
+	struct fat_bpb local;
+	struct fat_image *img = image_open(path, flags);
+
+	CHECK(img != NULL);
+	CHECK(rfat(img, bpb != NULL ? bpb : &local) == 0);
+	return img;
+}
+
+void *test_claim_all(void *arg)
+{
+	struct test_claimer *c = arg;
+	uint32_t cluster;
+
+	while ((cluster = fat_claim(c->fat)) != 0)
+		c->got[c->n++] = cluster;
+
+	return NULL;
+}
@@ -0,0 +1,56 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Apoio dos testes de `make check`: cada teste é um executável que retorna 0
+ * se tudo passou. CHECK() para no primeiro erro, mostrando a condição.
+ */
+
+#define CHECK(cond)                                                               \
+	do                                                                            \
+	{                                                                             \
+		if (!(cond))                                                              \
+		{                                                                         \
+			fprintf(stderr, "%s:%d: falhou: %s\n", __FILE__, __LINE__, #cond);    \
+			exit(EXIT_FAILURE);                                                   \
+		}                                                                         \
+	} while (0)
+
+/* Geometria das imagens de teste */
+#define TEST_SECTOR   512
+#define TEST_RESERVED 32
+#define TEST_FATS     2
+
+/*
+ * Formata em `path` um FAT32 vazio de `sectors` setores de 512 bytes, com
+ * `per_cluster` setores por cluster, duas cópias da FAT, FSInfo no setor 1 e
+ * o diretório raiz no cluster 2. Retorna 0 ou -1 (com errno).
+ */
+int test_image(const char *path, uint32_t sectors, uint8_t per_cluster);
+
+/* Caminho de um arquivo temporário novo (em $TMPDIR ou /tmp); liberar com free(). */
+char *test_path(const char *name);
+
+struct fat_image;
+struct fat_bpb;
+struct fat_table;
+
+/* image_open() com `flags` e o BPB lido em `bpb` (se não for NULL); para no erro. */
+struct fat_image *test_open(const char *path, int flags, struct fat_bpb *bpb);
+
+/* Uma thread de test_claim_all(): os clusters que ela conseguiu com fat_claim() */
+struct test_claimer
+{
+	struct fat_table *fat;
+	uint32_t         *got; // Cabe todos os livres
+	size_t            n;
+};
+
+/* fat_claim() até o volume acabar; o argumento é uma struct test_claimer. */
+void *test_claim_all(void *arg);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Alocador concorrente: fat_claim() em várias threads nunca entrega o mesmo
+ * cluster duas vezes, esgota exatamente os livres, e o cursor de cada thread
+ * é guardado por tabela.
+ */
+#include "fat32.h"
+#include "fattable.h"
+#include "check.h"
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define THREADS 8
+
+/* Imagem nova de `sectors` setores, aberta */
+static struct fat_image *new_image(const char *name, uint32_t sectors, struct fat_bpb *bpb, char **path)
+{
+	*path = test_path(name);
+	CHECK(*path != NULL);
+	CHECK(test_image(*path, sectors, 1) == 0);
+	return test_open(*path, 0, bpb);
+}
+
+int main(void)
+{
+	struct fat_bpb bpb, small_bpb;
+	char *path, *small_path;
+	struct fat_image *img   = new_image("claim.img", 16384, &bpb, &path);
+	struct fat_image *small = new_image("claim-small.img", 2048, &small_bpb, &small_path);
+	struct fat_table *fat   = img->fat;
+
+	/* Cursor por tabela: alocar em outra imagem não muda onde esta continua. */
+	uint32_t a = fat_claim(fat);
+	uint32_t b = fat_claim(small->fat);
+	CHECK(a != 0 && b != 0);
+	CHECK(fat_claim(fat) == a + 1);
+	CHECK(fat_claim(small->fat) == b + 1);
+	fat_release(fat, a);
+	fat_release(fat, a + 1);
+	CHECK(fat_reserve(fat, a));
+	CHECK(!fat_reserve(fat, a));
+	fat_release(fat, a);
+
+	/* Várias threads até o volume acabar */
+	const uint32_t free_before = atomic_load(&fat->free_count);
+	CHECK(free_before == fat->limit - 3); // Tudo menos o diretório raiz
+
+	struct test_claimer claimers[THREADS];
+	pthread_t threads[THREADS];
+	for (int i = 0; i < THREADS; i++)
+	{
+		claimers[i] = (struct test_claimer) { fat, malloc(free_before * sizeof(uint32_t)), 0 };
+		CHECK(claimers[i].got != NULL);
+		CHECK(pthread_create(&threads[i], NULL, test_claim_all, &claimers[i]) == 0);
+	}
+
+	uint8_t *seen = calloc(fat->limit, 1);
+	size_t total = 0;
+	for (int i = 0; i < THREADS; i++)
+	{
+		CHECK(pthread_join(threads[i], NULL) == 0);
+		for (size_t k = 0; k < claimers[i].n; k++)
+		{
+			uint32_t c = claimers[i].got[k];
+			CHECK(c >= 3 && c < fat->limit);
+			CHECK(!seen[c]);
+			seen[c] = 1;
+		}
+		total += claimers[i].n;
+	}
+
+	CHECK(total == free_before);
+	CHECK(atomic_load(&fat->free_count) == 0);
+	CHECK(fat_claim(fat) == 0);
+	CHECK(fat_next_free(fat, 2) == 0);
+
+	/* Devolvidos, voltam a ser achados */
+	fat_release(fat, 100);
+	CHECK(fat_next_free(fat, 2) == 100);
+	CHECK(fat_claim(fat) == 100);
+	for (uint32_t c = 3; c < fat->limit; c++)
+		fat_release(fat, c);
+	CHECK(atomic_load(&fat->free_count) == free_before);
+
+	for (int i = 0; i < THREADS; i++)
+		free(claimers[i].got);
+	free(seen);
+
+	/* Nada foi gravado na FAT: só reservas, já devolvidas. */
+	CHECK(image_close(small) == 0);
+	CHECK(image_close(img) == 0);
+	unlink(small_path);
+	unlink(path);
+	free(small_path);
+	free(path);
+	return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * FAT compacta sem bitmap: o espaço livre montado dos trechos da FAT bate com
+ * o da expandida, e reservar, devolver e gravar entradas mantêm a contagem.
+ */
+#include "fat32.h"
+#include "fattable.h"
+#include "check.h"
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define THREADS 4
+
+int main(void)
+{
+	char *path = test_path("compact.img");
+	CHECK(path != NULL);
+	CHECK(test_image(path, 16384, 1) == 0);
+
+	struct fat_image *img = test_open(path, IMAGE_COMPACT_FAT, NULL);
+	struct fat_table *fat = img->fat;
+	const uint32_t empty = atomic_load(&fat->free_count);
+
+	CHECK(fat->entries == NULL && fat->free_map == NULL);
+	CHECK(empty == fat->limit - 3); // Tudo menos o diretório raiz
+
+	/*
+	 * Cadeias: 10..19 contígua; 30 -> 31 -> 40; 50 sozinho; e 60 -> 61 com 61
+	 * valendo 0, um trecho encadeado cuja última entrada é livre e encosta nos
+	 * livres seguintes.
+	 */
+	for (uint32_t c = 10; c < 19; c++)
+		CHECK(fat_set(fat, c, c + 1) == 0);
+	CHECK(fat_set(fat, 19, FAT32_EOF_HI) == 0);
+	CHECK(fat_set(fat, 30, 31) == 0);
+	CHECK(fat_set(fat, 31, 40) == 0);
+	CHECK(fat_set(fat, 40, FAT32_EOF_HI) == 0);
+	CHECK(fat_set(fat, 50, FAT32_EOF_HI) == 0);
+	CHECK(fat_set(fat, 60, 61) == 0);
+	CHECK(atomic_load(&fat->free_count) == empty - 15);
+	CHECK(image_close(img) == 0);
+
+	/* Recarregada: trechos e contagem vêm dos trechos da FAT. */
+	img = test_open(path, IMAGE_COMPACT_FAT, NULL);
+	fat = img->fat;
+	struct fat_image *full = test_open(path, 0, NULL);
+
+	CHECK(fat->free_map == NULL && full->fat->free_map != NULL);
+	CHECK(atomic_load(&fat->free_count) == empty - 15);
+	CHECK(atomic_load(&full->fat->free_count) == empty - 15);
+	CHECK(fat->free_extents.count == full->fat->free_extents.count);
+	CHECK(fat_table_memory(fat) < fat_table_memory(full->fat));
+
+	for (uint32_t c = 2; c < fat->limit; c++)
+		CHECK(fat_next_free(fat, c) == fat_next_free(full->fat, c));
+	CHECK(fat_next_free(fat, 10) == 20);
+	CHECK(fat_next_free(fat, 60) == 61);
+
+	/* Best-fit entre [3, 10), [20, 30), [32, 40), [41, 50), [51, 60)... */
+	CHECK(fat_find_free_run(fat, 7) == 3);
+	CHECK(fat_find_free_run(fat, 8) == 32);
+	CHECK(fat_find_free_run(fat, 10) == 20);
+	CHECK(fat_find_free_run(fat, fat->limit) == 0);
+	CHECK(image_close(full) == 0);
+
+	/* Reserva: sai dos trechos, e gravar o cluster não conta de novo. */
+	uint32_t c = fat_claim(fat);
+	CHECK(c >= 2 && c < fat->limit);
+	CHECK(!fat_reserve(fat, c));
+	CHECK(fat_next_free(fat, c) != c);
+	CHECK(atomic_load(&fat->free_count) == empty - 16);
+	CHECK(fat_set(fat, c, FAT32_EOF_HI) == 0);
+	CHECK(atomic_load(&fat->free_count) == empty - 16);
+
+	/* Liberar volta direto aos trechos; devolver de novo não conta duas vezes. */
+	CHECK(fat_set(fat, c, 0) == 0);
+	CHECK(atomic_load(&fat->free_count) == empty - 15);
+	fat_release(fat, c);
+	CHECK(atomic_load(&fat->free_count) == empty - 15);
+	CHECK(fat_reserve(fat, c));
+	fat_release(fat, c);
+	fat_release(fat, 10); // Em uso: ignorado
+	CHECK(atomic_load(&fat->free_count) == empty - 15);
+
+	/* Várias threads até o volume acabar */
+	const uint32_t free_before = atomic_load(&fat->free_count);
+	struct test_claimer claimers[THREADS];
+	pthread_t threads[THREADS];
+
+	for (int i = 0; i < THREADS; i++)
+	{
+		claimers[i] = (struct test_claimer) { fat, malloc(free_before * sizeof(uint32_t)), 0 };
+		CHECK(claimers[i].got != NULL);
+		CHECK(pthread_create(&threads[i], NULL, test_claim_all, &claimers[i]) == 0);
+	}
+
+	uint8_t *seen = calloc(fat->limit, 1);
+	size_t total = 0;
+	CHECK(seen != NULL);
+
+	for (int i = 0; i < THREADS; i++)
+	{
+		CHECK(pthread_join(threads[i], NULL) == 0);
+		for (size_t k = 0; k < claimers[i].n; k++)
+		{
+			uint32_t got = claimers[i].got[k];
+			CHECK(got >= 2 && got < fat->limit && fat_get(fat, got) == 0);
+			CHECK(!seen[got]);
+			seen[got] = 1;
+		}
+		total += claimers[i].n;
+	}
+
+	CHECK(total == free_before);
+	CHECK(atomic_load(&fat->free_count) == 0 && fat->free_extents.count == 0);
+	CHECK(fat_next_free(fat, 2) == 0);
+
+	for (uint32_t k = 2; k < fat->limit; k++)
+		fat_release(fat, k);
+	CHECK(atomic_load(&fat->free_count) == free_before);
+
+	for (int i = 0; i < THREADS; i++)
+		free(claimers[i].got);
+	free(seen);
+
+	CHECK(image_close(img) == 0);
+	unlink(path);
+	free(path);
+	return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Índice de nomes do diretório: depois de criações, remoções e renomeações
+ * pela biblioteca, cada busca bate com uma varredura linear do diretório em
+ * disco; e, pela API interna, as buscas usam mesmo o índice mantido por
+ * dir_index_update() (uma entrada gravada sem aviso não é achada).
+ */
+#include "obese32.h"
+#include "fat32.h"
+#include "directory.h"
+#include "support.h"
+#include "check.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILES 300 /* Com 16 entradas por cluster, o diretório cresce várias vezes. */
+
+/* Nome do usuário para o nome no formato FAT32 */
+static void fat_name(const char *name, char out[FAT32STR_SIZE_WNULL])
+{
+	char copy[OBESE32_NAME_MAX];
+	strcpy(copy, name);
+	CHECK(!cstr_to_fat32wnull(copy, out));
+}
+
+/* Primeira entrada válida com `name`, lendo o diretório inteiro: 1, 0, ou -1 em erro. */
+static int linear_find(struct fat_image *img, struct fat_bpb *bpb, const char *name, size_t *index)
+{
+	struct dir_iter it;
+	const struct fat_dir *entry;
+	int found = 0;
+
+	CHECK(dir_open(&it, img, bpb, bpb->root_cluster) == 0);
+	while (!found && (entry = dir_next(&it)) != NULL)
+	{
+		if (entry->name[0] == DIR_FREE_ENTRY || entry->attr == DIR_ATTR_LFN || (entry->attr & DIR_ATTR_VOLUMEID))
+			continue;
+		if (memcmp(entry->name, name, FAT32STR_SIZE) == 0)
+		{
+			*index = it.index;
+			found  = 1;
+		}
+	}
+
+	int ret = it.error != 0 ? -1 : found;
+	dir_close(&it);
+	return ret;
+}
+
+/* Todos os nomes, existentes ou não: obese32_stat() contra a varredura em `disk`. */
+static void compare(struct obese32 *vol, const char *path)
+{
+	struct fat_bpb bpb;
+	struct fat_image *disk = test_open(path, 0, &bpb);
+
+	for (int i = 0; i < FILES; i++)
+	{
+		for (int kind = 0; kind < 2; kind++)
+		{
+			char name[OBESE32_NAME_MAX], rname[FAT32STR_SIZE_WNULL];
+			struct obese32_stat st;
+			size_t index;
+
+			snprintf(name, sizeof(name), "%c%03d.TXT", kind ? 'R' : 'F', i);
+			fat_name(name, rname);
+
+			int want = linear_find(disk, &bpb, rname, &index);
+			int got  = obese32_stat(vol, name, &st);
+
+			CHECK(want >= 0);
+			CHECK(want ? got == 0 && strcmp(st.name, name) == 0 : got == -ENOENT);
+		}
+	}
+
+	CHECK(image_close(disk) == 0);
+}
+
+/* Pela biblioteca */
+static void library(const char *path)
+{
+	struct obese32 *vol;
+	char name[OBESE32_NAME_MAX], to[OBESE32_NAME_MAX];
+
+	CHECK(obese32_open(path, 0, &vol) == 0);
+
+	for (int i = 0; i < FILES; i++)
+	{
+		snprintf(name, sizeof(name), "F%03d.TXT", i);
+		CHECK(obese32_create(vol, name) == 0);
+	}
+	CHECK(obese32_create(vol, "F000.TXT") == -EEXIST);
+
+	/* Remove um em cada três, renomeia um em cada cinco, e recria alguns nos buracos. */
+	for (int i = 0; i < FILES; i++)
+	{
+		snprintf(name, sizeof(name), "F%03d.TXT", i);
+		snprintf(to, sizeof(to), "R%03d.TXT", i);
+
+		if (i % 3 == 0)
+			CHECK(obese32_unlink(vol, name) == 0);
+		else if (i % 5 == 0)
+			CHECK(obese32_rename(vol, name, to) == 0);
+	}
+	for (int i = 0; i < FILES; i += 9)
+	{
+		snprintf(name, sizeof(name), "R%03d.TXT", i);
+		CHECK(obese32_create(vol, name) == 0);
+	}
+
+	CHECK(obese32_flush(vol) == 0);
+	compare(vol, path);
+	CHECK(obese32_close(vol) == 0);
+}
+
+/* Pela API interna: o que o índice diz é o que foi avisado com dir_index_update(). */
+static void internal(const char *path)
+{
+	struct fat_bpb bpb;
+	struct fat_image *img = test_open(path, 0, &bpb);
+
+	char a[FAT32STR_SIZE_WNULL], b[FAT32STR_SIZE_WNULL];
+	struct dir_location loc;
+	size_t index;
+
+	fat_name("F001.TXT", a);
+	fat_name("NOVO.TXT", b);
+	CHECK(dir_index_find(img, &bpb, bpb.root_cluster, a, &loc) == 1); // Monta o índice
+	CHECK(linear_find(img, &bpb, a, &index) == 1 && loc.index == index);
+
+	/* Gravada sem aviso: o índice não a conhece. */
+	uint64_t slot = dir_free_slot(img, &bpb, bpb.root_cluster, &index);
+	CHECK(slot != 0);
+
+	struct fat_dir entry;
+	memset(&entry, 0, sizeof(entry));
+	memcpy(entry.name, b, FAT32STR_SIZE);
+	entry.attr = DIR_ATTR_ARCHIVE;
+	CHECK(image_pwrite(img, slot, &entry, sizeof(entry)) == 0);
+	CHECK(dir_index_find(img, &bpb, bpb.root_cluster, b, &loc) == 0);
+
+	/* Criação, renomeação e remoção avisadas */
+	dir_index_update(img, bpb.root_cluster, NULL, b, index, slot);
+	CHECK(dir_index_find(img, &bpb, bpb.root_cluster, b, &loc) == 1);
+	CHECK(loc.index == index && loc.address == slot);
+
+	CHECK(dir_index_find(img, &bpb, bpb.root_cluster, a, &loc) == 1);
+	size_t old_index = loc.index;
+	uint64_t old_address = loc.address;
+	struct fat_dir gone = loc.entry;
+	gone.name[0] = DIR_FREE_ENTRY;
+	CHECK(image_pwrite(img, old_address, &gone, sizeof(gone)) == 0);
+	dir_index_update(img, bpb.root_cluster, a, NULL, old_index, old_address);
+	CHECK(dir_index_find(img, &bpb, bpb.root_cluster, a, &loc) == 0);
+
+	fat_name("OUTRO.TXT", a);
+	memcpy(entry.name, a, FAT32STR_SIZE);
+	CHECK(image_pwrite(img, slot, &entry, sizeof(entry)) == 0);
+	dir_index_update(img, bpb.root_cluster, b, a, index, slot);
+	CHECK(dir_index_find(img, &bpb, bpb.root_cluster, b, &loc) == 0);
+	CHECK(dir_index_find(img, &bpb, bpb.root_cluster, a, &loc) == 1 && loc.address == slot);
+
+	CHECK(image_close(img) == 0);
+}
+
+int main(void)
+{
+	char *path = test_path("dirindex.img");
+	CHECK(path != NULL);
+	CHECK(test_image(path, 16384, 1) == 0);
+
+	library(path);
+	internal(path);
+
+	unlink(path);
+	free(path);
+	return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Varredura de diretórios: as versões SSE2 e AVX2 têm de dar o mesmo
+ * resultado que a escalar, em qualquer alinhamento e tamanho de trecho.
+ */
+#include "dirscan.h"
+#include "check.h"
+#include <string.h>
+
+#define ENTRIES 256
+
+static const char *names[] = { "A       TXT", "B       TXT", "A       TX ", "AB      TXT" };
+
+/* Diretório aleatório: nomes parecidos, entradas apagadas e às vezes uma marca de fim */
+static void fill(struct fat_dir *dir, unsigned seed)
+{
+	srand(seed);
+	memset(dir, 0, ENTRIES * sizeof(struct fat_dir));
+
+	for (size_t i = 0; i < ENTRIES; i++)
+	{
+		memcpy(dir[i].name, names[rand() % 4], FAT32STR_SIZE);
+		dir[i].attr = rand() % 2 ? DIR_ATTR_ARCHIVE : DIR_ATTR_LFN; // O atributo não faz parte do nome
+		if (rand() % 16 == 0)
+			dir[i].name[0] = DIR_FREE_ENTRY;
+		if (rand() % 4 == 0)
+			dir[i].name[FAT32STR_SIZE - 1] = rand() % 256;
+	}
+
+	if (seed % 2)
+		dir[rand() % ENTRIES].name[0] = '\0';
+}
+
+int main(void)
+{
+	static const enum dir_scan_isa isas[] = { DIR_SCAN_SSE2, DIR_SCAN_AVX2 };
+	static struct fat_dir dir[ENTRIES];
+	size_t want_name[ENTRIES], want_free[ENTRIES];
+
+	for (unsigned seed = 0; seed < 200; seed++)
+	{
+		fill(dir, seed);
+		const char *name = names[seed % 4];
+
+		/* Referência: a versão escalar, de cada posição até o fim */
+		CHECK(dir_scan_use(DIR_SCAN_SCALAR) == 0);
+		for (size_t at = 0; at < ENTRIES; at++)
+		{
+			want_name[at] = dir_scan_name(dir + at, ENTRIES - at, name);
+			want_free[at] = dir_scan_free(dir + at, ENTRIES - at);
+		}
+
+		for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); k++)
+		{
+			if (dir_scan_use(isas[k]) != 0)
+			{
+				if (seed == 0)
+					fprintf(stderr, "dirscan: conjunto %d indisponível, pulado\n", (int) isas[k]);
+				continue;
+			}
+
+			for (size_t at = 0; at < ENTRIES; at++)
+			{
+				CHECK(dir_scan_name(dir + at, ENTRIES - at, name) == want_name[at]);
+				CHECK(dir_scan_free(dir + at, ENTRIES - at) == want_free[at]);
+
+				/* Trechos curtos, que terminam no meio de um bloco do vetor */
+				size_t n = (at * 7) % 41;
+				if (at + n <= ENTRIES)
+				{
+					size_t wn = want_name[at] < n ? want_name[at] : n;
+					size_t wf = want_free[at] < n ? want_free[at] : n;
+					CHECK(dir_scan_name(dir + at, n, name) == wn);
+					CHECK(dir_scan_free(dir + at, n) == wf);
+				}
+			}
+		}
+	}
+
+	/* Um caso conhecido, em todas as implementações */
+	static const enum dir_scan_isa all[] = { DIR_SCAN_SCALAR, DIR_SCAN_SSE2, DIR_SCAN_AVX2 };
+	for (size_t i = 0; i < ENTRIES; i++)
+		memcpy(dir[i].name, names[1], FAT32STR_SIZE);
+	memcpy(dir[37].name, names[0], FAT32STR_SIZE);
+	dir[70].name[0] = DIR_FREE_ENTRY;
+	dir[100].name[0] = '\0';
+
+	for (size_t k = 0; k < sizeof(all) / sizeof(all[0]); k++)
+	{
+		if (dir_scan_use(all[k]) != 0)
+			continue;
+		CHECK(dir_scan_name(dir, ENTRIES, names[0]) == 37);
+		CHECK(dir_scan_name(dir, ENTRIES, names[2]) == 100);
+		CHECK(dir_scan_free(dir, ENTRIES) == 70);
+		CHECK(dir_scan_free(dir + 71, ENTRIES - 71) == 29);
+	}
+
+	return 0;
+}
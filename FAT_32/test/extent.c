@@ -0,0 +1,204 @@
+/*
+ * Conjunto de trechos livres: inserções e remoções aleatórias conferidas contra
+ * um mapa de bits simples, com as duas treaps em ordem e com prioridades de heap,
+ * e o plano de alocação checado (best-fit, sem sobreposição, soma exata).
+ */
+#include "extent.h"
+#include "check.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define CLUSTERS 4096
+#define ROUNDS   20000
+
+static bool model[CLUSTERS];
+
+/* Runs do modelo, em ordem de início */
+static size_t model_runs(struct extent *out)
+{
+	size_t n = 0;
+
+	for (uint32_t i = 0; i < CLUSTERS; )
+	{
+		if (!model[i])
+		{
+			i++;
+			continue;
+		}
+
+		uint32_t start = i;
+		while (i < CLUSTERS && model[i])
+			i++;
+		out[n++] = (struct extent) { start, i - start };
+	}
+
+	return n;
+}
+
+static bool length_less(const struct extent *a, const struct extent *b)
+{
+	return a->length < b->length || (a->length == b->length && a->start < b->start);
+}
+
+/* Percorre uma árvore em ordem, conferindo o heap de prioridades. */
+static void walk(const struct extent_node *n, int tree, struct extent *out, size_t *count)
+{
+	if (n == NULL)
+		return;
+
+	for (int dir = 0; dir < 2; dir++)
+		if (n->child[tree][dir] != NULL)
+			CHECK(n->child[tree][dir]->priority <= n->priority);
+
+	walk(n->child[tree][0], tree, out, count);
+	CHECK(*count < CLUSTERS);
+	out[(*count)++] = n->e;
+	walk(n->child[tree][1], tree, out, count);
+}
+
+static void check_set(struct extent_set *s)
+{
+	static struct extent want[CLUSTERS], got[CLUSTERS];
+	size_t n = model_runs(want), count;
+
+	CHECK(s->count == n);
+
+	count = 0;
+	walk(s->root[EXTENT_BY_START], EXTENT_BY_START, got, &count);
+	CHECK(count == n);
+	CHECK(memcmp(got, want, n * sizeof(struct extent)) == 0);
+
+	count = 0;
+	walk(s->root[EXTENT_BY_LENGTH], EXTENT_BY_LENGTH, got, &count);
+	CHECK(count == n);
+	for (size_t i = 1; i < n; i++)
+		CHECK(length_less(&got[i - 1], &got[i]));
+}
+
+static void check_plan(struct extent_set *s, uint32_t count)
+{
+	static struct extent runs[CLUSTERS], plan[CLUSTERS];
+	static bool taken[CLUSTERS];
+	size_t nruns = model_runs(runs);
+	uint64_t total = 0;
+	const struct extent *fit = NULL;
+
+	for (size_t i = 0; i < nruns; i++)
+	{
+		total += runs[i].length;
+		if (runs[i].length >= count && (fit == NULL || length_less(&runs[i], fit)))
+			fit = &runs[i];
+	}
+
+	size_t n = extent_set_plan(s, count, plan, CLUSTERS);
+
+	if (total < count)
+	{
+		CHECK(n == 0);
+		return;
+	}
+
+	CHECK(n > 0);
+
+	/* Se algum trecho comporta tudo, é o menor deles. */
+	if (fit != NULL)
+	{
+		CHECK(n == 1);
+		CHECK(plan[0].start == fit->start && plan[0].length == count);
+		return;
+	}
+
+	memset(taken, 0, sizeof(taken));
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < n; i++)
+	{
+		CHECK(plan[i].length > 0);
+		for (uint32_t c = plan[i].start; c < plan[i].start + plan[i].length; c++)
+		{
+			CHECK(c < CLUSTERS && model[c] && !taken[c]);
+			taken[c] = true;
+		}
+		sum += plan[i].length;
+	}
+
+	CHECK(sum == count);
+}
+
+int main(void)
+{
+	struct extent_set s;
+	uint32_t rng = 12345;
+
+	/* Resposta conhecida: best-fit entre 2..5 (4), 10..12 (3) e 20..29 (10). */
+	const struct extent known[] = { { 2, 4 }, { 10, 3 }, { 20, 10 } };
+	struct extent plan[4];
+
+	CHECK(extent_set_build(&s, known, 3) == 0);
+	CHECK(extent_set_plan(&s, 3, plan, 4) == 1 && plan[0].start == 10 && plan[0].length == 3);
+	CHECK(extent_set_plan(&s, 4, plan, 4) == 1 && plan[0].start == 2);
+	CHECK(extent_set_plan(&s, 12, plan, 4) == 2);
+	CHECK(plan[0].start == 20 && plan[0].length == 10 && plan[1].start == 10 && plan[1].length == 2);
+	CHECK(extent_set_plan(&s, 18, plan, 4) == 0);
+
+	/* Dividir no meio e juntar de volta os dois lados. */
+	CHECK(extent_set_erase(&s, 23, 2) == 0);
+	CHECK(s.count == 4);
+	CHECK(extent_set_erase(&s, 23, 1) == -1);
+	CHECK(extent_set_insert(&s, 23, 2) == 0);
+	CHECK(s.count == 3);
+	CHECK(extent_set_insert(&s, 6, 4) == 0);
+	CHECK(s.count == 2);
+	CHECK(extent_set_plan(&s, 11, plan, 4) == 1 && plan[0].start == 2);
+	extent_set_free(&s);
+
+	/* Aleatório, contra o modelo */
+	CHECK(extent_set_build(&s, NULL, 0) == 0);
+	memset(model, 0, sizeof(model));
+
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		rng ^= rng << 13;
+		rng ^= rng >> 17;
+		rng ^= rng << 5;
+
+		uint32_t start  = rng % CLUSTERS;
+		uint32_t length = 1 + (rng >> 12) % 16;
+		if (start + length > CLUSTERS)
+			length = CLUSTERS - start;
+
+		bool all_free = true, none_free = true;
+		for (uint32_t c = start; c < start + length; c++)
+		{
+			all_free  &= model[c];
+			none_free &= !model[c];
+		}
+
+		if (rng & 0x80000000u)
+		{
+			if (!none_free)
+				continue;
+			CHECK(extent_set_insert(&s, start, length) == 0);
+			memset(model + start, true, length);
+		}
+		else
+		{
+			CHECK(extent_set_erase(&s, start, length) == (all_free ? 0 : -1));
+			if (all_free)
+				memset(model + start, false, length);
+		}
+
+		if (round % 64 == 0)
+		{
+			check_set(&s);
+			check_plan(&s, 1 + rng % 64);
+		}
+	}
+
+	check_set(&s);
+	for (uint32_t count = 1; count < 200; count += 7)
+		check_plan(&s, count);
+
+	extent_set_free(&s);
+	return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * Cliente da biblioteca: só usa obese32.h e é ligado contra libobese32.a e
+ * libobese32.so, sem nenhum outro objeto do projeto.
+ */
+#include "obese32.h"
+#include "check.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+int main(void)
+{
+	char *path = test_path("link.img");
+	CHECK(path != NULL);
+	CHECK(test_image(path, 8192, 1) == 0);
+
+	struct obese32 *vol;
+	struct obese32_stat st;
+	CHECK(obese32_open("/nonexistent/obese32.img", 0, &vol) == -ENOENT);
+	CHECK(obese32_open(path, 0, &vol) == 0);
+
+	const char text[] = "libobese32\n";
+	CHECK(obese32_create(vol, "LIB.TXT") == 0);
+	CHECK(obese32_pwrite(vol, "lib.txt", text, sizeof(text), 0) == (ssize_t) sizeof(text));
+	/* Nomes sem extensão */
+	CHECK(obese32_create(vol, "README") == 0);
+	CHECK(obese32_stat(vol, "readme", &st) == 0 && strcmp(st.name, "README") == 0);
+	CHECK(obese32_unlink(vol, "README") == 0);
+	CHECK(obese32_create(vol, "TOOLONGNAME") == -EINVAL);
+	CHECK(obese32_create(vol, "") == -EINVAL);
+	CHECK(obese32_close(vol) == 0);
+
+	CHECK(obese32_open(path, OBESE32_RDONLY, &vol) == 0);
+
+	uint64_t cookie = 0;
+	CHECK(obese32_readdir(vol, &cookie, &st) == 1);
+	CHECK(strcmp(st.name, "LIB.TXT") == 0 && st.size == sizeof(text));
+	CHECK(obese32_readdir(vol, &cookie, &st) == 0);
+
+	char buf[64];
+	CHECK(obese32_pread(vol, "LIB.TXT", buf, sizeof(buf), 0) == (ssize_t) sizeof(text));
+	CHECK(memcmp(buf, text, sizeof(text)) == 0);
+
+	struct obese32_check report;
+	CHECK(obese32_check(vol, &report) == 0);
+	CHECK(report.files == 1 && report.bad_chains == 0 && report.lost == 0 && report.fat_mismatch == 0);
+	CHECK(obese32_create(vol, "RO.TXT") == -EROFS);
+	CHECK(obese32_close(vol) == 0);
+
+	unlink(path);
+	free(path);
+	return 0;
+}
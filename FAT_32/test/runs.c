@@ -0,0 +1,163 @@
+/*
+ * FAT compacta: fat_set() divide e junta trechos conferidos contra um vetor
+ * simples, desfazer as alterações volta ao mesmo número de trechos, e fat_get()
+ * e fat_follow() sem trava leem certo enquanto outra thread altera a tabela.
+ */
+#include "fat32.h"
+#include "fattable.h"
+#include "check.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FIRST  1000   /* Região alterada: [FIRST, LAST) */
+#define LAST   3000
+#define ROUNDS 40000
+
+static uint32_t len(const struct fat_run *r)
+{
+	return r->length & ~FAT_RUN_UNIFORM;
+}
+
+/* Valor de `cluster` no trecho `r`, como a tabela o interpreta */
+static uint32_t value(const struct fat_run *r, uint32_t cluster)
+{
+	if ((r->length & FAT_RUN_UNIFORM) || cluster == r->start + len(r) - 1)
+		return r->next;
+	return cluster + 1;
+}
+
+/* Trechos cobrem a tabela em ordem, sem buracos, e batem com o modelo. */
+static void check_runs(struct fat_table *fat, const uint32_t *model)
+{
+	size_t n = atomic_load(&fat->nruns);
+	const struct fat_run *runs = fat->runs;
+	uint32_t c = 0;
+
+	for (size_t i = 0; i < n; i++)
+	{
+		const struct fat_run *r = &runs[i];
+		CHECK(r->start == c && len(r) > 0);
+
+		for (; c < r->start + len(r); c++)
+			CHECK(value(r, c) == model[c]);
+
+		/* Nenhum par de vizinhos com mais de uma entrada poderia se juntar. */
+		if (i + 1 < n && len(r) > 1 && len(&runs[i + 1]) > 1)
+		{
+			const struct fat_run *b = &runs[i + 1];
+			bool a_uniform = r->length & FAT_RUN_UNIFORM, b_uniform = b->length & FAT_RUN_UNIFORM;
+
+			CHECK(!(a_uniform && b_uniform && r->next == b->next));
+			CHECK(!(!a_uniform && !b_uniform && r->next == b->start));
+		}
+	}
+
+	CHECK(c == fat->count);
+}
+
+static atomic_bool stop;
+
+/* Lê sem parar uma cadeia fora da região alterada. */
+static void *reader(void *arg)
+{
+	struct fat_table *fat = arg;
+	uint64_t reads = 0;
+
+	while (!atomic_load(&stop) || reads == 0)
+	{
+		uint32_t next;
+
+		CHECK(fat_follow(fat, 100, &next) == 100 && next == FAT32_EOF_HI);
+		CHECK(fat_follow(fat, 150, &next) == 50 && next == FAT32_EOF_HI);
+		CHECK(fat_get(fat, 199) == FAT32_EOF_HI);
+		CHECK(fat_get(fat, 300) == FAT32_EOF_HI);
+		CHECK(fat_get(fat, 301) == 0);
+		reads++;
+	}
+
+	return NULL;
+}
+
+int main(void)
+{
+	char *path = test_path("runs.img");
+	CHECK(path != NULL);
+	CHECK(test_image(path, 16384, 1) == 0);
+
+	struct fat_bpb bpb;
+	struct fat_image *img = test_open(path, IMAGE_COMPACT_FAT, &bpb);
+
+	struct fat_table *fat = img->fat;
+	CHECK(fat->entries == NULL && fat->limit > LAST);
+
+	uint32_t *model = malloc(fat->count * sizeof(uint32_t));
+	CHECK(model != NULL);
+	for (uint32_t c = 0; c < fat->count; c++)
+		model[c] = fat_get(fat, c);
+	check_runs(fat, model);
+
+	/* Cadeia 100..199 e o cluster 300, lidos pela outra thread */
+	for (uint32_t c = 100; c < 199; c++)
+		CHECK(fat_set(fat, c, model[c] = c + 1) == 0);
+	CHECK(fat_set(fat, 199, model[199] = FAT32_EOF_HI) == 0);
+	CHECK(fat_set(fat, 300, model[300] = FAT32_EOF_HI) == 0);
+	check_runs(fat, model);
+	const size_t base = atomic_load(&fat->nruns);
+
+	pthread_t thread;
+	CHECK(pthread_create(&thread, NULL, reader, fat) == 0);
+
+	/* Valores que tanto dividem quanto juntam trechos: encadeado, EOF, livre, salto. */
+	uint32_t rng = 2463534242u;
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		rng ^= rng << 13;
+		rng ^= rng >> 17;
+		rng ^= rng << 5;
+
+		uint32_t c = FIRST + rng % (LAST - FIRST), v;
+		switch ((rng >> 24) % 4)
+		{
+			case 0:  v = c + 1; break;
+			case 1:  v = FAT32_EOF_HI; break;
+			case 2:  v = 0; break;
+			default: v = FIRST + (rng >> 8) % (LAST - FIRST); break;
+		}
+
+		CHECK(fat_set(fat, c, v) == 0);
+		model[c] = v;
+
+		if (round % 4096 == 0)
+			check_runs(fat, model);
+	}
+
+	atomic_store(&stop, true);
+	CHECK(pthread_join(thread, NULL) == 0);
+	check_runs(fat, model);
+
+	/* fat_follow() contra o modelo */
+	for (uint32_t c = FIRST; c < LAST; c++)
+	{
+		uint32_t next, end = c;
+		while (model[end] == end + 1 && end + 1 < fat->count)
+			end++;
+
+		CHECK(fat_follow(fat, c, &next) == end - c + 1);
+		CHECK(next == model[end]);
+	}
+
+	/* Desfeito, tudo volta a se juntar. */
+	for (uint32_t c = FIRST; c < LAST; c++)
+		CHECK(fat_set(fat, c, model[c] = 0) == 0);
+	check_runs(fat, model);
+	CHECK(atomic_load(&fat->nruns) == base);
+	CHECK(fat->nretired > 0); // O vetor cresceu com os leitores ativos
+
+	free(model);
+	CHECK(image_close(img) == 0);
+	unlink(path);
+	free(path);
+	return 0;
+}